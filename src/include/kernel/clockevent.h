@@ -0,0 +1,58 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_CLOCKEVENT_H
+#define KIZNIX_INCLUDED_KERNEL_CLOCKEVENT_H
+
+#include <kernel/interrupt.h>
+#include <stdint.h>
+
+
+/*
+    Clock event devices interrupt a CPU once at a programmed time (one-shot). The kernel
+    only programs the next expiry it needs (end of time slice or nearest timer) and
+    doesn't program anything when there is nothing to do.
+
+    All functions must be called with interrupts disabled.
+*/
+
+
+// Select the best clock event device and start it on the boot processor.
+// 'handler' is called on the CPU that programmed the expiry.
+void clockevent_init(interrupt_handler_t handler);
+
+// Start the clock event device on an application processor
+void clockevent_init_ap();
+
+// Interrupt the current CPU at 'deadline' (nanoseconds, see timer_now()).
+// TIMER_INFINITE cancels any programmed expiry.
+void clockevent_set(uint64_t deadline);
+
+// Make sure the current CPU is interrupted no later than 'deadline'
+void clockevent_set_earlier(uint64_t deadline);
+
+
+#endif
@@ -0,0 +1,123 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_CPU_H
+#define KIZNIX_INCLUDED_KERNEL_CPU_H
+
+#include <kernel/defs.h>
+#include <kernel/pmm.h>
+#include <kernel/runqueue.h>
+#include <kernel/stack.h>
+#include <kernel/timer.h>
+#include <stddef.h>
+
+
+#define MAX_CPUS 32
+
+
+// Per-CPU data. Each CPU reaches its own structure through the GS segment.
+struct cpu
+{
+    cpu_t*              self;               // Pointer to this structure, must be first (see cpu_get())
+    int                 id;                 // Logical CPU number (0 is the boot processor)
+    int                 apic_id;            // Local APIC ID
+    volatile int        online;             // CPU is up and running the scheduler
+
+    thread_t*           current_thread;     // Thread running on this CPU
+    volatile int        current_rank;       // Urgency of 'current_thread' for other CPUs (see thread_rank())
+    runqueue_t          runqueue;           // Threads ready to run on this CPU
+    int                 spinlock_count;     // Number of spin locks held by this CPU
+    int                 interrupts_enabled; // Interrupt state before the first spin lock was taken
+    int                 preempt_count;      // preempt_disable() nesting plus interrupt handler nesting
+    volatile int        need_resched;       // Run the scheduler at the next preemption point (see preempt.h)
+    uint64_t            clockevent_deadline;// Programmed clock event expiry (TIMER_INFINITE if none)
+    timer_wheel_t       timers;             // Timers armed on this CPU
+
+    thread_t*           fpu_owner;          // Thread whose state was last loaded in the FPU registers
+    int                 fpu_active;         // CR0.TS is clear for the current thread (it used the FPU)
+    int                 fpu_kernel;         // Inside kernel_fpu_begin() / kernel_fpu_end()
+    int                 fpu_interrupts_enabled; // Interrupt state before kernel_fpu_begin()
+
+    uint32_t            latency_histogram[THREAD_LATENCY_BUCKETS]; // Run queue latency (see thread_dump_stats())
+    uint32_t            migrations_in;      // Threads moved to this CPU (load balancing, affinity)
+    uint32_t            migrations_out;     // Threads moved away from this CPU
+    thread_t*           migrating_thread;   // Switched out thread to move to another CPU (see thread_schedule())
+    volatile uint32_t   tlb_generation;     // Last smp_flush_tlb() request this CPU has carried out
+
+    thread_t*           idle_thread;        // Runs when the run queue is empty, never queued (see thread_idle())
+    volatile int        idle_polling;       // Idle thread waits in mwait on the run queue, wakeups need no IPI
+    uint64_t            idle_timestamp;     // TSC value when the idle thread took over
+    uint64_t            idle_cycles;        // Time spent halted (TSC cycles)
+    uint32_t            idle_wakeups;       // Number of times the CPU left the halted state
+
+    char*               stack_cache[STACK_CACHE_SIZE];  // Free kernel stacks (see stack.c)
+    int                 stack_cache_count;  // Number of stacks in 'stack_cache'
+
+    pmm_magazine_t      pmm_magazines[PMM_ZONE_COUNT];  // Free pages of each zone (see pmm.c)
+
+    char*               stack;              // Initial stack (application processors only)
+};
+
+
+extern cpu_t g_cpus[MAX_CPUS];
+extern int g_cpu_count;
+
+
+// Setup the GDT and per-CPU data for an application processor (cpu_init() does the boot processor)
+void cpu_init_ap(cpu_t* cpu);
+
+// Discover (ACPI MADT) and start the application processors
+void smp_init();
+
+// Ask another CPU to run the scheduler
+void smp_send_reschedule(cpu_t* cpu);
+
+// Flush the TLB of all online CPUs, returns once they all did. Call this after removing
+// mappings and before reusing the virtual space or the physical pages.
+void smp_flush_tlb();
+
+
+// Retrieve the current CPU. The caller must make sure it can't be migrated to another CPU
+// while using the result (i.e. interrupts disabled or holding a spin lock).
+static inline cpu_t* cpu_get()
+{
+    cpu_t* cpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+
+// Read a field of the current CPU's structure with a single instruction. This is safe
+// to use without disabling interrupts as the read can't be split by a migration.
+#define cpu_read(field) \
+    ({ \
+        __typeof__(((cpu_t*)0)->field) value; \
+        asm volatile ("mov %%gs:%P1, %0" : "=r"(value) : "i"(offsetof(cpu_t, field))); \
+        value; \
+    })
+
+
+#endif
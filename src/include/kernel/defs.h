@@ -30,10 +30,12 @@
 
 #include <stdint.h>
 
-typedef uint32_t spinlock_t;
+typedef struct spinlock spinlock_t;
+typedef struct cpu cpu_t;
 typedef struct semaphore semaphore_t;
 typedef struct mutex mutex_t;
 typedef struct thread thread_t;
+typedef struct waiter waiter_t;
 
 
 #endif
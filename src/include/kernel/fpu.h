@@ -0,0 +1,71 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_FPU_H
+#define KIZNIX_INCLUDED_KERNEL_FPU_H
+
+#include <kernel/defs.h>
+#include <stddef.h>
+
+
+#define FPU_STATE_ALIGNMENT 64      // Required alignment of save areas (XSAVE needs 64 bytes)
+
+
+/*
+    FPU / SIMD state is switched lazily. Each thread has a save area, but registers are
+    only restored when a thread actually executes an FPU or SIMD instruction (the #NM
+    trap), so threads that don't use them pay nothing on context switch.
+
+    Code that can't rely on the current thread's state (interrupt handlers, code running
+    with interrupts disabled) must wrap SIMD usage in kernel_fpu_begin() / kernel_fpu_end().
+*/
+
+
+// Detect the save format (XSAVE or FXSAVE) and enable lazy switching on the boot processor
+void fpu_init();
+
+// Enable lazy switching on an application processor
+void fpu_init_ap();
+
+// Size of a thread's save area
+size_t fpu_state_size();
+
+// Initialize a thread's FPU save area. 'state' is fpu_state_size() bytes aligned on
+// FPU_STATE_ALIGNMENT, it is owned by the caller.
+void fpu_thread_init(thread_t* thread, void* state);
+
+// Called by the scheduler on the current CPU right before switching away from 'thread'
+void fpu_switch(thread_t* thread);
+
+// Borrow the FPU / SIMD registers. Interrupts are disabled until kernel_fpu_end().
+// Calls can't be nested.
+void kernel_fpu_begin();
+
+// Give back the FPU / SIMD registers
+void kernel_fpu_end();
+
+
+#endif
@@ -43,6 +43,9 @@ typedef int (*interrupt_handler_t)(interrupt_context_t*);
 
 void interrupt_init();
 
+// Load the interrupt table on an application processor
+void interrupt_init_ap();
+
 // Register an interrupt service routine.
 // Returns 0 on error (there is already an interrupt handler for the specified interrupt)
 int interrupt_register(int interrupt, interrupt_handler_t handler);
@@ -45,6 +45,10 @@ void fatal(const char* format, ...) __attribute__ ((noreturn)) __attribute__ ((f
 void cpu_halt() __attribute__ ((noreturn));
 
 
+// Initialize the ACPI table manager (can be called early and more than once).
+// Returns 0 on success.
+int acpi_init_tables();
+
 // Initialize ACPI
 void acpi_init();
 
@@ -30,11 +30,20 @@
 #include <kernel/semaphore.h>
 
 
-// Currently implemented as a semaphore with a max count of 1
-// Will be eventually optimized.
+// Adaptive mutex: an uncontended lock/unlock is a single CAS on 'owner'. A contended
+// lock spins while the owner is running on another CPU and sleeps otherwise.
+// Waiters are queued by priority and ownership is handed directly to the first one on
+// unlock. The owner inherits the priority of its most urgent waiter, transitively
+// through chains of blocked owners.
+#define MUTEX_HAS_WAITERS 1     // Bit 0 of 'owner': the wait queue isn't empty
+
 struct mutex
 {
-    semaphore_t semaphore;
+    volatile uintptr_t  owner;      // Owning thread | MUTEX_HAS_WAITERS (0 when unlocked)
+    spinlock_t          lock;       // Lock protecting the wait queue
+    wait_queue_t        waiters;    // Threads waiting on the mutex (by priority)
+    thread_t*           pi_owner;   // Thread whose 'pi_mutexes' list has this mutex
+    mutex_t*            pi_next;    // Next mutex in that list
 };
 
 
@@ -43,4 +52,8 @@ void mutex_lock(mutex_t* mutex);
 int mutex_try_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+// Lock the mutex, giving up after 'timeout' nanoseconds (TIMER_INFINITE to wait forever).
+// Returns 1 if the mutex was acquired, 0 on timeout.
+int mutex_lock_timeout(mutex_t* mutex, uint64_t timeout);
+
 #endif
@@ -49,16 +49,59 @@ typedef uint64_t physaddr_t;
 // Is the specified pointer aligned on a page boundary?
 #define IS_PAGE_ALIGNED(p) (((uintptr_t)(p) & (PAGE_SIZE-1)) == 0)
 
+// Largest contiguous allocation is 2^PMM_MAX_ORDER pages (1 GB)
+#define PMM_MAX_ORDER   18
+#define PMM_ORDER_COUNT (PMM_MAX_ORDER + 1)
 
-// Initialize the Physical Memory Manager
+// Physical memory zones
+#define PMM_ZONE_DMA    0       // Below 16 MB (ISA DMA)
+#define PMM_ZONE_DMA32  1       // Below 4 GB (32 bits devices)
+#define PMM_ZONE_HIGH   2       // Everything else
+#define PMM_ZONE_COUNT  3
+
+#define PMM_MAGAZINE_SIZE   64      // Free pages kept by each CPU for each zone
+#define PMM_MAGAZINE_BATCH  16      // Pages moved between a magazine and its zone at once
+
+
+// Per-CPU cache of free pages from one zone (see cpu_t::pmm_magazines)
+typedef struct pmm_magazine pmm_magazine_t;
+
+struct pmm_magazine
+{
+    int         count;                          // Number of pages in 'pages'
+    physaddr_t  pages[PMM_MAGAZINE_SIZE];       // Most recently freed (cache hot) page last
+};
+
+
+// Initialize the Physical Memory Manager (after vmm_init())
 void pmm_init();
 
-// Allocate a physical page - will always succeed (or never return)
+// Allocate a physical page - will always succeed (or never return).
+// Single pages go through the current CPU's magazines and rarely touch the zones.
 physaddr_t pmm_alloc_page();
 
-// Free a physical page
+// Free a physical page (to the current CPU's magazine)
 void pmm_free_page(physaddr_t page);
 
+// Allocate 2^order physically contiguous pages, aligned on their size. Returns 0 if there is no such block.
+physaddr_t pmm_alloc_pages(int order);
+
+// Same as pmm_alloc_pages(), but only from 'zone' and the zones below it
+physaddr_t pmm_alloc_zone_pages(int zone, int order);
+
+// Free pages returned by pmm_alloc_pages(), 'order' must be the same
+void pmm_free_pages(physaddr_t address, int order);
+
+// Take a page from the pool of pre-zeroed pages. Returns 0 if the pool is empty, the
+// caller then uses pmm_alloc_page() and clears the page itself.
+physaddr_t pmm_take_zeroed_page();
+
+// Start the thread keeping the pre-zeroed pool filled (after thread_init())
+void pmm_init_zero_pool();
+
+// Print free blocks and fragmentation for each zone
+void pmm_dump_stats();
+
 
 
 #endif
@@ -0,0 +1,64 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_PREEMPT_H
+#define KIZNIX_INCLUDED_KERNEL_PREEMPT_H
+
+#include <kernel/cpu.h>
+
+
+/*
+    Kernel preemption
+
+    Interrupt handlers never switch threads themselves: they set cpu_t::need_resched and
+    the switch happens on the way out of the outermost interrupt. If the interrupted code
+    can't be preempted (preemption disabled, spin lock held or interrupts disabled), the
+    switch is deferred to the next preempt_enable() or to the release of the last spin lock.
+*/
+
+
+// Switch to another thread if a reschedule is pending and the current thread can be preempted
+void preempt_schedule();
+
+
+// Prevent the current thread from being preempted (calls nest)
+static inline void preempt_disable()
+{
+    asm volatile ("incl %%gs:%P0" : : "i"(offsetof(cpu_t, preempt_count)) : "memory");
+}
+
+
+// Allow preemption again, switching right away if a reschedule is pending
+static inline void preempt_enable()
+{
+    asm volatile ("decl %%gs:%P0" : : "i"(offsetof(cpu_t, preempt_count)) : "memory");
+
+    if (cpu_read(need_resched))
+        preempt_schedule();
+}
+
+
+#endif
@@ -0,0 +1,196 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_RUNQUEUE_H
+#define KIZNIX_INCLUDED_KERNEL_RUNQUEUE_H
+
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <stddef.h>
+
+
+// FIFO queue of threads linked through thread_t::next / thread_t::prev.
+typedef struct thread_queue thread_queue_t;
+
+struct thread_queue
+{
+    thread_t*   head;
+    thread_t*   tail;
+};
+
+
+// Run queue - the ready threads of one CPU, organized by scheduling class:
+//  - deadline threads sorted by absolute deadline
+//  - one FIFO queue per real-time priority level plus a bitmap of the non-empty ones
+//  - one FIFO queue per time-sharing priority level plus a bitmap of the non-empty ones
+// Each CPU has its own run queue, 'lock' must be held to access it. Other CPUs wake up
+// threads without the lock through 'wakelist', the owner moves them to the queues.
+typedef struct runqueue runqueue_t;
+
+struct runqueue
+{
+    // 'count' and 'wakelist' share the first cache line, monitored by the idle thread
+    int             count;                              // Number of threads in the run queue (written by every push)
+    thread_t*       wakelist;                           // Threads woken up by other CPUs (lock-free LIFO through thread_t::wake_next)
+    spinlock_t      lock;                               // Protects the run queue
+    thread_queue_t  deadline;                           // THREAD_CLASS_DEADLINE threads, earliest deadline first
+    uint32_t        dl_bandwidth;                       // Admitted deadline reservations (THREAD_DL_BANDWIDTH_UNIT is 100%)
+    uint32_t        rt_bitmap;                          // Bit N is set if rt_queues[N] isn't empty
+    thread_queue_t  rt_queues[THREAD_RT_PRIORITY_COUNT];// THREAD_CLASS_FIFO threads, one queue per priority
+    uint32_t        bitmap;                             // Bit N is set if queues[N] isn't empty
+    thread_queue_t  queues[THREAD_PRIORITY_COUNT];      // THREAD_CLASS_NORMAL threads, one queue per priority
+} __attribute__((aligned(64)));
+
+
+// Scheduling class interface. runqueue_push() / runqueue_pop() / runqueue_remove() dispatch
+// to the class of each thread, the scheduler uses the rest to decide when to switch.
+typedef struct sched_class
+{
+    const char* name;
+
+    // Queue a ready thread / remove a queued thread
+    void (*enqueue)(runqueue_t* runqueue, thread_t* thread);
+    void (*dequeue)(runqueue_t* runqueue, thread_t* thread);
+
+    // Return the most urgent thread of this class without removing it (NULL if none)
+    thread_t* (*peek)(const runqueue_t* runqueue);
+
+    // Compare two threads of this class (see thread_compare())
+    int (*compare)(const thread_t* a, const thread_t* b);
+
+    // Time at which the running 'thread' must give up the CPU (TIMER_INFINITE if never)
+    uint64_t (*slice_end)(const runqueue_t* runqueue, const thread_t* thread, uint64_t now);
+
+    // Charge 'ns' of run time to a thread (optional)
+    void (*charge)(thread_t* thread, uint64_t ns);
+
+    // A suspended thread is ready again (optional)
+    void (*wakeup)(thread_t* thread, uint64_t now);
+} sched_class_t;
+
+
+extern const sched_class_t* const g_sched_classes[THREAD_CLASS_COUNT];
+
+
+static inline const sched_class_t* sched_class(const thread_t* thread)
+{
+    return g_sched_classes[thread->sched_class];
+}
+
+
+
+static inline void thread_queue_init(thread_queue_t* queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+
+static inline int thread_queue_empty(const thread_queue_t* queue)
+{
+    return queue->head == NULL;
+}
+
+
+static inline void thread_queue_append(thread_queue_t* queue, thread_t* thread)
+{
+    thread->next = NULL;
+    thread->prev = queue->tail;
+
+    if (queue->tail)
+        queue->tail->next = thread;
+    else
+        queue->head = thread;
+
+    queue->tail = thread;
+}
+
+
+// Insert 'thread' before 'next' (which is in the queue)
+static inline void thread_queue_insert_before(thread_queue_t* queue, thread_t* thread, thread_t* next)
+{
+    thread->next = next;
+    thread->prev = next->prev;
+
+    if (next->prev)
+        next->prev->next = thread;
+    else
+        queue->head = thread;
+
+    next->prev = thread;
+}
+
+
+static inline void thread_queue_remove(thread_queue_t* queue, thread_t* thread)
+{
+    if (thread->prev)
+        thread->prev->next = thread->next;
+    else
+        queue->head = thread->next;
+
+    if (thread->next)
+        thread->next->prev = thread->prev;
+    else
+        queue->tail = thread->prev;
+
+    thread->next = NULL;
+    thread->prev = NULL;
+}
+
+
+static inline thread_t* thread_queue_pop(thread_queue_t* queue)
+{
+    thread_t* thread = queue->head;
+
+    if (thread)
+        thread_queue_remove(queue, thread);
+
+    return thread;
+}
+
+
+
+// Initialize an empty run queue
+void runqueue_init(runqueue_t* runqueue);
+
+// Queue a thread according to its class: at the end of the queue for its priority (O(1))
+// or in deadline order (O(n) in the number of deadline threads)
+void runqueue_push(runqueue_t* runqueue, thread_t* thread);
+
+// Remove and return the most urgent thread (NULL if empty) - O(1)
+thread_t* runqueue_pop(runqueue_t* runqueue);
+
+// Remove a specific thread from the run queue - O(1)
+void runqueue_remove(runqueue_t* runqueue, thread_t* thread);
+
+// Is the run queue empty?
+static inline int runqueue_empty(const runqueue_t* runqueue)
+{
+    return runqueue->count == 0;
+}
+
+
+#endif
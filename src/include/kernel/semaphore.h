@@ -28,23 +28,94 @@
 #define KIZNIX_INCLUDED_KERNEL_SEMAPHORE_H
 
 #include <kernel/spinlock.h>
+#include <stddef.h>
 
 
-typedef struct waiter waiter_t;
+typedef struct wait_queue wait_queue_t;
+
+
+#define WAITER_WAITING      0   // In the wait queue
+#define WAITER_WOKEN        1   // Removed from the wait queue by a wakeup
+#define WAITER_TIMED_OUT    2   // Removed from the wait queue by its timer
+
 
 struct waiter
 {
-    thread_t* thread;
-    waiter_t* next;
+    thread_t*       thread;
+    waiter_t*       next;
+    waiter_t*       prev;
+    volatile int    status;     // WAITER_XXX
+};
+
+
+// FIFO list of waiters, protected by the owning object's lock
+struct wait_queue
+{
+    waiter_t*   head;
+    waiter_t*   tail;
 };
 
 
+static inline void wait_queue_init(wait_queue_t* queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+
+static inline void wait_queue_append(wait_queue_t* queue, waiter_t* waiter)
+{
+    waiter->next = NULL;
+    waiter->prev = queue->tail;
+    waiter->status = WAITER_WAITING;
+
+    if (queue->tail)
+        queue->tail->next = waiter;
+    else
+        queue->head = waiter;
+
+    queue->tail = waiter;
+}
+
+
+// Insert 'waiter' before 'next' (which is in the queue)
+static inline void wait_queue_insert_before(wait_queue_t* queue, waiter_t* waiter, waiter_t* next)
+{
+    waiter->next = next;
+    waiter->prev = next->prev;
+
+    if (next->prev)
+        next->prev->next = waiter;
+    else
+        queue->head = waiter;
+
+    next->prev = waiter;
+}
+
+
+static inline void wait_queue_remove(wait_queue_t* queue, waiter_t* waiter)
+{
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        queue->head = waiter->next;
+
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    else
+        queue->tail = waiter->prev;
+
+    waiter->next = NULL;
+    waiter->prev = NULL;
+}
+
+
+
 struct semaphore
 {
-    spinlock_t  lock;   // Lock protecting the semaphore structure
-    int         count;  // Semaphore count
-    waiter_t*   head;   // Head of waiters list
-    waiter_t*   tail;   // Tail of waiters list
+    spinlock_t      lock;       // Lock protecting the semaphore structure
+    int             count;      // Semaphore count
+    wait_queue_t    waiters;    // Threads waiting on the semaphore
 };
 
 
@@ -53,5 +124,9 @@ void semaphore_lock(semaphore_t* semaphore);
 int semaphore_try_lock(semaphore_t* semaphore);
 void semaphore_unlock(semaphore_t* semaphore);
 
+// Lock the semaphore, giving up after 'timeout' nanoseconds (TIMER_INFINITE to wait forever).
+// Returns 1 if the semaphore was acquired, 0 on timeout.
+int semaphore_lock_timeout(semaphore_t* semaphore, uint64_t timeout);
+
 
 #endif
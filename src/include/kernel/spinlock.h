@@ -31,18 +31,58 @@
 #include <kernel/defs.h>
 
 
-#define SPINLOCK_UNLOCKED 0
-#define DEFINE_SPINLOCK(name) spinlock_t name = SPINLOCK_UNLOCKED
+typedef struct lockstat lockstat_t;
 
 
-//todo: move to a CPU object
-extern int g_spinLockCount;     // temp
-extern int g_interruptsEnabled; // temp
+// Ticket lock: each CPU takes a ticket ('next') and waits for 'owner' to reach it.
+// Waiters are served in FIFO order and only read the lock while spinning.
+struct spinlock
+{
+    union
+    {
+        volatile uint32_t value;
+        struct
+        {
+            volatile uint16_t owner;    // Ticket being served
+            volatile uint16_t next;     // Next ticket to hand out
+        } tickets;
+    };
 
+#if defined(KIZNIX_LOCKSTAT)
+    const char*     name;               // Lock class name, statistics are per class
+    lockstat_t*     stats;              // Statistics for this lock class (found on first use)
+    uint64_t        hold_start;         // TSC when the lock was last acquired
+#endif
+};
+
+
+#if defined(KIZNIX_LOCKSTAT)
+#define SPINLOCK_INIT(name) { { 0 }, #name, NULL, 0 }
+#else
+#define SPINLOCK_INIT(name) { { 0 } }
+#endif
+
+#define DEFINE_SPINLOCK(name) spinlock_t name = SPINLOCK_INIT(name)
+
+
+// Initialize a spin lock at run time. Locks sharing a name share statistics (can be NULL).
+void spin_lock_init(volatile spinlock_t* lock, const char* name);
 
 void spin_lock(volatile spinlock_t* lock);
 void spin_unlock(volatile spinlock_t* lock);
 
+// Try to acquire a spin lock without waiting. Returns 1 if the lock was acquired.
+int spin_trylock(volatile spinlock_t* lock);
+
+// Is the lock held (by anyone)?
+static inline int spin_is_locked(volatile spinlock_t* lock)
+{
+    return lock->tickets.owner != lock->tickets.next;
+}
+
+// Print contention statistics for all lock classes used so far (KIZNIX_LOCKSTAT builds only)
+void spin_lock_dump_stats();
+
 
 
 #endif
@@ -30,11 +30,35 @@
 #include <kernel/defs.h>
 #include <kernel/interrupt.h>
 
-typedef void (*thread_function_t)();
+typedef void (*thread_function_t)(void* argument);
 
 
 typedef struct thread_registers thread_registers_t;
 typedef enum thread_state thread_state_t;
+typedef enum thread_class thread_class_t;
+
+
+// Thread priorities - lower values are more urgent
+#define THREAD_PRIORITY_COUNT   32
+#define THREAD_PRIORITY_HIGHEST 0
+#define THREAD_PRIORITY_NORMAL  16
+#define THREAD_PRIORITY_LOWEST  (THREAD_PRIORITY_COUNT - 1)
+
+// Real-time (THREAD_CLASS_FIFO) priorities - lower values are more urgent
+#define THREAD_RT_PRIORITY_COUNT    32
+#define THREAD_RT_PRIORITY_HIGHEST  0
+#define THREAD_RT_PRIORITY_LOWEST   (THREAD_RT_PRIORITY_COUNT - 1)
+
+// Deadline (THREAD_CLASS_DEADLINE) reservations
+#define THREAD_DL_MAX_PERIOD        1000000000ull   // Longest period (ns)
+#define THREAD_DL_BANDWIDTH_UNIT    (1u << 20)      // Fixed point 100% of a CPU
+#define THREAD_DL_BANDWIDTH_MAX     (THREAD_DL_BANDWIDTH_UNIT * 95 / 100) // Admission limit per CPU
+
+// CPU affinity masks: bit N allows the thread to run on g_cpus[N] (see MAX_CPUS)
+#define THREAD_AFFINITY_ALL     0xFFFFFFFFu
+
+// Run queue latency histogram: bucket N counts waits of [2^N, 2^(N+1)) TSC cycles
+#define THREAD_LATENCY_BUCKETS  40
 
 
 enum thread_state
@@ -42,6 +66,20 @@ enum thread_state
     THREAD_RUNNING,
     THREAD_READY,
     THREAD_SUSPENDED,
+    THREAD_TERMINATED,      // Exited, waiting to be reaped
+    THREAD_MIGRATING,       // Ready, on its way to a CPU allowed by its affinity (in no run queue)
+};
+
+
+// Scheduling classes, most urgent first: a ready thread always runs before the threads
+// of the classes below its own (see runqueue.h).
+enum thread_class
+{
+    THREAD_CLASS_DEADLINE,  // Earliest deadline first, with a runtime budget per period
+    THREAD_CLASS_FIFO,      // Fixed real-time priority, runs until it blocks or yields
+    THREAD_CLASS_NORMAL,    // Time-sharing: priorities with round-robin time slices
+
+    THREAD_CLASS_COUNT
 };
 
 
@@ -76,20 +114,62 @@ struct thread_registers
 struct thread
 {
     thread_state_t          state;              // Scheduling state
-    char*                   stack;              // Kernel stack
+    int                     priority;           // Effective scheduling priority (THREAD_PRIORITY_XXX)
+    int                     base_priority;      // Priority set by thread_set_priority()
+    int                     inherited_priority; // Priority inherited through mutexes (THREAD_PRIORITY_COUNT if none)
+    thread_class_t          sched_class;        // Scheduling class (THREAD_CLASS_XXX)
+    int                     rt_priority;        // THREAD_CLASS_FIFO priority (THREAD_RT_PRIORITY_XXX)
+    uint64_t                dl_runtime;         // THREAD_CLASS_DEADLINE budget per period (ns)
+    uint64_t                dl_period;          // THREAD_CLASS_DEADLINE period, also the relative deadline (ns)
+    uint64_t                dl_deadline;        // Current absolute deadline (timer_now() time base)
+    int64_t                 dl_budget;          // Runtime left before the deadline is postponed (ns)
+    char*                   stack;              // Kernel stack (lowest address)
     interrupt_context_t*    interrupt_frame;    // Interrupt frame
     thread_registers_t*     context;            // Saved context (on the thread's stack)
+    thread_function_t       function;           // Thread function
+    void*                   argument;           // Argument passed to 'function'
+
+    cpu_t*                  cpu;                // CPU this thread runs on or is queued on
+    uint32_t                affinity;           // CPUs this thread is allowed to run on (THREAD_AFFINITY_ALL by default)
+    uint64_t                last_run;           // Time at which the thread last stopped running (ns)
+
+    uint64_t                timestamp;          // TSC value when the thread started running / waiting
+    uint64_t                run_cycles;         // Total time spent running (TSC cycles)
+    uint64_t                wait_cycles;        // Total time spent in run queues (TSC cycles)
+    uint32_t                voluntary_switches; // Switched out because it blocked or exited
+    uint32_t                involuntary_switches; // Switched out while still ready to run
+    thread_t*               list_next;          // Next thread in the list of all threads
+    thread_t*               list_prev;          // Previous thread in the list of all threads
+
+    void*                   fpu_state;          // FPU / SIMD save area (see fpu.h)
+    cpu_t*                  fpu_cpu;            // CPU whose registers were last loaded from 'fpu_state'
 
     thread_t*               next;               // Next thread in list
+    thread_t*               wake_next;          // Next thread in a CPU's wakelist (see runqueue.h)
+    thread_t*               prev;               // Previous thread in list
     semaphore_t*            blocker;            // What's blocking this thread
+    mutex_t*                blocked_on;         // Mutex this thread is waiting for (priority inheritance)
+    waiter_t*               mutex_waiter;       // Waiter queued on 'blocked_on'
+    mutex_t*                pi_mutexes;         // Owned mutexes that have waiters
 };
 
 
 // Initialize scheduler
 void thread_init();
 
-// Create a new thread
-thread_t* thread_create(thread_function_t user_thread_function);
+// Initialize the scheduler for an application processor
+void thread_init_ap();
+
+// Create a new thread running function(argument)
+thread_t* thread_create(thread_function_t function, void* argument);
+
+// Terminate the current thread. This is also what happens when a thread function returns.
+void thread_exit() __attribute__((noreturn));
+
+// Turn the CPU's boot flow of execution into its idle thread. The idle thread is never
+// queued: the scheduler picks it when the run queue is empty. It halts the CPU (mwait on
+// the run queue when available, hlt otherwise) until there is something to run.
+void thread_idle() __attribute__((noreturn));
 
 // Retrieve the currently running thread
 thread_t* thread_current();
@@ -97,15 +177,60 @@ thread_t* thread_current();
 // Thread context switch
 void thread_switch(thread_registers_t** old, thread_registers_t* new);
 
-// Suspend a thread
-void thread_suspend(semaphore_t* semaphore);
+// Suspend the current thread. 'lock' is a spin lock held by the caller that protects
+// the wait list the thread was queued on. It is released once the thread can no longer
+// miss a wakeup.
+void thread_suspend(volatile spinlock_t* lock);
+
+// Put the current thread to sleep for at least 'ns' nanoseconds. The resolution is that
+// of the timer wheel (TIMER_WHEEL_SHIFT).
+void thread_sleep_ns(uint64_t ns);
 
 // Wake up a thread
 void thread_wakeup(thread_t* thread);
 
+// Wake up a suspended thread and switch to it right away, releasing 'lock' (held by the
+// caller). The current thread stays ready to run. This falls back to thread_wakeup() when
+// switching isn't possible or wanted: interrupt context, other spin locks held, 'thread'
+// on another CPU or less urgent than the current thread.
+void thread_wakeup_switch(thread_t* thread, volatile spinlock_t* lock);
+
 // Yield the CPU to another thread
 void thread_yield();
 
+// Change the priority of a thread
+void thread_set_priority(thread_t* thread, int priority);
+
+// Set the priority a thread inherits from the waiters of its mutexes (see mutex.c).
+// The effective priority is the most urgent of this and the thread's own priority.
+void thread_set_inherited_priority(thread_t* thread, int priority);
+
+// Move a thread to the time-sharing class (the default), giving back any deadline reservation
+void thread_set_normal(thread_t* thread);
+
+// Move a thread to the fixed priority real-time class (THREAD_RT_PRIORITY_XXX). It preempts
+// all time-sharing threads and keeps its CPU until it blocks, yields or is preempted by a
+// more urgent real-time thread.
+void thread_set_fifo(thread_t* thread, int priority);
+
+// Move a thread to the deadline class: it is guaranteed 'runtime' ns of CPU time every
+// 'period' ns. Reservations are per CPU, so the thread is pinned to the CPU it is on. Returns
+// 0 if the reservation doesn't fit on that CPU (admission control) or is invalid, 1 otherwise.
+int thread_set_deadline(thread_t* thread, uint64_t runtime, uint64_t period);
+
+// Compare the urgency of two threads: < 0 if 'a' should preempt 'b', 0 if they should
+// share the CPU, > 0 if 'a' should wait.
+int thread_compare(const thread_t* a, const thread_t* b);
+
+// Restrict a thread to the CPUs in 'affinity' (bit N is g_cpus[N]). A thread running or
+// queued on a CPU that isn't allowed anymore is moved right away, a suspended one when it
+// wakes up. Deadline threads can't be moved. Returns 1 on success, 0 if 'affinity' contains
+// no online CPU.
+int thread_set_affinity(thread_t* thread, uint32_t affinity);
+
+// Print CPU accounting for all threads, idle residency and the run queue latency histogram
+void thread_dump_stats();
+
 
 #endif
 
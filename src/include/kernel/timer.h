@@ -28,9 +28,88 @@
 #define KIZNIX_INCLUDED_KERNEL_TIMER_H
 
 #include <kernel/interrupt.h>
+#include <kernel/spinlock.h>
+#include <stdint.h>
 
 
-void timer_init(int frequency, interrupt_handler_t callback);
+#define TIMER_INFINITE UINT64_MAX   // Timeout that never expires
+
+// Timer wheel geometry. A tick is 2^18 ns (~262 us), the wheel covers 64^4 ticks (~73 minutes).
+// Timers further away than that are parked in the last level and cascaded again.
+#define TIMER_WHEEL_SHIFT       18
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_SLOT_BITS   6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_SLOT_BITS)
+
+
+typedef struct timer timer_t;
+typedef struct timer_wheel timer_wheel_t;
+
+typedef void (*timer_function_t)(timer_t* timer);
+
+
+// Kernel timer. The function is called from the timer interrupt once the deadline is
+// reached. It runs with interrupts disabled and must not block.
+struct timer
+{
+    uint64_t            deadline;   // Expiration time (nanoseconds, see timer_now())
+    timer_function_t    function;   // Function to call on expiration
+    void*               context;    // User data
+    uint64_t            expires;    // Expiration tick (deadline rounded up to the wheel's resolution)
+    timer_wheel_t*      wheel;      // Wheel the timer was last added to
+    timer_t**           slot;       // Wheel slot holding the timer (NULL if not pending)
+    timer_t*            next;       // Next timer in slot
+    timer_t*            prev;       // Previous timer in slot
+};
+
+
+// Hierarchical timer wheel. Each CPU has one, timers are added to the wheel of the CPU
+// that arms them and expire there. Level N has 64 slots of 64^N ticks each. Adding
+// and cancelling a timer is O(1), timers are moved down one level at a time as their
+// expiration gets closer.
+struct timer_wheel
+{
+    spinlock_t          lock;                                           // Protects the wheel
+    uint64_t            clock;                                          // Next tick to process
+    int                 count;                                          // Number of pending timers
+    timer_t* volatile   running;                                        // Timer whose function is being called
+    uint64_t            bitmap[TIMER_WHEEL_LEVELS];                     // Bit N is set if slots[level][N] isn't empty
+    timer_t*            slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];   // Pending timers
+};
+
+
+// Start the clock used by timer_now()
+void timer_init();
+
+// Initialize the current CPU's timer wheel
+void timer_init_cpu();
+
+// Busy-wait for the specified number of microseconds (doesn't need interrupts)
+void timer_delay(unsigned microseconds);
+
+// Nanoseconds elapsed since the timer was started
+uint64_t timer_now();
+
+// Busy-wait for the specified number of nanoseconds using timer_now()
+void timer_stall(uint64_t ns);
+
+// Run the current CPU's expired timers (called from the clock event interrupt)
+void timer_expire();
+
+// Deadline of the current CPU's next pending timer (TIMER_INFINITE if there is none).
+// This is rounded up to the timer wheel's resolution.
+uint64_t timer_next_deadline();
+
+// Initialize a timer
+void timer_setup(timer_t* timer, timer_function_t function, void* context);
+
+// Arm (or re-arm) a timer to expire at 'deadline' (nanoseconds, see timer_now()).
+// The timer is queued on the current CPU and its function will run there.
+void timer_add(timer_t* timer, uint64_t deadline);
+
+// Disarm a timer. If the timer function is running, wait for it to complete.
+// Returns 1 if the timer was pending.
+int timer_cancel(timer_t* timer);
 
 
 
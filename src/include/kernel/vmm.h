@@ -64,16 +64,60 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress);
 // Unmap the specified virtual memory page
 void vmm_unmap_page(void* virtualAddress);
 
-// Map pages
+// Temporarily identity map the first 4 MB of memory (used to start application processors)
+void vmm_map_low_memory();
+void vmm_unmap_low_memory();
+
+// Map pages. Large pages are used where the physical range allows it.
 void* vmm_map(physaddr_t physicalAddress, size_t length);
 
-// Unmap pages
+// Unmap pages. Large pages only partially unmapped are first split in 4 KB pages.
+// The physical pages are left alone, the virtual space is given back to the heap.
 int vmm_unmap(void* virtualAddress, size_t length);
 
 
+#if defined(__x86_64__)
+
+// All RAM is mapped at VMM_DIRECT_MAP_BASE, holes (device memory) are left out
+#define VMM_DIRECT_MAP_BASE 0xFFFF800000000000ull
+#define VMM_DIRECT_MAP_SIZE 0x0000400000000000ull  // 64 TB
+
+// Map the RAM range [start, end) in the direct map (done by pmm_init() for each range)
+void vmm_init_direct_map(physaddr_t start, physaddr_t end);
+
+// Firmware memory (ACPI tables, NVS) that vmm_map() maps write-back (done by pmm_init())
+void vmm_init_firmware_range(physaddr_t start, physaddr_t end);
+
+// Print how much RAM the direct map holds
+void vmm_report_direct_map();
+
+// Address of physical memory in the direct map
+static inline void* phys_to_virt(physaddr_t address)
+{
+    return (void*)(uintptr_t)(VMM_DIRECT_MAP_BASE + address);
+}
+
+// Physical address of a direct map address (only)
+static inline physaddr_t virt_to_phys(const void* address)
+{
+    return (uintptr_t)address - VMM_DIRECT_MAP_BASE;
+}
+
+#endif
+
+
 // Alloc virtual memory
 // Returns NULL on failure (or if length is 0)
+// Large page sized parts are backed by large pages right away when physical memory
+// allows, the rest is backed a page at a time on first write.
 void* vmm_alloc(size_t length);
 
+// Free virtual memory from vmm_alloc(), any page aligned part of an allocation can be freed
+// Returns -1 if the range isn't in the heap
+int vmm_free(void* address, size_t length);
+
+// Initialize the heap used by vmm_alloc() and vmm_map() (needs the PMM)
+void vmm_init_heap();
+
 
 #endif
@@ -0,0 +1,84 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_WORKQUEUE_H
+#define KIZNIX_INCLUDED_KERNEL_WORKQUEUE_H
+
+#include <kernel/defs.h>
+
+
+/*
+    Deferred work. Interrupt handlers (or anything else that can't block) queue a work
+    item and a worker thread runs its function later in thread context, where it is
+    free to block.
+
+    Each CPU has one pool of worker threads per priority class. Work is queued on the
+    current CPU's pool for the item's priority.
+*/
+
+
+typedef struct work work_t;
+
+typedef void (*work_function_t)(work_t* work);
+
+
+typedef enum work_priority
+{
+    WORK_PRIORITY_HIGH,         // Latency sensitive (interrupt bottom halves)
+    WORK_PRIORITY_NORMAL,       // Default
+    WORK_PRIORITY_LOW,          // Background work
+    WORK_PRIORITY_COUNT
+} work_priority_t;
+
+
+// Work item. It is owned by the caller and must stay valid until its function runs.
+struct work
+{
+    work_function_t     function;   // Function to call from a worker thread
+    void*               context;    // User data
+    work_priority_t     priority;   // Pool the work is queued on
+    volatile int        pending;    // Queued and not started yet
+    work_t*             next;       // Next work item in the pool
+};
+
+
+// Start the worker threads of all online CPUs
+void work_init();
+
+// Initialize a work item
+void work_setup(work_t* work, work_function_t function, void* context, work_priority_t priority);
+
+// Queue a work item on the current CPU. This doesn't allocate memory and can be called
+// from interrupt handlers. Returns 0 if the work was already pending (it will only run
+// once), 1 otherwise. A work item can be queued again as soon as its function starts.
+int work_queue(work_t* work);
+
+// Wait until all pools are idle: no work queued or running. Work queued while waiting
+// is waited on as well.
+void work_flush();
+
+
+#endif
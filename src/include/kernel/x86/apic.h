@@ -0,0 +1,76 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_X86_APIC_H
+#define KIZNIX_INCLUDED_KERNEL_X86_APIC_H
+
+#include <kernel/pmm.h>
+
+
+#define APIC_TIMER_VECTOR       0xF0
+#define APIC_RESCHEDULE_VECTOR  0xF1
+#define APIC_TLB_FLUSH_VECTOR   0xF2
+#define APIC_SPURIOUS_VECTOR    0xFF
+
+
+// Map the local APIC registers and enable the boot processor's local APIC
+void apic_init(physaddr_t address);
+
+// Enable the local APIC of an application processor
+void apic_init_ap();
+
+// Is there a local APIC? (apic_init() was called)
+int apic_available();
+
+// Retrieve the current CPU's local APIC ID
+int apic_id();
+
+// Signal end-of-interrupt to the local APIC
+void apic_eoi();
+
+// Send an INIT IPI to the specified processor
+void apic_send_init(int apic_id);
+
+// Send a STARTUP IPI to the specified processor, 'address' is the start address (4 KB aligned, < 1 MB)
+void apic_send_startup(int apic_id, physaddr_t address);
+
+// Send a fixed interrupt to the specified processor
+void apic_send_ipi(int apic_id, int vector);
+
+// Measure the frequency of the local APIC timer (ticks per second)
+uint32_t apic_timer_calibrate();
+
+// Setup the current CPU's local APIC timer in one-shot or TSC-deadline mode (stopped)
+void apic_timer_init(int vector, int tscDeadline);
+
+// One-shot mode: interrupt after 'count' timer ticks (0 stops the timer)
+void apic_timer_set_count(uint32_t count);
+
+// TSC-deadline mode: interrupt when the TSC reaches 'deadline' (0 stops the timer)
+void apic_timer_set_deadline(uint64_t deadline);
+
+
+#endif
@@ -0,0 +1,192 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef KIZNIX_INCLUDED_KERNEL_X86_CPU_H
+#define KIZNIX_INCLUDED_KERNEL_X86_CPU_H
+
+#include <stdint.h>
+
+
+// Control register bits
+#define X86_CR0_MP              (1 << 1)    // Monitor coprocessor (WAIT honours TS)
+#define X86_CR0_EM              (1 << 2)    // FPU emulation
+#define X86_CR0_TS              (1 << 3)    // Task switched (FPU/SIMD instructions raise #NM)
+#define X86_CR0_NE              (1 << 5)    // Native FPU error reporting
+
+#define X86_CR4_PSE             (1 << 4)    // 4 MB pages without PAE
+#define X86_CR4_PGE             (1 << 7)    // Global pages (PAGE_GLOBAL survives CR3 reloads)
+#define X86_CR4_OSFXSR          (1 << 9)    // FXSAVE/FXRSTOR and SSE enabled
+#define X86_CR4_OSXMMEXCPT      (1 << 10)   // Unmasked SIMD exceptions raise #XM
+#define X86_CR4_OSXSAVE         (1 << 18)   // XSAVE/XRSTOR and XCR0 enabled
+
+
+// Extended control register 0 (state components managed by XSAVE)
+#define X86_XCR0_X87            (1 << 0)
+#define X86_XCR0_SSE            (1 << 1)
+#define X86_XCR0_AVX            (1 << 2)
+
+
+// Model Specific Registers
+#define X86_MSR_APIC_BASE       0x0000001B
+#define X86_MSR_TSC_DEADLINE    0x000006E0
+#define X86_MSR_EFER            0xC0000080
+#define X86_MSR_GS_BASE         0xC0000101
+
+
+// CPUID feature bits (leaf 1)
+#define X86_CPUID1_EDX_PSE          (1 << 3)
+#define X86_CPUID1_EDX_TSC          (1 << 4)
+#define X86_CPUID1_EDX_APIC         (1 << 9)
+#define X86_CPUID1_EDX_FXSR         (1 << 24)
+#define X86_CPUID1_EDX_SSE          (1 << 25)
+#define X86_CPUID1_EDX_SSE2         (1 << 26)
+#define X86_CPUID1_ECX_MONITOR      (1 << 3)
+#define X86_CPUID1_ECX_TSC_DEADLINE (1 << 24)
+#define X86_CPUID1_ECX_XSAVE        (1 << 26)
+#define X86_CPUID1_ECX_AVX          (1 << 28)
+
+// CPUID feature bits (leaf 0x80000001)
+#define X86_CPUID81_EDX_PDPE1GB     (1 << 26)
+
+
+// Bit Scan Forward - returns the index of the least significant bit set in 'value'.
+// The result is undefined if 'value' is 0.
+static inline int x86_bsf(uint32_t value)
+{
+    uint32_t index;
+    asm ("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+
+
+static inline void x86_cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    asm volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+
+
+static inline uintptr_t x86_get_cr0()
+{
+    uintptr_t value;
+    asm volatile ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+
+
+static inline void x86_set_cr0(uintptr_t value)
+{
+    asm volatile ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+
+
+static inline uintptr_t x86_get_cr4()
+{
+    uintptr_t value;
+    asm volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+
+
+static inline void x86_set_cr4(uintptr_t value)
+{
+    asm volatile ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+
+
+// Clear CR0.TS
+static inline void x86_clts()
+{
+    asm volatile ("clts" : : : "memory");
+}
+
+
+
+// Write an extended control register
+static inline void x86_xsetbv(uint32_t reg, uint64_t value)
+{
+    asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+
+
+// Enable interrupts and halt until the next one. 'sti' only takes effect after the
+// following instruction: no interrupt can be taken between the two.
+static inline void x86_sti_hlt()
+{
+    asm volatile ("sti; hlt" : : : "memory");
+}
+
+
+
+// Monitor the cache line containing 'address' for writes (see x86_sti_mwait())
+static inline void x86_monitor(const volatile void* address)
+{
+    asm volatile ("monitor" : : "a"(address), "c"(0), "d"(0));
+}
+
+
+
+// Enable interrupts and wait for an interrupt or a write to the monitored cache line
+static inline void x86_sti_mwait()
+{
+    asm volatile ("sti; mwait" : : "a"(0), "c"(0) : "memory");
+}
+
+
+
+// Read the time stamp counter
+static inline uint64_t x86_rdtsc()
+{
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+
+
+static inline uint64_t x86_read_msr(uint32_t msr)
+{
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+
+
+static inline void x86_write_msr(uint32_t msr, uint64_t value)
+{
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+
+
+#endif
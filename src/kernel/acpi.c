@@ -32,7 +32,9 @@
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <kernel/vmm.h>
+#include <kernel/workqueue.h>
 #include <kernel/x86/io.h>
 
 #include <assert.h>
@@ -42,6 +44,11 @@
 #define _COMPONENT          ACPI_KIZNIX
         ACPI_MODULE_NAME    ("kiznix")
 
+// AcpiOsStall() requests at least this long (microseconds) sleep instead of spinning
+#define ACPI_STALL_SLEEP_THRESHOLD  1000
+
+#define ACPI_WORK_COUNT 32      // Maximum number of AcpiOsExecute() callbacks pending at once
+
 
 static ACPI_STATUS acpi_device_callback(ACPI_HANDLE handle, UINT32 level, void* context, void** returnValue)
 {
@@ -78,6 +85,28 @@ static ACPI_STATUS acpi_device_callback(ACPI_HANDLE handle, UINT32 level, void*
 }
 
 
+int acpi_init_tables()
+{
+    static int initialized;
+
+    if (initialized)
+        return 0;
+
+    // The table manager doesn't need the rest of ACPICA, this lets us find the
+    // MADT (SMP) before the scheduler and memory allocator are fully operational.
+    ACPI_STATUS status = AcpiInitializeTables(NULL, 16, FALSE);
+    if (ACPI_FAILURE(status))
+    {
+        ACPI_EXCEPTION((AE_INFO, status, "While initializing Table Manager"));
+        return -1;
+    }
+
+    initialized = 1;
+    return 0;
+}
+
+
+
 void acpi_init()
 {
     printf("acpi_init()\n");
@@ -92,10 +121,8 @@ void acpi_init()
         return;
     }
 
-    status = AcpiInitializeTables(NULL, 16, FALSE);
-    if (ACPI_FAILURE(status))
+    if (acpi_init_tables() != 0)
     {
-        ACPI_EXCEPTION((AE_INFO, status, "While initializing Table Manager"));
         return;
     }
 
@@ -132,10 +159,34 @@ void acpi_init()
 
 
 
+// AcpiOsExecute() can be called from the SCI handler: work items come from a fixed pool
+// instead of the heap.
+typedef struct acpi_work
+{
+    work_t                  work;
+    ACPI_OSD_EXEC_CALLBACK  function;
+    void*                   context;
+    struct acpi_work*       next_free;
+} acpi_work_t;
+
+static acpi_work_t acpi_works[ACPI_WORK_COUNT];
+static acpi_work_t* acpi_free_works;
+static DEFINE_SPINLOCK(acpi_works_lock);
+
+
+
 ACPI_STATUS AcpiOsInitialize()
 {
     printf("AcpiOsInitialize()\n");
 
+    acpi_free_works = NULL;
+
+    for (int i = 0; i != ACPI_WORK_COUNT; ++i)
+    {
+        acpi_works[i].next_free = acpi_free_works;
+        acpi_free_works = &acpi_works[i];
+    }
+
     return AE_OK;
 }
 
@@ -299,62 +350,63 @@ ACPI_THREAD_ID AcpiOsGetThreadId()
 
 
 
-ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE type, ACPI_OSD_EXEC_CALLBACK function, void* context)
+static void acpi_work_function(work_t* work)
 {
-    printf("AcpiOsExecute()\n");
+    acpi_work_t* acpiWork = work->context;
 
-    (void) type;
-    (void) function;
-    (void) context;
+    acpiWork->function(acpiWork->context);
 
-    return AE_ERROR;
+    spin_lock(&acpi_works_lock);
+    acpiWork->next_free = acpi_free_works;
+    acpi_free_works = acpiWork;
+    spin_unlock(&acpi_works_lock);
+}
 
-/*TODO
-    HANDLE ThreadHandle;
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    NTSTATUS Status;
 
 
-    InitializeObjectAttributes(&ObjectAttributes,
-                               NULL,
-                               OBJ_KERNEL_HANDLE,
-                               NULL,
-                               NULL);
+ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE type, ACPI_OSD_EXEC_CALLBACK function, void* context)
+{
+    if (!function)
+        return AE_BAD_PARAMETER;
+
+    spin_lock(&acpi_works_lock);
 
-    Status = PsCreateSystemThread(&ThreadHandle,
-                                  THREAD_ALL_ACCESS,
-                                  &ObjectAttributes,
-                                  NULL,
-                                  NULL,
-                                  (PKSTART_ROUTINE)Function,
-                                  Context);
-    if (!NT_SUCCESS(Status))
-        return AE_ERROR;
+    acpi_work_t* acpiWork = acpi_free_works;
+    if (acpiWork)
+        acpi_free_works = acpiWork->next_free;
 
-    ZwClose(ThreadHandle);
+    spin_unlock(&acpi_works_lock);
+
+    if (!acpiWork)
+        return AE_NO_MEMORY;
+
+    // Notify handlers can run AML for a long time, keep them away from GPE / EC handling
+    const work_priority_t priority = type == OSL_NOTIFY_HANDLER ? WORK_PRIORITY_NORMAL : WORK_PRIORITY_HIGH;
+
+    acpiWork->function = function;
+    acpiWork->context = context;
+    work_setup(&acpiWork->work, acpi_work_function, acpiWork, priority);
+    work_queue(&acpiWork->work);
 
     return AE_OK;
-*/
 }
 
 
 
 void AcpiOsSleep(UINT64 milliseconds)
 {
-    printf("AcpiOsSleep(%lu)\n", (unsigned long) milliseconds);
-/* TODO
-    KeStallExecutionProcessor(milliseconds*1000);
-*/
+    thread_sleep_ns(milliseconds * 1000000);
 }
 
 
 
 void AcpiOsStall(UINT32 microseconds)
 {
-    printf("AcpiOsStall(%d)\n",microseconds);
-/* TODO
-    KeStallExecutionProcessor(microseconds);
-*/
+    // Stalls are meant to be short busy-waits, but don't burn the CPU on long ones
+    if (microseconds >= ACPI_STALL_SLEEP_THRESHOLD)
+        thread_sleep_ns((uint64_t)microseconds * 1000);
+    else
+        timer_stall((uint64_t)microseconds * 1000);
 }
 
 
@@ -392,22 +444,9 @@ ACPI_STATUS AcpiOsAcquireMutex(ACPI_MUTEX handle, UINT16 timeout)
 {
     //printf("AcpiOsAcquireMutex(%d)\n", timeout);
 
-    if (timeout == ACPI_DO_NOT_WAIT)
-    {
-        if (mutex_try_lock(handle))
-            return AE_OK;
-        else
-            return AE_TIME;
-    }
-    else if (timeout == ACPI_WAIT_FOREVER)
-    {
-        mutex_lock(handle);
-        return AE_OK;
-    }
-    else
-    {
-        assert(0);
-    }
+    const uint64_t ns = (timeout == ACPI_WAIT_FOREVER) ? TIMER_INFINITE : timeout * 1000000ull;
+
+    return mutex_lock_timeout(handle, ns) ? AE_OK : AE_TIME;
 }
 
 
@@ -459,36 +498,36 @@ ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE handle, UINT32 count, UINT16 time
 {
     //printf("AcpiOsWaitSemaphore()\n");
 
-    assert(timeout == ACPI_WAIT_FOREVER);
-
-    for (uint32_t i = 0; i != count; ++i)
+    if (timeout == ACPI_WAIT_FOREVER)
     {
-        semaphore_lock(handle);
+        for (uint32_t i = 0; i != count; ++i)
+        {
+            semaphore_lock(handle);
+        }
+
+        return AE_OK;
     }
 
-/* TODO
-    KeAcquireSpinLock(&Sem->Lock, &OldIrql);
+    // All units must be acquired before the deadline
+    const uint64_t deadline = timer_now() + timeout * 1000000ull;
 
-    // Make sure we can wait if we have fewer units than we need
-    if ((Timeout == ACPI_DO_NOT_WAIT) && (Sem->CurrentUnits < Units))
+    for (uint32_t i = 0; i != count; ++i)
     {
-        // We can't so we must bail now
-        KeReleaseSpinLock(&Sem->Lock, OldIrql);
-        return AE_TIME;
-    }
+        const uint64_t now = timer_now();
+        const uint64_t remaining = now < deadline ? deadline - now : 0;
 
-    // Time to block until we get enough units
-    while (Sem->CurrentUnits < Units)
-    {
-        KeReleaseSpinLock(&Sem->Lock, OldIrql);
-        KeWaitForSingleObject(&Sem->Event,
-                              Executive,
-                              KernelMode,
-                              FALSE,
-                              NULL);
-        KeAcquireSpinLock(&Sem->Lock, &OldIrql);
+        if (!semaphore_lock_timeout(handle, remaining))
+        {
+            // Give back what we got
+            while (i--)
+            {
+                semaphore_unlock(handle);
+            }
+
+            return AE_TIME;
+        }
     }
-*/
+
     return AE_OK;
 }
 
@@ -520,7 +559,7 @@ ACPI_STATUS AcpiOsCreateLock(ACPI_SPINLOCK* handle)
     if (!spinlock)
         return AE_NO_MEMORY;
 
-    *spinlock = SPINLOCK_UNLOCKED;
+    spin_lock_init(spinlock, "acpi");
 
     *handle = spinlock;
 
@@ -900,7 +939,7 @@ ACPI_STATUS AcpiOsGetLine(char* Buffer, UINT32 BufferLength, UINT32* BytesRead)
 
 void AcpiOsWaitEventsComplete()
 {
-    printf("AcpiOsWaitEventsComplete()\n");
+    work_flush();
 }
 
 
@@ -26,13 +26,20 @@
 
 #include <kernel/kernel.h>
 #include <kernel/console.h>
+#include <kernel/cpu.h>
 #include <kernel/interrupt.h>
+#include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
+#include <kernel/stack.h>
 #include <kernel/pmm.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <kernel/vmm.h>
+#include <kernel/workqueue.h>
 #include <kernel/x86/bios.h>
+#include <kernel/x86/cpu.h>
+#include <kernel/x86/timer.h>
 
 #include <stdlib.h>
 
@@ -72,8 +79,9 @@ int kernel_early()
     printf("Booting Kiznix (" KIZNIX_ARCH ")...\n\n");
 
     cpu_init();
-    pmm_init();
     vmm_init();
+    pmm_init();
+    vmm_init_heap();
 
     return 0;
 }
@@ -86,8 +94,9 @@ DEFINE_SPINLOCK(magic);
 semaphore_t sem;
 
 
-void thread1()
+void thread1(void* argument)
 {
+    (void)argument;
     printf("This is thread 1 (%p)!\n", thread_current());
     for (;;)
     {
@@ -97,8 +106,9 @@ void thread1()
     }
 }
 
-void thread2()
+void thread2(void* argument)
 {
+    (void)argument;
     printf("This is thread 2 (%p)!\n", thread_current());
     for (;;)
     {
@@ -108,8 +118,9 @@ void thread2()
     }
 }
 
-void thread3()
+void thread3(void* argument)
 {
+    (void)argument;
     printf("This is thread 3 (%p)!\n", thread_current());
     for (;;)
     {
@@ -121,6 +132,866 @@ void thread3()
 
 
 
+#if defined(KIZNIX_SELFTEST)
+
+/*
+    Boot time tests and benchmarks (build with KIZNIX_SELFTEST)
+
+    They run one after the other in their own thread once all processors are online and
+    print their results on the console. Durations are measured with the TSC. The test
+    thread runs slightly above the normal priority so that the threads it creates don't
+    slow it down while it sets things up.
+*/
+
+#define SELFTEST_PRIORITY       (THREAD_PRIORITY_NORMAL - 1)
+
+#define SELFTEST_SWITCHES       200000  // Context switches timed for each thread count
+
+// Each thread needs a kernel stack: 160 MB of RAM for 10000 of them is too much for 32 bits
+#if defined(__x86_64__)
+#define SELFTEST_SWITCH_MAX_THREADS 10000
+#else
+#define SELFTEST_SWITCH_MAX_THREADS 2000
+#endif
+
+#define SELFTEST_BALANCE_THREADS    4               // CPU-bound threads per online CPU
+#define SELFTEST_BALANCE_NS         1000000000ull   // How long they run (1 s)
+#define SELFTEST_BALANCE_CHUNK      10000           // Loop iterations per unit of work
+#define SELFTEST_BALANCE_IO_THREADS 2               // Sleeping / waking threads per online CPU
+#define SELFTEST_BALANCE_IO_SLEEP   1000000ull      // How long they sleep between bursts (1 ms)
+
+#define SELFTEST_LOCK_THREADS       2       // Contending threads per online CPU
+#define SELFTEST_LOCK_ROUNDS        20000   // Lock / unlock pairs per thread
+#define SELFTEST_LOCK_HOLD          100     // Loop iterations with the lock held (and between pairs)
+
+#define SELFTEST_PI_LOW             (THREAD_PRIORITY_NORMAL + 4)
+#define SELFTEST_PI_MEDIUM          THREAD_PRIORITY_NORMAL
+#define SELFTEST_PI_HIGH            (THREAD_PRIORITY_NORMAL - 4)
+#define SELFTEST_PI_HOLD_NS         10000000ull     // The low priority owner keeps the mutex this long once contended (10 ms)
+#define SELFTEST_PI_HOG_NS          1000000000ull   // The medium priority hog runs this long at most (1 s)
+#define SELFTEST_PI_BOUND_NS        50000000ull     // Longest acceptable wait for the high priority thread (50 ms)
+#define SELFTEST_PI_TIMEOUT_NS      20000000ull     // Timed wait that lends its priority, then gives up (20 ms)
+
+#define SELFTEST_JITTER_WAKEUPS     100             // Wakeups measured per scheduling class
+#define SELFTEST_JITTER_SLEEP_NS    5000000ull      // Time between wakeups (5 ms)
+#define SELFTEST_JITTER_RUNTIME_NS  1000000ull      // Deadline class reservation: 1 ms...
+#define SELFTEST_JITTER_PERIOD_NS   10000000ull     // ...every 10 ms
+
+#define SELFTEST_CHURN_ROUNDS       10000   // Alloc / free rounds per CPU
+#define SELFTEST_CHURN_PAGES        32      // Pages allocated then freed in each round
+
+
+// Released by the last thread of a test. Test state is static and this semaphore is never
+// reinitialized: a thread can still be inside semaphore_unlock() when the next test starts.
+static semaphore_t selftest_done;
+
+
+
+// Burn some CPU time
+static inline void selftest_spin(int iterations)
+{
+    for (int i = 0; i != iterations; ++i)
+        asm volatile ("" : : : "memory");
+}
+
+
+
+// Context switch cost: 'count' threads pinned to the same CPU take turns with thread_yield()
+typedef struct
+{
+    int             cpu;        // CPU the threads are pinned to
+    int             count;      // Number of threads
+    int             rounds;     // thread_yield() calls per thread once they are all there
+    volatile int    arrived;    // Threads pinned and waiting for the others
+    volatile int    running;    // Threads not done yet
+    volatile int    go;         // All threads arrived, start yielding for real
+    uint64_t        start;      // TSC when the last thread arrived
+    uint64_t        end;        // TSC when the last thread was done
+} selftest_switch_t;
+
+
+
+static void selftest_switch_thread(void* argument)
+{
+    selftest_switch_t* test = argument;
+
+    thread_set_affinity(thread_current(), 1u << test->cpu);
+
+    if (__sync_add_and_fetch(&test->arrived, 1) == test->count)
+    {
+        test->start = x86_rdtsc();
+        test->go = 1;
+    }
+
+    while (!test->go)
+        thread_yield();
+
+    for (int i = 0; i != test->rounds; ++i)
+        thread_yield();
+
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+    {
+        test->end = x86_rdtsc();
+        semaphore_unlock(&selftest_done);
+    }
+}
+
+
+
+static void selftest_switch(int count)
+{
+    static selftest_switch_t test;
+
+    test.cpu = 0;
+    test.count = count;
+    test.rounds = SELFTEST_SWITCHES / count;
+    test.arrived = 0;
+    test.running = count;
+    test.go = 0;
+
+    for (int i = 0; i != count; ++i)
+        thread_create(selftest_switch_thread, &test);
+
+    semaphore_lock(&selftest_done);
+
+    const uint64_t switches = (uint64_t)count * test.rounds;
+    const uint64_t cycles = test.end - test.start;
+
+    printf("    %5d threads: %lu ns, %lu cycles per switch\n", count,
+        (unsigned long)(ns_from_tsc_cycles(cycles) / switches), (unsigned long)(cycles / switches));
+}
+
+
+
+// Load balancing: threads created on one CPU count the work they get done on each CPU.
+// I/O-style threads sleep and wake up among them and measure how late they run again.
+typedef struct
+{
+    volatile int        stop;               // Time is up
+    volatile int        running;            // Threads not done yet
+    volatile uint32_t   work[MAX_CPUS];     // Units of work done on each CPU
+    spinlock_t          lock;               // Protects the fields below
+    uint64_t            min_run;            // Least CPU time a CPU-bound thread got (TSC cycles)
+    uint64_t            max_run;            // Most CPU time a CPU-bound thread got (TSC cycles)
+    uint32_t            wakeups;            // I/O thread wakeups
+    uint64_t            total_latency;      // Sum of their latencies (ns)
+    uint64_t            max_latency;        // Worst one (ns)
+} selftest_balance_t;
+
+
+
+static void selftest_balance_thread(void* argument)
+{
+    selftest_balance_t* test = argument;
+
+    while (!test->stop)
+    {
+        selftest_spin(SELFTEST_BALANCE_CHUNK);
+
+        // We can be moved right after reading the CPU, close enough
+        __sync_fetch_and_add(&test->work[cpu_read(id)], 1);
+    }
+
+    // Accounting is only updated on switches, add the current time slice
+    thread_t* self = thread_current();
+    const uint64_t run = self->run_cycles + (x86_rdtsc() - self->timestamp);
+
+    spin_lock(&test->lock);
+
+    if (run < test->min_run)
+        test->min_run = run;
+
+    if (run > test->max_run)
+        test->max_run = run;
+
+    spin_unlock(&test->lock);
+
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+        semaphore_unlock(&selftest_done);
+}
+
+
+
+static void selftest_balance_io_thread(void* argument)
+{
+    selftest_balance_t* test = argument;
+    uint32_t wakeups = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    while (!test->stop)
+    {
+        // A short burst of work, then wait for the "device"
+        selftest_spin(SELFTEST_BALANCE_CHUNK / 10);
+
+        const uint64_t target = timer_now() + SELFTEST_BALANCE_IO_SLEEP;
+        thread_sleep_ns(SELFTEST_BALANCE_IO_SLEEP);
+
+        const uint64_t now = timer_now();
+        const uint64_t latency = now > target ? now - target : 0;
+
+        ++wakeups;
+        total += latency;
+        if (latency > max)
+            max = latency;
+    }
+
+    spin_lock(&test->lock);
+
+    test->wakeups += wakeups;
+    test->total_latency += total;
+    if (max > test->max_latency)
+        test->max_latency = max;
+
+    spin_unlock(&test->lock);
+
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+        semaphore_unlock(&selftest_done);
+}
+
+
+
+static void selftest_balance()
+{
+    static selftest_balance_t test;
+    static uint32_t migrations_in[MAX_CPUS];
+    static uint32_t migrations_out[MAX_CPUS];
+
+    const int count = SELFTEST_BALANCE_THREADS * g_cpu_count;
+    const int io_count = SELFTEST_BALANCE_IO_THREADS * g_cpu_count;
+
+    test.stop = 0;
+    test.running = count + io_count;
+    spin_lock_init(&test.lock, "selftest_balance");
+    test.min_run = UINT64_MAX;
+    test.max_run = 0;
+    test.wakeups = 0;
+    test.total_latency = 0;
+    test.max_latency = 0;
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        test.work[i] = 0;
+        migrations_in[i] = g_cpus[i].migrations_in;
+        migrations_out[i] = g_cpus[i].migrations_out;
+    }
+
+    // All threads start on this CPU, they have to wait for us: the load balancer moves them
+    for (int i = 0; i != count; ++i)
+        thread_create(selftest_balance_thread, &test);
+
+    for (int i = 0; i != io_count; ++i)
+        thread_create(selftest_balance_io_thread, &test);
+
+    thread_sleep_ns(SELFTEST_BALANCE_NS);
+    test.stop = 1;
+
+    semaphore_lock(&selftest_done);
+
+    unsigned long total = 0;
+    unsigned long least = ~0ul;
+    unsigned long most = 0;
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        const unsigned long work = test.work[i];
+
+        total += work;
+        least = work < least ? work : least;
+        most = work > most ? work : most;
+    }
+
+    printf("    %d threads, %lu units of work per second\n", count, (unsigned long)(total * 1000000000ull / SELFTEST_BALANCE_NS));
+    printf("    %-4s %10s %7s %10s %10s\n", "cpu", "work", "share", "migr in", "migr out");
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        printf("    %-4d %10lu %6lu%% %10lu %10lu\n", i,
+            (unsigned long)test.work[i],
+            total ? (unsigned long)test.work[i] * 100 / total : 0,
+            (unsigned long)(g_cpus[i].migrations_in - migrations_in[i]),
+            (unsigned long)(g_cpus[i].migrations_out - migrations_out[i]));
+    }
+
+    printf("    Imbalance (busiest / idlest CPU): %lu%%\n", least ? most * 100 / least : 0);
+    printf("    Thread run time: %lu to %lu ms\n",
+        (unsigned long)(ns_from_tsc_cycles(test.min_run) / 1000000),
+        (unsigned long)(ns_from_tsc_cycles(test.max_run) / 1000000));
+    printf("    %d I/O threads, %lu wakeups: latency avg %lu us, max %lu us\n", io_count,
+        (unsigned long)test.wakeups,
+        test.wakeups ? (unsigned long)(test.total_latency / test.wakeups / 1000) : 0,
+        (unsigned long)(test.max_latency / 1000));
+}
+
+
+
+// Lock contention: threads on all CPUs increment a counter protected by a mutex or by a
+// semaphore used as a mutex (what mutex_t used to be)
+typedef struct
+{
+    int                     use_mutex;  // Use 'mutex', 'semaphore' otherwise
+    mutex_t                 mutex;
+    semaphore_t             semaphore;
+    volatile int            running;    // Threads not done yet
+    volatile unsigned long  counter;    // Protected by the lock
+    uint64_t                end;        // TSC when the last thread was done
+} selftest_lock_t;
+
+
+
+static void selftest_lock_thread(void* argument)
+{
+    selftest_lock_t* test = argument;
+
+    for (int i = 0; i != SELFTEST_LOCK_ROUNDS; ++i)
+    {
+        if (test->use_mutex)
+            mutex_lock(&test->mutex);
+        else
+            semaphore_lock(&test->semaphore);
+
+        test->counter = test->counter + 1;
+        selftest_spin(SELFTEST_LOCK_HOLD);
+
+        if (test->use_mutex)
+            mutex_unlock(&test->mutex);
+        else
+            semaphore_unlock(&test->semaphore);
+
+        selftest_spin(SELFTEST_LOCK_HOLD);
+    }
+
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+    {
+        test->end = x86_rdtsc();
+        semaphore_unlock(&selftest_done);
+    }
+}
+
+
+
+static void selftest_lock(int use_mutex)
+{
+    static selftest_lock_t test;
+
+    const int count = SELFTEST_LOCK_THREADS * g_cpu_count;
+
+    test.use_mutex = use_mutex;
+    mutex_init(&test.mutex);
+    semaphore_init(&test.semaphore, 1);
+    test.running = count;
+    test.counter = 0;
+
+    const uint64_t start = x86_rdtsc();
+
+    for (int i = 0; i != count; ++i)
+        thread_create(selftest_lock_thread, &test);
+
+    semaphore_lock(&selftest_done);
+
+    const uint64_t pairs = (uint64_t)count * SELFTEST_LOCK_ROUNDS;
+    const uint64_t ns = ns_from_tsc_cycles(test.end - start);
+
+    if (test.counter != pairs)
+    {
+        fatal("selftest_lock() - %s lost updates (%lu / %lu)\n", use_mutex ? "mutex" : "semaphore",
+            test.counter, (unsigned long)pairs);
+    }
+
+    printf("    %-9s: %d threads, %lu ns per lock / unlock, %lu per second\n",
+        use_mutex ? "mutex" : "semaphore", count,
+        (unsigned long)(ns / pairs), (unsigned long)(pairs * 1000000000ull / ns));
+}
+
+
+
+// Priority inversion: a low priority thread owns a mutex, a medium priority thread hogs the
+// CPU and a high priority thread waits for the mutex, through a chain of two owners.
+typedef struct
+{
+    uint32_t        affinity;   // CPU all threads run on
+    mutex_t         outer;      // Owned by the low priority thread
+    mutex_t         inner;      // Owned by a thread waiting for 'outer'
+    semaphore_t     step;       // A thread reached the point the test thread waits for
+    semaphore_t     release;    // Let the owner of 'outer' go (timeout test)
+    volatile int    running;    // Threads not done yet
+    volatile int    contended;  // The high priority thread is about to wait
+    volatile int    finished;   // The high priority thread got its mutex
+    volatile int    acquired;   // mutex_lock_timeout() result
+    uint64_t        latency;    // How long the high priority thread waited (ns)
+} selftest_pi_t;
+
+
+
+static void selftest_pi_enter(selftest_pi_t* test, int priority)
+{
+    thread_t* self = thread_current();
+
+    thread_set_affinity(self, test->affinity);
+    thread_set_priority(self, priority);
+}
+
+
+
+static void selftest_pi_exit(selftest_pi_t* test)
+{
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+        semaphore_unlock(&selftest_done);
+}
+
+
+
+static void selftest_pi_low(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_LOW);
+
+    mutex_lock(&test->outer);
+    semaphore_unlock(&test->step);
+
+    // Without priority inheritance, the hog keeps us from getting here until it is done
+    while (!test->contended)
+        selftest_spin(1000);
+
+    const uint64_t start = timer_now();
+    while (timer_now() - start < SELFTEST_PI_HOLD_NS)
+        selftest_spin(1000);
+
+    mutex_unlock(&test->outer);
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_chain(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_LOW);
+
+    mutex_lock(&test->inner);
+    semaphore_unlock(&test->step);
+
+    mutex_lock(&test->outer);
+    mutex_unlock(&test->outer);
+
+    mutex_unlock(&test->inner);
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_hog(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_MEDIUM);
+
+    semaphore_unlock(&test->step);
+
+    const uint64_t start = timer_now();
+    while (!test->finished && timer_now() - start < SELFTEST_PI_HOG_NS)
+        selftest_spin(1000);
+
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_high(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_HIGH);
+
+    test->contended = 1;
+
+    const uint64_t start = timer_now();
+    mutex_lock(&test->inner);
+    test->latency = timer_now() - start;
+    test->finished = 1;
+    mutex_unlock(&test->inner);
+
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_owner(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_LOW);
+
+    mutex_lock(&test->outer);
+    semaphore_unlock(&test->step);
+
+    semaphore_lock(&test->release);
+    mutex_unlock(&test->outer);
+
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_timed_waiter(void* argument)
+{
+    selftest_pi_t* test = argument;
+    selftest_pi_enter(test, SELFTEST_PI_HIGH);
+
+    test->acquired = mutex_lock_timeout(&test->outer, SELFTEST_PI_TIMEOUT_NS);
+    if (test->acquired)
+        mutex_unlock(&test->outer);
+
+    semaphore_unlock(&test->step);
+    selftest_pi_exit(test);
+}
+
+
+
+static void selftest_pi_init(selftest_pi_t* test, int threads)
+{
+    // Another CPU than ours when possible, we are more urgent than the hog
+    test->affinity = 1u << (g_cpu_count - 1);
+    mutex_init(&test->outer);
+    mutex_init(&test->inner);
+    semaphore_init(&test->step, 0);
+    semaphore_init(&test->release, 0);
+    test->running = threads;
+    test->contended = 0;
+    test->finished = 0;
+    test->acquired = 0;
+    test->latency = 0;
+}
+
+
+
+// The high priority thread must get its mutex in about the time the low priority owner
+// needs to finish, not once the hog is done. This walks a chain of two owners.
+static void selftest_pi_inversion()
+{
+    static selftest_pi_t test;
+    selftest_pi_init(&test, 4);
+
+    thread_create(selftest_pi_low, &test);
+    semaphore_lock(&test.step);
+
+    thread_t* chain = thread_create(selftest_pi_chain, &test);
+    semaphore_lock(&test.step);
+
+    // The chain is only there once it waits for the low priority thread
+    while (chain->blocked_on != &test.outer)
+        thread_sleep_ns(1000000);
+
+    thread_create(selftest_pi_hog, &test);
+    semaphore_lock(&test.step);
+
+    thread_create(selftest_pi_high, &test);
+    semaphore_lock(&selftest_done);
+
+    if (test.latency > SELFTEST_PI_BOUND_NS)
+    {
+        fatal("selftest_pi_inversion() - high priority thread waited %lu us (bound is %lu us)\n",
+            (unsigned long)(test.latency / 1000), (unsigned long)(SELFTEST_PI_BOUND_NS / 1000));
+    }
+
+    printf("    Chain of 2 owners: high priority thread waited %lu us (bound is %lu us, hog runs %lu us)\n",
+        (unsigned long)(test.latency / 1000), (unsigned long)(SELFTEST_PI_BOUND_NS / 1000),
+        (unsigned long)(SELFTEST_PI_HOG_NS / 1000));
+}
+
+
+
+// A waiter that times out must take back the priority it lent (see mutex_timeout())
+static void selftest_pi_timeout()
+{
+    static selftest_pi_t test;
+    selftest_pi_init(&test, 2);
+
+    thread_t* owner = thread_create(selftest_pi_owner, &test);
+    semaphore_lock(&test.step);
+
+    thread_create(selftest_pi_timed_waiter, &test);
+
+    const uint64_t start = timer_now();
+    while (owner->priority != SELFTEST_PI_HIGH && timer_now() - start < SELFTEST_PI_TIMEOUT_NS)
+        thread_sleep_ns(1000000);
+
+    const int boosted = owner->priority;
+
+    semaphore_lock(&test.step);
+
+    const int restored = owner->priority;
+
+    semaphore_unlock(&test.release);
+    semaphore_lock(&selftest_done);
+
+    if (test.acquired || boosted != SELFTEST_PI_HIGH || restored != SELFTEST_PI_LOW)
+    {
+        fatal("selftest_pi_timeout() - acquired %d, owner priority %d while waited on, %d after the timeout\n",
+            test.acquired, boosted, restored);
+    }
+
+    printf("    Timed out waiter: owner priority %d, %d while waited on, %d after the timeout\n",
+        SELFTEST_PI_LOW, boosted, restored);
+}
+
+
+
+// Wakeup latency: a thread sleeps and measures how late it runs again, while a normal class
+// thread hogs the same CPU.
+typedef struct
+{
+    uint32_t        affinity;   // CPU both threads run on
+    int             policy;     // THREAD_CLASS_XXX of the measuring thread
+    semaphore_t     started;    // The hog is running
+    volatile int    stop;       // Tell the hog to exit
+    uint64_t        total;      // Sum of wakeup latencies (ns)
+    uint64_t        max;        // Worst wakeup latency (ns)
+    uint64_t        wait;       // Time spent in the run queue after wakeups (TSC cycles)
+} selftest_jitter_t;
+
+
+
+static void selftest_jitter_hog(void* argument)
+{
+    selftest_jitter_t* test = argument;
+    thread_set_affinity(thread_current(), test->affinity);
+
+    semaphore_unlock(&test->started);
+
+    while (!test->stop)
+        selftest_spin(1000);
+
+    semaphore_unlock(&selftest_done);
+}
+
+
+
+static void selftest_jitter_thread(void* argument)
+{
+    selftest_jitter_t* test = argument;
+    thread_t* self = thread_current();
+
+    thread_set_affinity(self, test->affinity);
+
+    if (test->policy == THREAD_CLASS_FIFO)
+        thread_set_fifo(self, THREAD_RT_PRIORITY_HIGHEST);
+    else if (test->policy == THREAD_CLASS_DEADLINE && !thread_set_deadline(self, SELFTEST_JITTER_RUNTIME_NS, SELFTEST_JITTER_PERIOD_NS))
+        fatal("selftest_jitter_thread() - deadline reservation refused\n");
+
+    test->total = 0;
+    test->max = 0;
+
+    const uint64_t wait = self->wait_cycles;
+
+    for (int i = 0; i != SELFTEST_JITTER_WAKEUPS; ++i)
+    {
+        const uint64_t target = timer_now() + SELFTEST_JITTER_SLEEP_NS;
+        thread_sleep_ns(SELFTEST_JITTER_SLEEP_NS);
+
+        const uint64_t now = timer_now();
+        const uint64_t latency = now > target ? now - target : 0;
+
+        test->total += latency;
+        if (latency > test->max)
+            test->max = latency;
+    }
+
+    test->wait = self->wait_cycles - wait;
+
+    semaphore_unlock(&selftest_done);
+}
+
+
+
+static void selftest_jitter(selftest_jitter_t* test, int sched_class, const char* name)
+{
+    test->policy = sched_class;
+
+    thread_create(selftest_jitter_thread, test);
+    semaphore_lock(&selftest_done);
+
+    printf("    %-8s: wakeup latency avg %lu us, max %lu us, run queue wait avg %lu us\n", name,
+        (unsigned long)(test->total / SELFTEST_JITTER_WAKEUPS / 1000),
+        (unsigned long)(test->max / 1000),
+        (unsigned long)(ns_from_tsc_cycles(test->wait) / SELFTEST_JITTER_WAKEUPS / 1000));
+}
+
+
+
+// The latency includes timer wheel resolution; the run queue wait is what the hog costs
+static void selftest_jitter_all()
+{
+    static selftest_jitter_t test;
+
+    test.affinity = 1u << (g_cpu_count - 1);
+    semaphore_init(&test.started, 0);
+    test.stop = 0;
+
+    thread_create(selftest_jitter_hog, &test);
+    semaphore_lock(&test.started);
+
+    selftest_jitter(&test, THREAD_CLASS_NORMAL, "normal");
+    selftest_jitter(&test, THREAD_CLASS_FIFO, "fifo");
+    selftest_jitter(&test, THREAD_CLASS_DEADLINE, "deadline");
+
+    test.stop = 1;
+    semaphore_lock(&selftest_done);
+}
+
+
+
+// Page allocator churn: one thread per CPU allocates and frees pages, through the per-CPU
+// magazines or straight from the zones.
+typedef struct
+{
+    int             use_magazines;  // pmm_alloc_page() or pmm_alloc_pages(0)
+    volatile int    next_cpu;       // CPU for the next thread
+    volatile int    arrived;        // Threads on their CPU
+    volatile int    running;        // Threads not done yet
+    volatile int    go;             // All threads are on their CPU
+    uint64_t        start;          // timer_now() when the threads were let go
+    uint64_t        end;            // timer_now() when the last thread was done
+} selftest_churn_t;
+
+
+
+static void selftest_churn_thread(void* argument)
+{
+    selftest_churn_t* test = argument;
+    physaddr_t pages[SELFTEST_CHURN_PAGES];
+
+    const int cpu = __sync_fetch_and_add(&test->next_cpu, 1);
+    thread_set_affinity(thread_current(), 1u << cpu);
+
+    if (__sync_add_and_fetch(&test->arrived, 1) == g_cpu_count)
+    {
+        test->start = timer_now();
+        test->go = 1;
+    }
+
+    while (!test->go)
+        selftest_spin(100);
+
+    for (int round = 0; round != SELFTEST_CHURN_ROUNDS; ++round)
+    {
+        if (test->use_magazines)
+        {
+            for (int i = 0; i != SELFTEST_CHURN_PAGES; ++i)
+                pages[i] = pmm_alloc_page();
+
+            for (int i = 0; i != SELFTEST_CHURN_PAGES; ++i)
+                pmm_free_page(pages[i]);
+        }
+        else
+        {
+            for (int i = 0; i != SELFTEST_CHURN_PAGES; ++i)
+                pages[i] = pmm_alloc_pages(0);
+
+            for (int i = 0; i != SELFTEST_CHURN_PAGES; ++i)
+                pmm_free_pages(pages[i], 0);
+        }
+    }
+
+    if (__sync_sub_and_fetch(&test->running, 1) == 0)
+    {
+        test->end = timer_now();
+        semaphore_unlock(&selftest_done);
+    }
+}
+
+
+
+static void selftest_churn(int use_magazines)
+{
+    static selftest_churn_t test;
+
+    test.use_magazines = use_magazines;
+    test.next_cpu = 0;
+    test.arrived = 0;
+    test.running = g_cpu_count;
+    test.go = 0;
+
+    for (int i = 0; i != g_cpu_count; ++i)
+        thread_create(selftest_churn_thread, &test);
+
+    semaphore_lock(&selftest_done);
+
+    const uint64_t allocs = (uint64_t)g_cpu_count * SELFTEST_CHURN_ROUNDS * SELFTEST_CHURN_PAGES;
+    const uint64_t elapsed = test.end - test.start;
+
+    printf("    %-16s: %lu allocations/s (%d CPUs, %lu ns per alloc / free pair on each)\n",
+        use_magazines ? "magazines" : "zones only",
+        (unsigned long)(allocs * 1000000000ull / elapsed), g_cpu_count,
+        (unsigned long)(elapsed * g_cpu_count / allocs));
+}
+
+
+
+// Freeing a range reads the boundary tags of its neighbours, possibly on metadata pages
+// nothing was written to yet. With an empty heap, this reads tags[2047] on tags page 1.
+static void selftest_vmm()
+{
+    const size_t size = 6 * 1024 * 1024;
+    const size_t length = 4 * 1024 * 1024;
+
+    void* before = vmm_alloc(size);
+    void* p = vmm_alloc(length);
+
+    if (!before || !p || vmm_free(p, length) || vmm_free(before, size))
+    {
+        fatal("selftest_vmm() - vmm_alloc() / vmm_free() failed\n");
+    }
+
+    printf("    vmm_alloc(6 MB), vmm_alloc(4 MB), vmm_free(4 MB): OK\n");
+}
+
+
+
+static void selftest_thread(void* argument)
+{
+    (void)argument;
+
+    thread_set_priority(thread_current(), SELFTEST_PRIORITY);
+    semaphore_init(&selftest_done, 0);
+
+    // First, while most of the heap metadata is still untouched
+    printf("\nKernel heap (boundary tags on unbacked metadata pages):\n");
+    selftest_vmm();
+
+    printf("\nContext switch (thread_yield() on one CPU):\n");
+    selftest_switch(10);
+    selftest_switch(1000);
+    selftest_switch(SELFTEST_SWITCH_MAX_THREADS);
+
+    // Kernel stacks are cached, not freed: give back what the largest count left behind
+    // once the reaper is done with the threads
+    thread_sleep_ns(10000000);
+    work_flush();
+    printf("    Released %d cached kernel stacks\n", stack_trim());
+
+    printf("\nLoad balancing (CPU-bound and I/O threads created on one CPU):\n");
+    selftest_balance();
+
+    printf("\nLock contention (adaptive mutex vs semaphore):\n");
+    selftest_lock(1);
+    selftest_lock(0);
+
+    printf("\nPriority inheritance (low, medium and high priority threads on one CPU):\n");
+    selftest_pi_inversion();
+    selftest_pi_timeout();
+
+    printf("\nWakeup jitter (sleeping thread sharing a CPU with a normal class hog):\n");
+    selftest_jitter_all();
+
+    printf("\nPage allocator churn (pmm_alloc_page() / pmm_free_page() on every CPU):\n");
+    selftest_churn(1);
+    selftest_churn(0);
+
+    printf("\nSelf tests done\n");
+}
+
+#endif
+
+
+
 // Kernel entry point
 void kernel_main()
 {
@@ -130,21 +1001,29 @@ void kernel_main()
 
     thread_init();
 
+    smp_init();
+
+    work_init();
+
+    pmm_init_zero_pool();
+
     //*(int*)KERNEL_HEAP_START = 0;
 
     //acpi_init();
 
     //semaphore_init(&sem, 1);
-    //thread_create(thread2);
-    //thread_create(thread3);
-    //thread1();
+    //thread_create(thread2, NULL);
+    //thread_create(thread3, NULL);
+    //thread1(NULL);
 
     vga_set_mode(4);
 
     printf("kiznix running\n");
 
-    for(;;)
-    {
-        thread_yield();
-    }
+#if defined(KIZNIX_SELFTEST)
+    thread_create(selftest_thread, NULL);
+#endif
+
+    // Nothing else to do, only run when no other thread wants this CPU
+    thread_idle();
 }
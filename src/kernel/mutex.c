@@ -25,32 +25,388 @@
 */
 
 #include <kernel/mutex.h>
-#include <kernel/semaphore.h>
+#include <kernel/cpu.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <assert.h>
+#include <xmmintrin.h>
+
+
+// How many times to check a running owner before going to sleep
+#define MUTEX_SPIN_COUNT 1000
+
+// Longest chain of blocked owners priority inheritance follows (this also stops deadlock cycles)
+#define MUTEX_PI_MAX_DEPTH 16
+
+
+// A waiter with a deadline
+typedef struct
+{
+    waiter_t    waiter;
+    mutex_t*    mutex;
+    timer_t     timer;
+} mutex_timed_waiter_t;
+
+
+// Priority inheritance state (wait queue order, threads' blocked_on / pi_mutexes and
+// mutexes' pi_owner) is protected by a single lock. Following a chain of owners takes
+// no per-mutex lock, so there is no lock ordering problem between the mutexes of the
+// chain. It is only taken on contention. Lock order: mutex->lock, mutex_pi_lock, run queues.
+static DEFINE_SPINLOCK(mutex_pi_lock);
+
+
+
+static inline thread_t* mutex_owner(uintptr_t owner)
+{
+    return (thread_t*)(owner & ~(uintptr_t)MUTEX_HAS_WAITERS);
+}
+
+
+
+// Is 'thread' running on another CPU right now?
+static inline int mutex_owner_running(thread_t* thread)
+{
+    return __atomic_load_n(&thread->state, __ATOMIC_RELAXED) == THREAD_RUNNING &&
+           __atomic_load_n(&thread->cpu, __ATOMIC_RELAXED) != cpu_read(self);
+}
 
 
 
 void mutex_init(mutex_t* mutex)
 {
-    semaphore_init(&mutex->semaphore, 1);
+    mutex->owner = 0;
+    spin_lock_init(&mutex->lock, "mutex");
+    wait_queue_init(&mutex->waiters);
+    mutex->pi_owner = NULL;
+    mutex->pi_next = NULL;
+}
+
+
+
+// Queue a waiter in priority order, after waiters of the same priority
+static void mutex_queue_waiter(mutex_t* mutex, waiter_t* waiter)
+{
+    waiter_t* next = mutex->waiters.head;
+
+    while (next && thread_compare(next->thread, waiter->thread) <= 0)
+        next = next->next;
+
+    if (next)
+        wait_queue_insert_before(&mutex->waiters, waiter, next);
+    else
+        wait_queue_append(&mutex->waiters, waiter);
+
+    waiter->status = WAITER_WAITING;
+}
+
+
+
+// Record that 'thread' owns a mutex with waiters
+static void mutex_pi_track(thread_t* thread, mutex_t* mutex)
+{
+    if (mutex->pi_owner == thread)
+        return;
+
+    mutex->pi_owner = thread;
+    mutex->pi_next = thread->pi_mutexes;
+    thread->pi_mutexes = mutex;
+}
+
+
+
+static void mutex_pi_untrack(mutex_t* mutex)
+{
+    thread_t* thread = mutex->pi_owner;
+
+    if (!thread)
+        return;
+
+    for (mutex_t** p = &thread->pi_mutexes; *p; p = &(*p)->pi_next)
+    {
+        if (*p == mutex)
+        {
+            *p = mutex->pi_next;
+            break;
+        }
+    }
+
+    mutex->pi_owner = NULL;
+    mutex->pi_next = NULL;
+}
+
+
+
+// Priority a waiter lends to the owner. Inheritance only boosts the time-sharing priority
+// of the owner: real-time waiters lend the highest one.
+static inline int mutex_lent_priority(const thread_t* thread)
+{
+    return thread->sched_class == THREAD_CLASS_NORMAL ? thread->priority : THREAD_PRIORITY_HIGHEST;
+}
+
+
+
+// Most urgent priority among the first waiters of the mutexes a thread owns
+static int mutex_pi_priority(thread_t* thread)
+{
+    int priority = THREAD_PRIORITY_COUNT;
+
+    for (mutex_t* mutex = thread->pi_mutexes; mutex; mutex = mutex->pi_next)
+    {
+        waiter_t* waiter = mutex->waiters.head;
+
+        if (waiter && mutex_lent_priority(waiter->thread) < priority)
+            priority = mutex_lent_priority(waiter->thread);
+    }
+
+    return priority;
+}
+
+
+
+// The waiters of a mutex owned by 'thread' changed: update its inherited priority and
+// walk the chain of owners it is (transitively) blocked on.
+static void mutex_pi_propagate(thread_t* thread)
+{
+    for (int depth = 0; thread && depth != MUTEX_PI_MAX_DEPTH; ++depth)
+    {
+        const int previous = thread->priority;
+
+        thread_set_inherited_priority(thread, mutex_pi_priority(thread));
+
+        mutex_t* mutex = thread->blocked_on;
+
+        if (thread->priority == previous || !mutex)
+            break;
+
+        // Keep the wait queue sorted, the next owner might have to change priority too
+        wait_queue_remove(&mutex->waiters, thread->mutex_waiter);
+        mutex_queue_waiter(mutex, thread->mutex_waiter);
+
+        thread = mutex_owner(mutex->owner);
+    }
+}
+
+
+
+// Spin while the owner is running, it is likely to release the mutex soon.
+// Returns 1 if the mutex was acquired.
+static int mutex_spin(mutex_t* mutex, thread_t* self)
+{
+    for (int i = 0; i != MUTEX_SPIN_COUNT; ++i)
+    {
+        const uintptr_t owner = mutex->owner;
+
+        if (owner == 0)
+        {
+            if (__sync_bool_compare_and_swap(&mutex->owner, 0, (uintptr_t)self))
+                return 1;
+        }
+        else if (!mutex_owner_running(mutex_owner(owner)))
+        {
+            // Owner is sleeping or waiting for this CPU, no point in spinning
+            return 0;
+        }
+
+        _mm_pause();
+    }
+
+    return 0;
+}
+
+
+
+// Deadline reached: take the waiter out of the queue unless it was given the mutex already
+static void mutex_timeout(timer_t* timer)
+{
+    mutex_timed_waiter_t* timed = timer->context;
+    mutex_t* mutex = timed->mutex;
+
+    spin_lock(&mutex->lock);
+
+    if (timed->waiter.status == WAITER_WAITING)
+    {
+        thread_t* thread = timed->waiter.thread;
+
+        spin_lock(&mutex_pi_lock);
+
+        wait_queue_remove(&mutex->waiters, &timed->waiter);
+        timed->waiter.status = WAITER_TIMED_OUT;
+        thread->blocked_on = NULL;
+        thread->mutex_waiter = NULL;
+
+        // Let the owner use the fast path again. Only waiters (with the lock held) set the
+        // flag and the owner's fast path unlock fails while it is set, so nothing can race us.
+        if (mutex->waiters.head == NULL)
+        {
+            __sync_fetch_and_and(&mutex->owner, ~(uintptr_t)MUTEX_HAS_WAITERS);
+            mutex_pi_untrack(mutex);
+        }
+
+        // The owner might have been boosted by this waiter
+        mutex_pi_propagate(mutex_owner(mutex->owner));
+
+        spin_unlock(&mutex_pi_lock);
+
+        thread_wakeup(thread);
+    }
+
+    spin_unlock(&mutex->lock);
+}
+
+
+
+static int mutex_lock_slow(mutex_t* mutex, thread_t* self, uint64_t timeout)
+{
+    if (mutex_spin(mutex, self))
+        return 1;
+
+    spin_lock(&mutex->lock);
+
+    for (;;)
+    {
+        const uintptr_t owner = mutex->owner;
+
+        if (owner == 0)
+        {
+            // Released in the meantime. The wait queue is empty: mutex_unlock() hands the
+            // mutex to the first waiter instead of releasing it.
+            if (__sync_bool_compare_and_swap(&mutex->owner, 0, (uintptr_t)self))
+            {
+                spin_unlock(&mutex->lock);
+                return 1;
+            }
+        }
+        else if (__sync_bool_compare_and_swap(&mutex->owner, owner, owner | MUTEX_HAS_WAITERS))
+        {
+            // The owner will have to go through the slow path to unlock
+            break;
+        }
+    }
+
+    // Queue a waiter and lend our priority to the owner
+    mutex_timed_waiter_t timed;
+    timed.waiter.thread = self;
+    timed.mutex = mutex;
+
+    spin_lock(&mutex_pi_lock);
+
+    mutex_queue_waiter(mutex, &timed.waiter);
+    self->blocked_on = mutex;
+    self->mutex_waiter = &timed.waiter;
+
+    thread_t* owner = mutex_owner(mutex->owner);
+    mutex_pi_track(owner, mutex);
+    mutex_pi_propagate(owner);
+
+    spin_unlock(&mutex_pi_lock);
+
+    if (timeout != TIMER_INFINITE)
+    {
+        timer_setup(&timed.timer, mutex_timeout, &timed);
+        timer_add(&timed.timer, timer_now() + timeout);
+    }
+
+    // This releases the mutex lock. We own the mutex if we were woken up by mutex_unlock().
+    thread_suspend(&mutex->lock);
+
+    // Make sure the timer function is done with our waiter before it goes out of scope
+    if (timeout != TIMER_INFINITE)
+    {
+        timer_cancel(&timed.timer);
+    }
+
+    if (timed.waiter.status != WAITER_WOKEN)
+        return 0;
+
+    assert(mutex_owner(mutex->owner) == self);
+    return 1;
+}
+
+
+
+int mutex_lock_timeout(mutex_t* mutex, uint64_t timeout)
+{
+    thread_t* self = thread_current();
+
+    // Fast path: mutex is free
+    if (__sync_bool_compare_and_swap(&mutex->owner, 0, (uintptr_t)self))
+        return 1;
+
+    assert(mutex_owner(mutex->owner) != self);
+
+    if (timeout == 0)
+        return 0;
+
+    return mutex_lock_slow(mutex, self, timeout);
 }
 
 
 
 void mutex_lock(mutex_t* mutex)
 {
-    semaphore_lock(&mutex->semaphore);
+    mutex_lock_timeout(mutex, TIMER_INFINITE);
 }
 
 
 
 int mutex_try_lock(mutex_t* mutex)
 {
-    return semaphore_try_lock(&mutex->semaphore);
+    return __sync_bool_compare_and_swap(&mutex->owner, 0, (uintptr_t)thread_current());
 }
 
 
 
 void mutex_unlock(mutex_t* mutex)
 {
-    semaphore_unlock(&mutex->semaphore);
+    thread_t* self = thread_current();
+
+    // Fast path: nobody is waiting
+    if (__sync_bool_compare_and_swap(&mutex->owner, (uintptr_t)self, 0))
+        return;
+
+    assert(mutex_owner(mutex->owner) == self);
+
+    spin_lock(&mutex->lock);
+    spin_lock(&mutex_pi_lock);
+
+    mutex_pi_untrack(mutex);
+
+    waiter_t* waiter = mutex->waiters.head;
+    thread_t* thread = NULL;
+
+    if (waiter == NULL)
+    {
+        // The last waiter timed out after our fast path failed
+        mutex->owner = 0;
+    }
+    else
+    {
+        // Hand the mutex over to the first (most urgent) waiter
+        thread = waiter->thread;
+
+        wait_queue_remove(&mutex->waiters, waiter);
+        waiter->status = WAITER_WOKEN;
+        thread->blocked_on = NULL;
+        thread->mutex_waiter = NULL;
+
+        mutex->owner = (uintptr_t)thread | (mutex->waiters.head ? MUTEX_HAS_WAITERS : 0);
+
+        // The new owner inherits from the remaining waiters
+        if (mutex->waiters.head)
+        {
+            mutex_pi_track(thread, mutex);
+            thread_set_inherited_priority(thread, mutex_pi_priority(thread));
+        }
+    }
+
+    // Drop whatever priority this mutex was lending us. This happens before waking up
+    // the new owner so that it can preempt us.
+    thread_set_inherited_priority(self, mutex_pi_priority(self));
+
+    spin_unlock(&mutex_pi_lock);
+
+    if (thread)
+        thread_wakeup(thread);
+
+    spin_unlock(&mutex->lock);
 }
@@ -0,0 +1,370 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <kernel/runqueue.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/x86/cpu.h>
+
+#include <assert.h>
+
+
+#define THREAD_TIMESLICE 10000000       // Time slice for round-robin between threads of the same priority (ns)
+
+
+
+/*
+    Deadline class: earliest deadline first. Each thread owns a constant bandwidth server
+    (runtime every period): once its budget is spent, its deadline is postponed by a period
+    and the budget refilled. A thread can't take more than its reservation away from the
+    other deadline threads, admission control (thread_set_deadline()) does the rest.
+*/
+
+static void deadline_enqueue(runqueue_t* runqueue, thread_t* thread)
+{
+    thread_t* next = runqueue->deadline.head;
+
+    // Same deadline: first come, first served
+    while (next && next->dl_deadline <= thread->dl_deadline)
+        next = next->next;
+
+    if (next)
+        thread_queue_insert_before(&runqueue->deadline, thread, next);
+    else
+        thread_queue_append(&runqueue->deadline, thread);
+}
+
+
+
+static void deadline_dequeue(runqueue_t* runqueue, thread_t* thread)
+{
+    thread_queue_remove(&runqueue->deadline, thread);
+}
+
+
+
+static thread_t* deadline_peek(const runqueue_t* runqueue)
+{
+    return runqueue->deadline.head;
+}
+
+
+
+static int deadline_compare(const thread_t* a, const thread_t* b)
+{
+    if (a->dl_deadline == b->dl_deadline)
+        return 0;
+
+    return a->dl_deadline < b->dl_deadline ? -1 : 1;
+}
+
+
+
+static uint64_t deadline_slice_end(const runqueue_t* runqueue, const thread_t* thread, uint64_t now)
+{
+    (void)runqueue;
+
+    // Budget exhausted: time to postpone the deadline (see deadline_charge())
+    return now + (thread->dl_budget > 0 ? (uint64_t)thread->dl_budget : 0);
+}
+
+
+
+static void deadline_charge(thread_t* thread, uint64_t ns)
+{
+    thread->dl_budget -= (int64_t)ns;
+
+    while (thread->dl_budget <= 0)
+    {
+        thread->dl_budget += thread->dl_runtime;
+        thread->dl_deadline += thread->dl_period;
+    }
+}
+
+
+
+static void deadline_wakeup(thread_t* thread, uint64_t now)
+{
+    // Keep the current deadline only if the budget left can be used before it without
+    // exceeding the reserved bandwidth: budget / (deadline - now) <= runtime / period.
+    // The budget never exceeds the runtime, so this always holds a period or more ahead.
+    const uint64_t left = thread->dl_deadline - now;
+
+    if (thread->dl_deadline <= now ||
+        (left < thread->dl_period && (uint64_t)thread->dl_budget * thread->dl_period > left * thread->dl_runtime))
+    {
+        thread->dl_deadline = now + thread->dl_period;
+        thread->dl_budget = thread->dl_runtime;
+    }
+}
+
+
+
+static const sched_class_t deadline_class =
+{
+    "deadline",
+    deadline_enqueue,
+    deadline_dequeue,
+    deadline_peek,
+    deadline_compare,
+    deadline_slice_end,
+    deadline_charge,
+    deadline_wakeup,
+};
+
+
+
+/*
+    FIFO class: fixed real-time priorities, no time slice
+*/
+
+static void fifo_enqueue(runqueue_t* runqueue, thread_t* thread)
+{
+    const int priority = thread->rt_priority;
+
+    assert(priority >= 0 && priority < THREAD_RT_PRIORITY_COUNT);
+
+    thread_queue_append(&runqueue->rt_queues[priority], thread);
+
+    runqueue->rt_bitmap |= 1u << priority;
+}
+
+
+
+static void fifo_dequeue(runqueue_t* runqueue, thread_t* thread)
+{
+    const int priority = thread->rt_priority;
+
+    thread_queue_t* queue = &runqueue->rt_queues[priority];
+    thread_queue_remove(queue, thread);
+
+    if (thread_queue_empty(queue))
+    {
+        runqueue->rt_bitmap &= ~(1u << priority);
+    }
+}
+
+
+
+static thread_t* fifo_peek(const runqueue_t* runqueue)
+{
+    if (runqueue->rt_bitmap == 0)
+    {
+        return NULL;
+    }
+
+    return runqueue->rt_queues[x86_bsf(runqueue->rt_bitmap)].head;
+}
+
+
+
+static int fifo_compare(const thread_t* a, const thread_t* b)
+{
+    return a->rt_priority - b->rt_priority;
+}
+
+
+
+static uint64_t fifo_slice_end(const runqueue_t* runqueue, const thread_t* thread, uint64_t now)
+{
+    (void)runqueue;
+    (void)thread;
+    (void)now;
+
+    return TIMER_INFINITE;
+}
+
+
+
+static const sched_class_t fifo_class =
+{
+    "fifo",
+    fifo_enqueue,
+    fifo_dequeue,
+    fifo_peek,
+    fifo_compare,
+    fifo_slice_end,
+    NULL,
+    NULL,
+};
+
+
+
+/*
+    Normal class: time-sharing priorities, round-robin within a priority
+*/
+
+static void normal_enqueue(runqueue_t* runqueue, thread_t* thread)
+{
+    const int priority = thread->priority;
+
+    assert(priority >= 0 && priority < THREAD_PRIORITY_COUNT);
+
+    thread_queue_append(&runqueue->queues[priority], thread);
+
+    runqueue->bitmap |= 1u << priority;
+}
+
+
+
+static void normal_dequeue(runqueue_t* runqueue, thread_t* thread)
+{
+    const int priority = thread->priority;
+
+    thread_queue_t* queue = &runqueue->queues[priority];
+    thread_queue_remove(queue, thread);
+
+    if (thread_queue_empty(queue))
+    {
+        runqueue->bitmap &= ~(1u << priority);
+    }
+}
+
+
+
+static thread_t* normal_peek(const runqueue_t* runqueue)
+{
+    if (runqueue->bitmap == 0)
+    {
+        return NULL;
+    }
+
+    // Lowest bit set is the highest priority queue that isn't empty
+    return runqueue->queues[x86_bsf(runqueue->bitmap)].head;
+}
+
+
+
+static int normal_compare(const thread_t* a, const thread_t* b)
+{
+    return a->priority - b->priority;
+}
+
+
+
+static uint64_t normal_slice_end(const runqueue_t* runqueue, const thread_t* thread, uint64_t now)
+{
+    // Only threads with the same or a higher priority can take the CPU from 'thread'
+    if (runqueue->bitmap & ((2u << thread->priority) - 1))
+    {
+        return now + THREAD_TIMESLICE;
+    }
+
+    return TIMER_INFINITE;
+}
+
+
+
+static const sched_class_t normal_class =
+{
+    "normal",
+    normal_enqueue,
+    normal_dequeue,
+    normal_peek,
+    normal_compare,
+    normal_slice_end,
+    NULL,
+    NULL,
+};
+
+
+
+const sched_class_t* const g_sched_classes[THREAD_CLASS_COUNT] =
+{
+    &deadline_class,
+    &fifo_class,
+    &normal_class,
+};
+
+
+
+void runqueue_init(runqueue_t* runqueue)
+{
+    spin_lock_init(&runqueue->lock, "runqueue");
+    runqueue->count = 0;
+    runqueue->wakelist = NULL;
+
+    thread_queue_init(&runqueue->deadline);
+    runqueue->dl_bandwidth = 0;
+
+    runqueue->rt_bitmap = 0;
+
+    for (int i = 0; i != THREAD_RT_PRIORITY_COUNT; ++i)
+    {
+        thread_queue_init(&runqueue->rt_queues[i]);
+    }
+
+    runqueue->bitmap = 0;
+
+    for (int i = 0; i != THREAD_PRIORITY_COUNT; ++i)
+    {
+        thread_queue_init(&runqueue->queues[i]);
+    }
+}
+
+
+
+void runqueue_push(runqueue_t* runqueue, thread_t* thread)
+{
+    sched_class(thread)->enqueue(runqueue, thread);
+
+    ++runqueue->count;
+}
+
+
+
+thread_t* runqueue_pop(runqueue_t* runqueue)
+{
+    if (runqueue->count == 0)
+    {
+        return NULL;
+    }
+
+    // First thread of the most urgent class that has one
+    for (int i = 0; i != THREAD_CLASS_COUNT; ++i)
+    {
+        const sched_class_t* class = g_sched_classes[i];
+        thread_t* thread = class->peek(runqueue);
+
+        if (thread)
+        {
+            class->dequeue(runqueue, thread);
+            --runqueue->count;
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+void runqueue_remove(runqueue_t* runqueue, thread_t* thread)
+{
+    sched_class(thread)->dequeue(runqueue, thread);
+
+    --runqueue->count;
+}
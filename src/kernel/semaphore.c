@@ -26,25 +26,54 @@
 
 #include <kernel/semaphore.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 
+// A waiter with a deadline
+typedef struct
+{
+    waiter_t        waiter;
+    semaphore_t*    semaphore;
+    timer_t         timer;
+} semaphore_timed_waiter_t;
+
+
 
 void semaphore_init(semaphore_t* semaphore, int initialCount)
 {
     assert(initialCount >= 0);
 
-    semaphore->lock = SPINLOCK_UNLOCKED;
+    spin_lock_init(&semaphore->lock, "semaphore");
     semaphore->count = initialCount;
-    semaphore->head = NULL;
-    semaphore->tail = NULL;
+    wait_queue_init(&semaphore->waiters);
 }
 
 
 
-void semaphore_lock(semaphore_t* semaphore)
+// Deadline reached: take the waiter out of the queue unless it was woken up already
+static void semaphore_timeout(timer_t* timer)
+{
+    semaphore_timed_waiter_t* timed = timer->context;
+    semaphore_t* semaphore = timed->semaphore;
+
+    spin_lock(&semaphore->lock);
+
+    if (timed->waiter.status == WAITER_WAITING)
+    {
+        wait_queue_remove(&semaphore->waiters, &timed->waiter);
+        timed->waiter.status = WAITER_TIMED_OUT;
+        thread_wakeup(timed->waiter.thread);
+    }
+
+    spin_unlock(&semaphore->lock);
+}
+
+
+
+int semaphore_lock_timeout(semaphore_t* semaphore, uint64_t timeout)
 {
     spin_lock(&semaphore->lock);
 
@@ -54,58 +83,58 @@ void semaphore_lock(semaphore_t* semaphore)
         --semaphore->count;
         //printf("%p: semaphore_lock() - got lock, count = %d\n", thread_current(), semaphore->count);
         spin_unlock(&semaphore->lock);
+        return 1;
     }
-    else
+
+    if (timeout == 0)
     {
-        // Blocked - queue current thread and yield
-        //printf("%p: semaphore_lock() - blocked\n", thread_current());
+        spin_unlock(&semaphore->lock);
+        return 0;
+    }
 
-        // Append a waiter
-        thread_t* thread = thread_current();
+    // Blocked - queue current thread and yield
+    //printf("%p: semaphore_lock() - blocked\n", thread_current());
 
-        waiter_t waiter;
-        waiter.thread = thread;
-        waiter.next = NULL;
+    thread_t* thread = thread_current();
 
-        if (semaphore->tail == NULL)
-        {
-            semaphore->head = semaphore->tail = &waiter;
-        }
-        else
-        {
-            semaphore->tail->next = &waiter;
-            semaphore->tail = &waiter;
-        }
+    semaphore_timed_waiter_t timed;
+    timed.waiter.thread = thread;
+    timed.semaphore = semaphore;
 
-        thread->state = THREAD_SUSPENDED;
-        thread->blocker = semaphore;
+    wait_queue_append(&semaphore->waiters, &timed.waiter);
 
-        spin_unlock(&semaphore->lock);
+    if (timeout != TIMER_INFINITE)
+    {
+        timer_setup(&timed.timer, semaphore_timeout, &timed);
+        timer_add(&timed.timer, timer_now() + timeout);
+    }
+
+    thread->blocker = semaphore;
 
-//todo: it's possible we get pre-empted here, and that would mean inefficient scheduling right now
+    // This releases the semaphore lock
+    thread_suspend(&semaphore->lock);
 
-        thread_yield();
+    // Make sure the timer function is done with our waiter before it goes out of scope
+    if (timeout != TIMER_INFINITE)
+    {
+        timer_cancel(&timed.timer);
     }
+
+    return timed.waiter.status == WAITER_WOKEN;
 }
 
 
 
-int semaphore_try_lock(semaphore_t* semaphore)
+void semaphore_lock(semaphore_t* semaphore)
 {
-    spin_lock(&semaphore->lock);
+    semaphore_lock_timeout(semaphore, TIMER_INFINITE);
+}
 
-    if (semaphore->count > 0)
-    {
-        // Lock acquired
-        --semaphore->count;
-        spin_unlock(&semaphore->lock);
-        return 1;
-    }
-    else
-    {
-        spin_unlock(&semaphore->lock);
-        return 0;
-    }
+
+
+int semaphore_try_lock(semaphore_t* semaphore)
+{
+    return semaphore_lock_timeout(semaphore, 0);
 }
 
 
@@ -114,7 +143,9 @@ void semaphore_unlock(semaphore_t* semaphore)
 {
     spin_lock(&semaphore->lock);
 
-    if (semaphore->head == NULL)
+    waiter_t* waiter = semaphore->waiters.head;
+
+    if (waiter == NULL)
     {
         // No thread to wakup, increment counter
         ++semaphore->count;
@@ -123,18 +154,14 @@ void semaphore_unlock(semaphore_t* semaphore)
     }
     else
     {
-        // Wake up a waiting thread
-        //printf("%p: semaphore_unlock() - waking up thread %p\n", thread_current(), semaphore->head->thread);
+        // Wake up a waiting thread, it now owns the count we are releasing
+        //printf("%p: semaphore_unlock() - waking up thread %p\n", thread_current(), waiter->thread);
 
-        // Pop a waiter
-        waiter_t* waiter = semaphore->head;
+        wait_queue_remove(&semaphore->waiters, waiter);
+        waiter->status = WAITER_WOKEN;
 
-        semaphore->head = waiter->next;
-        if (semaphore->head == NULL)
-            semaphore->tail = NULL;
-
-        thread_wakeup(waiter->thread);
-
-        spin_unlock(&semaphore->lock);
+        // Hand the CPU over to the waiter when we can: a producer / consumer ping-pong
+        // then costs a single context switch. This releases the semaphore lock.
+        thread_wakeup_switch(waiter->thread, &semaphore->lock);
     }
 }
@@ -25,16 +25,175 @@
 */
 
 #include <kernel/spinlock.h>
+#include <kernel/cpu.h>
 #include <kernel/interrupt.h>
 #include <kernel/thread.h>
+#include <kernel/x86/cpu.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <xmmintrin.h>
 
 
-//todo: move to a CPU object
-int g_spinLockCount;        // todo: temp hack, does not belong here
-int g_interruptsEnabled;    // todo: temp hack, does not belong here
+#if defined(KIZNIX_LOCKSTAT)
+
+#define LOCKSTAT_MAX_CLASSES 32
+
+
+// Each CPU updates its own counters, they are only added up when dumped
+typedef struct
+{
+    uint64_t acquisitions;      // Number of times the lock was acquired
+    uint64_t contentions;       // Number of acquisitions that had to wait
+    uint64_t spin_cycles;       // TSC cycles spent waiting for the lock
+    uint64_t hold_cycles;       // TSC cycles the lock was held
+} lockstat_counters_t;
+
+
+struct lockstat
+{
+    const char*         name;
+    lockstat_counters_t counters[MAX_CPUS];
+};
+
+
+static lockstat_t lockstat_classes[LOCKSTAT_MAX_CLASSES];
+static int lockstat_class_count;
+static spinlock_t lockstat_lock;    // Protects the class table (never tracked itself)
+
+#endif
+
+
+
+// Take a ticket and wait for our turn. Returns 1 if the lock was contended.
+static inline int ticket_lock(volatile spinlock_t* lock)
+{
+    const uint16_t ticket = __sync_fetch_and_add(&lock->value, 1u << 16) >> 16;
+
+    if (__atomic_load_n(&lock->tickets.owner, __ATOMIC_ACQUIRE) == ticket)
+    {
+        return 0;
+    }
+
+    while (__atomic_load_n(&lock->tickets.owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+        _mm_pause();
+    }
+
+    return 1;
+}
+
+
+
+static inline int ticket_trylock(volatile spinlock_t* lock)
+{
+    const uint32_t value = lock->value;
+
+    // Only take a ticket if it would be served immediately
+    if ((value & 0xFFFF) != (value >> 16))
+    {
+        return 0;
+    }
+
+    return __sync_bool_compare_and_swap(&lock->value, value, value + (1u << 16));
+}
+
+
+
+static inline void ticket_unlock(volatile spinlock_t* lock)
+{
+    // Only the owner writes 'owner', no need for an atomic increment
+    __atomic_store_n(&lock->tickets.owner, lock->tickets.owner + 1, __ATOMIC_RELEASE);
+}
+
+
+
+#if defined(KIZNIX_LOCKSTAT)
+
+// Find (or create) the statistics of a lock class. Interrupts must be disabled.
+static lockstat_t* lockstat_find(const char* name)
+{
+    if (!name)
+        name = "(unnamed)";
+
+    ticket_lock(&lockstat_lock);
+
+    lockstat_t* stats = NULL;
+
+    for (int i = 0; i != lockstat_class_count; ++i)
+    {
+        if (strcmp(lockstat_classes[i].name, name) == 0)
+        {
+            stats = &lockstat_classes[i];
+            break;
+        }
+    }
+
+    if (!stats)
+    {
+        // When the table is full, the last class is shared by everyone else
+        if (lockstat_class_count == LOCKSTAT_MAX_CLASSES)
+        {
+            stats = &lockstat_classes[LOCKSTAT_MAX_CLASSES - 1];
+            stats->name = "(other)";
+        }
+        else
+        {
+            stats = &lockstat_classes[lockstat_class_count++];
+            stats->name = name;
+        }
+    }
+
+    ticket_unlock(&lockstat_lock);
+
+    return stats;
+}
+
+
+
+static void lockstat_acquired(volatile spinlock_t* lock, int contended, uint64_t spinStart)
+{
+    const uint64_t now = x86_rdtsc();
+
+    if (!lock->stats)
+        lock->stats = lockstat_find(lock->name);
+
+    lockstat_counters_t* counters = &lock->stats->counters[cpu_get()->id];
+
+    ++counters->acquisitions;
+
+    if (contended)
+    {
+        ++counters->contentions;
+        counters->spin_cycles += now - spinStart;
+    }
+
+    lock->hold_start = now;
+}
+
+
+
+static void lockstat_released(volatile spinlock_t* lock)
+{
+    lock->stats->counters[cpu_get()->id].hold_cycles += x86_rdtsc() - lock->hold_start;
+}
+
+#endif
+
+
+
+void spin_lock_init(volatile spinlock_t* lock, const char* name)
+{
+    lock->value = 0;
+
+#if defined(KIZNIX_LOCKSTAT)
+    lock->name = name;
+    lock->stats = NULL;
+    lock->hold_start = 0;
+#else
+    (void)name;
+#endif
+}
 
 
 
@@ -46,18 +205,51 @@ void spin_lock(volatile spinlock_t* lock)
 
     //printf("spin_lock: %p\n", lock);
 
-    if (g_spinLockCount++ == 0)
+    cpu_t* cpu = cpu_get();
+
+    if (cpu->spinlock_count++ == 0)
     {
-        g_interruptsEnabled = interruptsEnabled;
+        cpu->interrupts_enabled = interruptsEnabled;
     }
 
-    while (__sync_lock_test_and_set(lock, 1))
+#if defined(KIZNIX_LOCKSTAT)
+    const uint64_t spinStart = x86_rdtsc();
+    const int contended = ticket_lock(lock);
+    lockstat_acquired(lock, contended, spinStart);
+#else
+    ticket_lock(lock);
+#endif
+}
+
+
+int spin_trylock(volatile spinlock_t* lock)
+{
+    int interruptsEnabled = interrupt_enabled();
+
+    interrupt_disable();
+
+    if (!ticket_trylock(lock))
     {
-        while (*lock)
+        if (interruptsEnabled)
         {
-            _mm_pause();
+            interrupt_enable();
         }
+
+        return 0;
+    }
+
+#if defined(KIZNIX_LOCKSTAT)
+    lockstat_acquired(lock, 0, 0);
+#endif
+
+    cpu_t* cpu = cpu_get();
+
+    if (cpu->spinlock_count++ == 0)
+    {
+        cpu->interrupts_enabled = interruptsEnabled;
     }
+
+    return 1;
 }
 
 
@@ -67,12 +259,57 @@ void spin_unlock(volatile spinlock_t* lock)
 
     assert(!interrupt_enabled());
 
-    assert(g_spinLockCount > 0);
+    cpu_t* cpu = cpu_get();
+
+    assert(cpu->spinlock_count > 0);
+
+#if defined(KIZNIX_LOCKSTAT)
+    lockstat_released(lock);
+#endif
 
-    __sync_lock_release(lock);
+    ticket_unlock(lock);
 
-    if (--g_spinLockCount == 0 && g_interruptsEnabled)
+    if (--cpu->spinlock_count == 0 && cpu->interrupts_enabled)
     {
+        // Releasing the last lock is a preemption point (see preempt.h)
+        if (cpu->need_resched && cpu->preempt_count == 0)
+        {
+            thread_yield();
+        }
+
         interrupt_enable();
     }
 }
+
+
+void spin_lock_dump_stats()
+{
+#if defined(KIZNIX_LOCKSTAT)
+    printf("%-16s %12s %12s %12s %12s\n", "lock", "acquired", "contended", "avg spin", "avg hold");
+
+    for (int i = 0; i != lockstat_class_count; ++i)
+    {
+        const lockstat_t* stats = &lockstat_classes[i];
+        lockstat_counters_t total = { 0, 0, 0, 0 };
+
+        // Counters of other CPUs might be in the middle of an update, close enough
+        for (int cpu = 0; cpu != g_cpu_count; ++cpu)
+        {
+            total.acquisitions += stats->counters[cpu].acquisitions;
+            total.contentions += stats->counters[cpu].contentions;
+            total.spin_cycles += stats->counters[cpu].spin_cycles;
+            total.hold_cycles += stats->counters[cpu].hold_cycles;
+        }
+
+        // printf() has no 64 bits support, show the counters as unsigned long
+        printf("%-16s %12lu %12lu %12lu %12lu\n",
+            stats->name,
+            (unsigned long)total.acquisitions,
+            (unsigned long)total.contentions,
+            (unsigned long)(total.contentions ? total.spin_cycles / total.contentions : 0),
+            (unsigned long)(total.acquisitions ? total.hold_cycles / total.acquisitions : 0));
+    }
+#else
+    printf("spin_lock_dump_stats(): lock statistics are disabled (build with KIZNIX_LOCKSTAT)\n");
+#endif
+}
@@ -0,0 +1,147 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <kernel/stack.h>
+#include <kernel/cpu.h>
+#include <kernel/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/spinlock.h>
+#include <kernel/vmm.h>
+
+#include <stddef.h>
+#include <string.h>
+
+
+/*
+    Stacks are only returned to the virtual memory manager by stack_trim(). Each CPU keeps
+    a few free stacks, the rest go to a shared depot linked through the first word of each
+    stack.
+*/
+
+static char* stack_depot;                   // Free stacks not cached by any CPU
+static DEFINE_SPINLOCK(stack_depot_lock);   // Protects the depot
+
+
+
+static char* stack_create()
+{
+    char* guard = vmm_alloc(PAGE_SIZE + STACK_SIZE);
+
+    if (!guard)
+    {
+        fatal("stack_create() - out of virtual space");
+    }
+
+    // Neither present nor marked as allocated: touching the guard page is a fatal page fault
+    vmm_unmap_page(guard);
+
+    // Fault the stack in now rather than when the thread runs
+    char* stack = guard + PAGE_SIZE;
+    memset(stack, 0, STACK_SIZE);
+
+    return stack;
+}
+
+
+
+char* stack_alloc()
+{
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    cpu_t* cpu = cpu_get();
+    char* stack = cpu->stack_cache_count ? cpu->stack_cache[--cpu->stack_cache_count] : NULL;
+
+    if (interruptsEnabled)
+        interrupt_enable();
+
+    if (stack)
+        return stack;
+
+    spin_lock(&stack_depot_lock);
+
+    stack = stack_depot;
+    if (stack)
+        stack_depot = *(char**)stack;
+
+    spin_unlock(&stack_depot_lock);
+
+    return stack ? stack : stack_create();
+}
+
+
+
+void stack_free(char* stack)
+{
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    cpu_t* cpu = cpu_get();
+    const int cached = cpu->stack_cache_count != STACK_CACHE_SIZE;
+
+    if (cached)
+        cpu->stack_cache[cpu->stack_cache_count++] = stack;
+
+    if (interruptsEnabled)
+        interrupt_enable();
+
+    if (cached)
+        return;
+
+    // This CPU has enough, share with the others
+    spin_lock(&stack_depot_lock);
+
+    *(char**)stack = stack_depot;
+    stack_depot = stack;
+
+    spin_unlock(&stack_depot_lock);
+}
+
+
+
+int stack_trim()
+{
+    spin_lock(&stack_depot_lock);
+
+    char* stack = stack_depot;
+    stack_depot = NULL;
+
+    spin_unlock(&stack_depot_lock);
+
+    int count = 0;
+
+    while (stack)
+    {
+        char* next = *(char**)stack;
+
+        // The guard page is part of the allocation
+        vmm_free(stack - PAGE_SIZE, PAGE_SIZE + STACK_SIZE);
+
+        stack = next;
+        ++count;
+    }
+
+    return count;
+}
@@ -25,272 +25,1154 @@
 */
 
 #include <kernel/thread.h>
+#include <kernel/cpu.h>
+#include <kernel/clockevent.h>
+#include <kernel/fpu.h>
 #include <kernel/kernel.h>
+#include <kernel/preempt.h>
+#include <kernel/runqueue.h>
 #include <kernel/spinlock.h>
+#include <kernel/stack.h>
 #include <kernel/timer.h>
 #include <kernel/vmm.h>
-#include <kernel/x86/pic.h>
+#include <kernel/workqueue.h>
+#include <kernel/x86/cpu.h>
+#include <kernel/x86/timer.h>
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define THREAD_STACK_SIZE 16384
+// A thread that stopped running less than this many nanoseconds ago is considered to
+// still have a warm cache on its CPU and won't be migrated by the load balancer.
+#define THREAD_CACHE_HOT_TIME 2000000
 
-extern void interrupt_exit();
+// Round 'size' up to a multiple of FPU_STATE_ALIGNMENT
+#define THREAD_ALIGN(size) (((size) + FPU_STATE_ALIGNMENT - 1) & ~(FPU_STATE_ALIGNMENT - 1))
 
+extern void interrupt_exit();
+extern char _BootStackBottom[];
 
-static volatile uint64_t timer_tick;
-static thread_t* volatile current_thread;   // todo: need one per CPU
-static thread_t* volatile ready_list;       // Threads ready to run
-static thread_t* volatile suspended_list;   // Suspended threads
 
 static thread_t thread0;
 
-static DEFINE_SPINLOCK(scheduler_lock);     // Protects the scheduler and thread lists
+static thread_t* thread_zombies;            // Terminated threads waiting for the reaper
+static DEFINE_SPINLOCK(thread_zombies_lock);
+static work_t thread_reaper_work;
+
+static thread_t* thread_list;               // All threads (for thread_dump_stats())
+static DEFINE_SPINLOCK(thread_list_lock);
+
+
+
+static int timer_callback(interrupt_context_t* context)
+{
+    (void)context;
+
+    //printf("TICK: %d\n", (int)(timer_now() / 1000000));
+
+    timer_expire();
+
+    // End of time slice (or early wakeup), thread_schedule() programs the next expiry.
+    // The switch happens on the way out of the interrupt.
+    cpu_get()->need_resched = 1;
+
+    return 1;
+}
+
+
+
+static void thread_reap(work_t* work);
+
+
+
+// Urgency of a thread as a single number, lower is more urgent. This is only a hint for
+// other CPUs: all deadline threads have the same rank.
+static inline int thread_rank(const thread_t* thread)
+{
+    int level = 0;
+
+    if (thread->sched_class == THREAD_CLASS_FIFO)
+        level = thread->rt_priority;
+    else if (thread->sched_class == THREAD_CLASS_NORMAL)
+        level = thread->priority;
+
+    return thread->sched_class * THREAD_PRIORITY_COUNT + level;
+}
+
+
+
+// Reset a new thread's accounting and add it to the list of all threads
+static void thread_register(thread_t* thread)
+{
+    thread->timestamp = x86_rdtsc();
+    thread->run_cycles = 0;
+    thread->wait_cycles = 0;
+    thread->voluntary_switches = 0;
+    thread->involuntary_switches = 0;
+
+    spin_lock(&thread_list_lock);
+
+    thread->list_prev = NULL;
+    thread->list_next = thread_list;
+    if (thread_list)
+        thread_list->list_prev = thread;
+    thread_list = thread;
+
+    spin_unlock(&thread_list_lock);
+}
+
+
+
+static void thread_unregister(thread_t* thread)
+{
+    spin_lock(&thread_list_lock);
+
+    if (thread->list_prev)
+        thread->list_prev->list_next = thread->list_next;
+    else
+        thread_list = thread->list_next;
+
+    if (thread->list_next)
+        thread->list_next->list_prev = thread->list_prev;
+
+    spin_unlock(&thread_list_lock);
+}
+
+
+
+// FPU save area for the boot flows of execution (created threads keep it on their stack)
+static void* thread_alloc_fpu_state()
+{
+    void* state;
+
+    if (posix_memalign(&state, FPU_STATE_ALIGNMENT, fpu_state_size()))
+    {
+        fatal("thread_alloc_fpu_state() - out of memory");
+    }
+
+    return state;
+}
+
+
+
+void thread_init()
+{
+    thread0.state = THREAD_RUNNING;
+    thread0.priority = THREAD_PRIORITY_NORMAL;
+    thread0.base_priority = THREAD_PRIORITY_NORMAL;
+    thread0.inherited_priority = THREAD_PRIORITY_COUNT;
+    thread0.sched_class = THREAD_CLASS_NORMAL;
+    thread0.rt_priority = 0;
+    thread0.dl_runtime = 0;
+    thread0.dl_period = 0;
+    thread0.dl_deadline = 0;
+    thread0.dl_budget = 0;
+    thread0.stack = _BootStackBottom;
+    thread0.interrupt_frame = NULL;
+    thread0.context = NULL;
+    thread0.function = NULL;
+    thread0.argument = NULL;
+    thread0.cpu = cpu_get();
+    thread0.affinity = THREAD_AFFINITY_ALL;
+    thread0.last_run = 0;
+    thread0.next = NULL;
+    thread0.wake_next = NULL;
+    thread0.prev = NULL;
+    thread0.blocker = NULL;
+    thread0.blocked_on = NULL;
+    thread0.mutex_waiter = NULL;
+    thread0.pi_mutexes = NULL;
+
+    runqueue_init(&thread0.cpu->runqueue);
+
+    thread0.cpu->current_thread = &thread0;
+    thread0.cpu->current_rank = thread_rank(&thread0);
+    thread_register(&thread0);
+
+    fpu_init();
+    fpu_thread_init(&thread0, thread_alloc_fpu_state());
+
+    timer_init();
+    timer_init_cpu();
+    clockevent_init(timer_callback);
+
+    work_setup(&thread_reaper_work, thread_reap, NULL, WORK_PRIORITY_LOW);
+}
+
+
+
+void thread_init_ap()
+{
+    cpu_t* cpu = cpu_get();
+
+    // Wrap the application processor's initial flow of execution in a thread. It becomes
+    // the CPU's idle thread once the CPU is online (see thread_idle()).
+    thread_t* thread = malloc(sizeof(*thread));
+
+    thread->state = THREAD_RUNNING;
+    thread->priority = THREAD_PRIORITY_LOWEST;
+    thread->base_priority = THREAD_PRIORITY_LOWEST;
+    thread->inherited_priority = THREAD_PRIORITY_COUNT;
+    thread->sched_class = THREAD_CLASS_NORMAL;
+    thread->rt_priority = 0;
+    thread->dl_runtime = 0;
+    thread->dl_period = 0;
+    thread->dl_deadline = 0;
+    thread->dl_budget = 0;
+    thread->stack = cpu->stack;
+    thread->interrupt_frame = NULL;
+    thread->context = NULL;
+    thread->function = NULL;
+    thread->argument = NULL;
+    thread->cpu = cpu;
+    thread->affinity = 1u << cpu->id;
+    thread->last_run = 0;
+    thread->next = NULL;
+    thread->prev = NULL;
+    thread->wake_next = NULL;
+    thread->blocker = NULL;
+    thread->blocked_on = NULL;
+    thread->mutex_waiter = NULL;
+    thread->pi_mutexes = NULL;
+
+    runqueue_init(&cpu->runqueue);
+    timer_init_cpu();
+
+    cpu->current_thread = thread;
+    cpu->current_rank = thread_rank(thread);
+    thread_register(thread);
+
+    fpu_init_ap();
+    fpu_thread_init(thread, thread_alloc_fpu_state());
+}
+
+
+
+thread_t* thread_current()
+{
+    return cpu_read(current_thread);
+}
+
+
+
+// Lock the run queue of the current CPU
+static runqueue_t* thread_lock_local_runqueue()
+{
+    for (;;)
+    {
+        // We can be migrated until the lock is taken (interrupts are then disabled)
+        runqueue_t* runqueue = &cpu_read(self)->runqueue;
+
+        spin_lock(&runqueue->lock);
+
+        if (runqueue == &cpu_get()->runqueue)
+            return runqueue;
+
+        spin_unlock(&runqueue->lock);
+    }
+}
+
+
+
+// Lock the run queue a thread belongs to
+static runqueue_t* thread_lock_runqueue(thread_t* thread)
+{
+    for (;;)
+    {
+        // The thread can be stolen by another CPU until the lock is taken
+        runqueue_t* runqueue = &thread->cpu->runqueue;
+
+        spin_lock(&runqueue->lock);
+
+        if (runqueue == &thread->cpu->runqueue)
+            return runqueue;
+
+        spin_unlock(&runqueue->lock);
+    }
+}
+
+
+
+// Can 'thread' run on 'cpu'?
+static inline int thread_allowed(const thread_t* thread, const cpu_t* cpu)
+{
+    return (thread->affinity >> cpu->id) & 1;
+}
+
+
+
+// Pick the least loaded online CPU allowed by the thread's affinity (NULL if none)
+static cpu_t* thread_select_cpu(const thread_t* thread)
+{
+    cpu_t* best = NULL;
+
+    // Counts are read without locking, this is only a hint
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        cpu_t* cpu = &g_cpus[i];
+        if (!cpu->online || !thread_allowed(thread, cpu))
+            continue;
+
+        if (!best || cpu->runqueue.count < best->runqueue.count)
+            best = cpu;
+    }
+
+    return best;
+}
+
+
+
+// Each CPU's counters can be updated by others, hence the atomics
+static inline void thread_count_migration(cpu_t* source, cpu_t* target)
+{
+    __sync_fetch_and_add(&source->migrations_out, 1);
+    __sync_fetch_and_add(&target->migrations_in, 1);
+}
+
+
+
+static void thread_notify_cpu(cpu_t* cpu, thread_t* thread);
+
+
+
+// Queue a THREAD_MIGRATING thread on a CPU allowed by its affinity. No run queue can be
+// locked by the caller.
+static void thread_migrate(thread_t* thread)
+{
+    // Whoever holds the run queue of thread->cpu owns the thread: switch it to the new
+    // CPU's run queue first, then queue it there.
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+
+    cpu_t* source = thread->cpu;
+    cpu_t* target = thread_select_cpu(thread);
+
+    if (!target)
+        target = source;    // thread_set_affinity() doesn't allow this, be safe anyway
+
+    thread->cpu = target;
+
+    spin_unlock(&runqueue->lock);
+
+    runqueue = thread_lock_runqueue(thread);
+
+    thread->state = THREAD_READY;
+    runqueue_push(runqueue, thread);
+
+    if (target != source)
+        thread_count_migration(source, target);
+
+    thread_notify_cpu(thread->cpu, thread);
+
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+// Unlock the run queue of the current CPU. After a context switch, this might not
+// be the run queue that was locked before the switch.
+static void thread_unlock_local_runqueue()
+{
+    cpu_t* cpu = cpu_get();
+
+    thread_t* migrating = cpu->migrating_thread;
+    cpu->migrating_thread = NULL;
+
+    spin_unlock(&cpu->runqueue.lock);
+
+    // The previous thread is off its stack, it can now run elsewhere
+    if (migrating)
+        thread_migrate(migrating);
+}
+
+
+
+// Does the run queue have anything to run other than idle priority threads?
+static inline int thread_runqueue_busy(const runqueue_t* runqueue)
+{
+    return runqueue->deadline.head || runqueue->rt_bitmap || (runqueue->bitmap & ~(1u << THREAD_PRIORITY_LOWEST));
+}
+
+
+
+// Load balancer: steal half of the threads of the busiest CPU. Only time-sharing threads
+// move: cache-hot and idle priority ones are left where they are, so are real-time threads
+// (placed with affinity). Called with the local run queue locked, by a CPU with nothing to do.
+static void thread_steal(cpu_t* cpu)
+{
+    cpu_t* busiest = NULL;
+    int busiestCount = 0;   // 'count' leaves out the running thread: a single ready thread is worth taking
+
+    // Counts are read without locking, this is only a hint
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        cpu_t* victim = &g_cpus[i];
+        if (victim == cpu || !victim->online)
+            continue;
+
+        const int count = victim->runqueue.count;
+        if (count > busiestCount)
+        {
+            busiest = victim;
+            busiestCount = count;
+        }
+    }
+
+    if (!busiest)
+        return;
+
+    // Never wait for the victim's lock: two CPUs stealing from each other would deadlock
+    runqueue_t* source = &busiest->runqueue;
+    if (!spin_trylock(&source->lock))
+        return;
+
+    // Half of its threads, the running one included
+    const uint64_t now = timer_now();
+    int quota = (source->count + 1) / 2;
+
+    for (int priority = THREAD_PRIORITY_HIGHEST; priority != THREAD_PRIORITY_LOWEST && quota > 0; ++priority)
+    {
+        thread_t* next;
+        for (thread_t* thread = source->queues[priority].head; thread && quota > 0; thread = next)
+        {
+            next = thread->next;
+
+            if (now - thread->last_run < THREAD_CACHE_HOT_TIME || !thread_allowed(thread, cpu))
+                continue;
+
+            runqueue_remove(source, thread);
+            thread->cpu = cpu;
+            runqueue_push(&cpu->runqueue, thread);
+            thread_count_migration(busiest, cpu);
+            --quota;
+        }
+    }
+
+    spin_unlock(&source->lock);
+}
+
+
+
+// Program the next clock event for the current CPU: the end of the time slice (or
+// budget) of 'thread' if its class has one, and the nearest timer. When there is nothing
+// to do, no interrupt is programmed at all (tickless).
+static void thread_program_clockevent(runqueue_t* runqueue, thread_t* thread)
+{
+    uint64_t deadline = timer_next_deadline();
+
+    const uint64_t end = sched_class(thread)->slice_end(runqueue, thread, timer_now());
+    if (end < deadline)
+        deadline = end;
+
+    clockevent_set(deadline);
+}
+
+
+
+// A thread is about to run after waiting in a run queue since thread->timestamp
+static inline void thread_account_wait(cpu_t* cpu, thread_t* thread, uint64_t now)
+{
+    // Don't trust small TSC differences between CPUs (the thread might have migrated)
+    const uint64_t wait = now > thread->timestamp ? now - thread->timestamp : 0;
+
+    thread->wait_cycles += wait;
+    thread->timestamp = now;
+
+    int bucket = wait ? 63 - __builtin_clzll(wait) : 0;
+    if (bucket >= THREAD_LATENCY_BUCKETS)
+        bucket = THREAD_LATENCY_BUCKETS - 1;
+
+    cpu->latency_histogram[bucket]++;
+}
+
+
+
+// A suspended thread becomes ready: let its scheduling class know
+static inline void thread_class_wakeup(thread_t* thread)
+{
+    const sched_class_t* class = sched_class(thread);
+
+    if (class->wakeup)
+        class->wakeup(thread, timer_now());
+}
+
+
+
+// An idle CPU other than 'busy' and the current one, NULL if none. Idle states are read
+// without locking, this is only a hint.
+static cpu_t* thread_find_idle_cpu(const cpu_t* busy)
+{
+    const cpu_t* self = cpu_get();
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        cpu_t* cpu = &g_cpus[i];
+        if (cpu == busy || cpu == self || !cpu->online)
+            continue;
+
+        if (cpu->current_thread == cpu->idle_thread)
+            return cpu;
+    }
+
+    return NULL;
+}
+
+
+
+// Idle CPUs sleep until something is queued on their own run queue: get one to run the load
+// balancer when threads start piling up on 'busy' (its run queue is locked).
+static void thread_kick_idle_cpu(cpu_t* busy)
+{
+    // Nothing is waiting behind the running thread
+    if (busy->runqueue.count < 1)
+        return;
+
+    cpu_t* idle = thread_find_idle_cpu(busy);
+    if (idle)
+        smp_send_reschedule(idle);
+}
+
+
+
+// Queue the threads other CPUs woke up for this one (its run queue is locked). Returns
+// whether there were any.
+static int thread_drain_wakelist(runqueue_t* runqueue)
+{
+    thread_t* thread = __atomic_exchange_n(&runqueue->wakelist, NULL, __ATOMIC_ACQUIRE);
+
+    if (!thread)
+        return 0;
+
+    // The list is LIFO, restore the wakeup order
+    thread_t* list = NULL;
+
+    while (thread)
+    {
+        thread_t* next = thread->wake_next;
+        thread->wake_next = list;
+        list = thread;
+        thread = next;
+    }
+
+    const uint64_t now = x86_rdtsc();
+
+    for (thread = list; thread; thread = list)
+    {
+        list = thread->wake_next;
+        thread->wake_next = NULL;
+
+        // A thread can be woken up before it is done suspending itself (we might be that
+        // thread), its state only changes here, with the run queue locked.
+        if (thread->state != THREAD_SUSPENDED)
+        {
+            fatal("%p: thread_wakeup() - Thread isn't suspended! (%d)\n", thread, thread->state);
+        }
+
+        thread->blocker = NULL;
+        thread->timestamp = now;
+        thread_class_wakeup(thread);
+
+        thread->state = THREAD_READY;
+        runqueue_push(runqueue, thread);
+    }
+
+    return 1;
+}
+
+
+
+// This is the scheduler. 'next' is the thread to switch to, or NULL to pick the best
+// ready thread. An explicit 'next' must belong to this CPU and not be in the run queue.
+static void thread_schedule(thread_t* next)
+{
+    cpu_t* cpu = cpu_get();
+    runqueue_t* runqueue = &cpu->runqueue;
+    thread_t* current_thread = cpu->current_thread;
+
+//    printf("%p: READY THREADS: %d\n", thread_current(), runqueue->count);
+
+    if (!spin_is_locked(&runqueue->lock))
+    {
+        fatal("%p: thread_schedule() - run queue not locked!", thread_current());
+    }
+
+    if (cpu->spinlock_count != 1)
+    {
+        fatal("%p: thread_schedule() - spin lock count is not 1", thread_current());
+    }
+
+    if (current_thread->state == THREAD_RUNNING)
+    {
+        fatal("%p: thread_schedule() - Current thread is running!", thread_current());
+    }
+
+    if (interrupt_enabled())
+    {
+        fatal("%p: thread_schedule() - interrupts are enabled!", thread_current());
+    }
+
+    cpu->need_resched = 0;
+
+    // Charge the time slice to the current thread, it now waits from this point
+    const uint64_t now = x86_rdtsc();
+    const uint64_t ran = now - current_thread->timestamp;
+    current_thread->run_cycles += ran;
+    current_thread->timestamp = now;
+
+    const sched_class_t* class = sched_class(current_thread);
+    if (class->charge)
+        class->charge(current_thread, ns_from_tsc_cycles(ran));
+
+    // Queue current thread in the run queue. Suspended threads are only tracked by
+    // whatever they are waiting on.
+    current_thread->last_run = timer_now();
+
+    if (current_thread->state == THREAD_READY && current_thread != cpu->idle_thread)
+    {
+        if (thread_allowed(current_thread, cpu))
+        {
+            runqueue_push(runqueue, current_thread);
+        }
+        else
+        {
+            // Its affinity changed, move it once switched out (see thread_unlock_local_runqueue())
+            current_thread->state = THREAD_MIGRATING;
+            cpu->migrating_thread = current_thread;
+        }
+    }
+
+    // Threads woken up by other CPUs. This comes after queuing the current thread: if
+    // it was woken up while suspending itself, it is queued here.
+    const int woken = thread_drain_wakelist(runqueue);
+
+    thread_t* new_thread = next;
+    thread_t* old_thread = current_thread;
+
+    if (new_thread == NULL)
+    {
+        // Nothing worth running here, try to get some work from another CPU
+        if (!thread_runqueue_busy(runqueue))
+            thread_steal(cpu);
+
+        // Pop the new thread to run (highest priority first), or idle
+        new_thread = runqueue_pop(runqueue);
+
+        if (new_thread == NULL)
+            new_thread = cpu->idle_thread;
+    }
+
+    if (new_thread == NULL)
+    {
+        fatal("%p: thread_schedule() - No thread to run!", thread_current());
+    }
+
+    // Threads left waiting behind the new one might get an idle CPU (see thread_wakeup_remote())
+    if (woken)
+        thread_kick_idle_cpu(cpu);
+
+    thread_program_clockevent(runqueue, new_thread);
+
+    cpu->current_rank = thread_rank(new_thread);
+
+    if (new_thread == old_thread)
+    {
+        // Nothing better to run, keep going
+        new_thread->state = THREAD_RUNNING;
+        return;
+    }
+
+    //printf("%p: thread_schedule() - Switching to thread %p (%d -> %d)\n", old_thread, new_thread, old_thread->state, new_thread->state);
+
+    if (old_thread->state == THREAD_READY || old_thread->state == THREAD_MIGRATING)
+        old_thread->involuntary_switches++;
+    else
+        old_thread->voluntary_switches++;
+
+    // The idle thread doesn't wait for anything, keep it out of the latency histogram
+    if (new_thread == cpu->idle_thread)
+        new_thread->timestamp = now;
+    else
+        thread_account_wait(cpu, new_thread, now);
+
+    new_thread->state = THREAD_RUNNING;
+    new_thread->cpu = cpu;
+    cpu->current_thread = new_thread;
+
+    int interruptsEnabled = cpu->interrupts_enabled;
+    fpu_switch(old_thread);
+    thread_switch(&old_thread->context, new_thread->context);
+
+    // We might be resuming on a different CPU
+    cpu_get()->interrupts_enabled = interruptsEnabled;
+}
+
+
+
+// A thread was queued on 'cpu' (its run queue is locked): make sure the CPU reconsiders
+// what it is running if the thread should preempt or share time with the current one.
+static void thread_notify_cpu(cpu_t* cpu, thread_t* thread)
+{
+    thread_t* current = cpu->current_thread;
+    const int urgency = thread_compare(thread, current);
+
+    if (urgency > 0)
+    {
+        // The thread has to wait, maybe another CPU has nothing to do
+        thread_kick_idle_cpu(cpu);
+        return;
+    }
+
+    if (cpu == cpu_get())
+    {
+        // We can't switch here (caller might hold locks). A more urgent thread runs at the
+        // next preemption point, one of the same priority gets a time slice.
+        if (urgency < 0 || current == cpu->idle_thread)
+            cpu->need_resched = 1;
+        else
+            thread_program_clockevent(&cpu->runqueue, current);
+    }
+    else
+    {
+        // An idle CPU waiting in mwait was woken up by the run queue update. The barrier
+        // orders that update before reading 'idle_polling' (see thread_idle()).
+        __sync_synchronize();
+
+        if (!cpu->idle_polling)
+            smp_send_reschedule(cpu);
+    }
+}
+
+
+
+// Wake up a thread that last ran on another CPU without taking its run queue lock: push it
+// on the CPU's wakelist, that CPU queues it at its next scheduling point.
+static void thread_wakeup_remote(cpu_t* cpu, thread_t* thread)
+{
+    runqueue_t* runqueue = &cpu->runqueue;
+    thread_t* head = __atomic_load_n(&runqueue->wakelist, __ATOMIC_RELAXED);
+
+    do
+    {
+        thread->wake_next = head;
+    }
+    while (!__atomic_compare_exchange_n(&runqueue->wakelist, &head, thread, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    // Only interrupt the CPU if it has to reschedule now: it is idle (unless it waits in
+    // mwait, the push woke it up) or the thread can preempt or share time with its current
+    // one. The exchange above is a full barrier (see thread_idle()).
+    if (cpu->idle_polling)
+        return;
+
+    if (cpu->current_thread == cpu->idle_thread || thread_rank(thread) <= cpu->current_rank)
+    {
+        smp_send_reschedule(cpu);
+        return;
+    }
+
+    // The thread would wait for the CPU's next scheduling point, possibly a whole time slice
+    // away (tickless). Load balancing can't see it until then: if another CPU is idle, have
+    // this one queue it now, thread_schedule() then kicks the idle CPU.
+    if (thread_find_idle_cpu(cpu))
+        smp_send_reschedule(cpu);
+}
+
+
+
+void thread_wakeup(thread_t* thread)
+{
+    // Suspended threads don't migrate: queue the thread on the CPU it last ran on (warm cache)
+    cpu_t* cpu = thread->cpu;
+
+    if (cpu != cpu_read(self) && thread_allowed(thread, cpu))
+    {
+        thread_wakeup_remote(cpu, thread);
+        return;
+    }
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+
+    //printf("%p: thread_wakeup(%p)\n", thread_current(), thread);
+
+    if (thread->state != THREAD_SUSPENDED)
+    {
+        fatal("%p: thread_wakeup() - Thread isn't suspended! (%d)\n", thread, thread->state);
+    }
+
+    thread->blocker = NULL;
+    thread->timestamp = x86_rdtsc();
+    thread_class_wakeup(thread);
+
+    if (!thread_allowed(thread, thread->cpu))
+    {
+        // Its affinity changed while it was suspended
+        thread->state = THREAD_MIGRATING;
+        spin_unlock(&runqueue->lock);
+        thread_migrate(thread);
+        return;
+    }
+
+    thread->state = THREAD_READY;
+
+    runqueue_push(runqueue, thread);
+
+    thread_notify_cpu(thread->cpu, thread);
+
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+void thread_wakeup_switch(thread_t* thread, volatile spinlock_t* lock)
+{
+    cpu_t* cpu = cpu_get();
+    thread_t* current_thread = cpu->current_thread;
+
+    // Only switch from preemptible thread context: no interrupt handler (interrupts were
+    // enabled when 'lock' was taken), no other spin lock held and preemption enabled. The
+    // thread must also be on this CPU (we can't lock two run queues) and deserve to run now.
+    if (!cpu->interrupts_enabled || cpu->spinlock_count != 1 || cpu->preempt_count != 0 ||
+        thread->cpu != cpu || !thread_allowed(thread, cpu) || thread_compare(thread, current_thread) > 0)
+    {
+        thread_wakeup(thread);
+        spin_unlock(lock);
+        return;
+    }
+
+    thread_lock_local_runqueue();
+
+    // 'thread' is out of whatever list 'lock' protects, only the run queue matters now
+    spin_unlock(lock);
+
+    if (thread->state != THREAD_SUSPENDED)
+    {
+        fatal("%p: thread_wakeup_switch() - Thread isn't suspended! (%d)\n", thread, thread->state);
+    }
+
+    if (current_thread->state != THREAD_RUNNING)
+    {
+        fatal("%p: thread_wakeup_switch() - Current thread isn't running! (%d)\n", current_thread, current_thread->state);
+    }
+
+    // The woken thread never goes through the run queue, it didn't wait
+    thread->state = THREAD_READY;
+    thread->blocker = NULL;
+    thread->timestamp = x86_rdtsc();
+    thread_class_wakeup(thread);
+
+    current_thread->state = THREAD_READY;
+
+    thread_schedule(thread);
+
+    thread_unlock_local_runqueue();
+}
+
 
 
-// List helpers
-static inline void list_append(thread_t* volatile* head, thread_t* thread)
+// This code assumes interrupts are disabled, which is the case if we are coming from the timer interrupt
+//todo: make sure interrupts are disabled!
+void thread_yield()
 {
-    thread->next = NULL;
+    thread_lock_local_runqueue();
 
-    if (*head == NULL)
-    {
-        *head = thread;
-    }
-    else
+    thread_t* current_thread = cpu_get()->current_thread;
+
+    if (current_thread->state != THREAD_RUNNING)
     {
-        thread_t* last = *head;
-        while (last->next != NULL)
-            last = last->next;
-        last->next = thread;
+        fatal("%p: thread_yield() - Current thread isn't running! (%d)\n", current_thread, current_thread->state);
     }
+
+    current_thread->state = THREAD_READY;
+
+    thread_schedule(NULL);
+
+    thread_unlock_local_runqueue();
 }
 
 
-static inline thread_t* list_pop(thread_t* volatile* head)
+
+// Take the current thread off the CPU. 'lock' is released once the run queue is locked.
+static void thread_stop(volatile spinlock_t* lock, thread_state_t state)
 {
-    thread_t* thread = *head;
+    thread_lock_local_runqueue();
 
-    if (thread != NULL)
-    {
-        *head = thread->next;
-        thread->next = NULL;
-        return thread;
-    }
-    else
+    thread_t* current_thread = cpu_get()->current_thread;
+
+    if (current_thread->state != THREAD_RUNNING)
     {
-        return NULL;
+        fatal("%p: thread_stop() - Current thread isn't running! (%d)\n", current_thread, current_thread->state);
     }
+
+    current_thread->state = state;
+
+    // Holding the run queue lock, it is now safe to let other CPUs see this thread in
+    // whatever list 'lock' protects: nobody can act on it until we are switched out.
+    spin_unlock(lock);
+
+    thread_schedule(NULL);
+
+    thread_unlock_local_runqueue();
 }
 
 
 
-static inline void list_remove(thread_t* volatile* head, thread_t* thread)
+void thread_suspend(volatile spinlock_t* lock)
 {
-    thread_t** pp = (thread_t**)head;
+    thread_stop(lock, THREAD_SUSPENDED);
+}
 
-    while (*pp != NULL)
-    {
-        if (*pp == thread)
-        {
-            *pp = thread->next;
-            return;
-        }
 
-        pp = &((*pp)->next);
-    }
-}
+
+// State shared between a sleeping thread and its wakeup timer
+typedef struct thread_sleeper
+{
+    timer_t             timer;
+    thread_t*           thread;
+    spinlock_t          lock;       // Held until the thread is suspended so the wakeup can't be lost
+} thread_sleeper_t;
 
 
-static inline int list_size(thread_t* head)
+
+static void thread_sleep_timeout(timer_t* timer)
 {
-    int size = 0;
-    for (thread_t* p = head; p != NULL; p = p ->next)
-        ++size;
-    return size;
+    thread_sleeper_t* sleeper = timer->context;
+
+    spin_lock(&sleeper->lock);
+    thread_wakeup(sleeper->thread);
+    spin_unlock(&sleeper->lock);
 }
 
 
 
-static int timer_callback(interrupt_context_t* context)
+void thread_sleep_ns(uint64_t ns)
 {
-    (void)context;
+    if (ns == 0)
+    {
+        thread_yield();
+        return;
+    }
 
-    __sync_fetch_and_add(&timer_tick, 1);   //todo: use atomic_increment()
+    thread_sleeper_t sleeper;
+    timer_setup(&sleeper.timer, thread_sleep_timeout, &sleeper);
+    spin_lock_init(&sleeper.lock, "thread_sleeper");
 
-    //printf("TICK: %d\n", (int)timer_tick);
+    spin_lock(&sleeper.lock);
 
-    thread_yield();
+    sleeper.thread = cpu_get()->current_thread;
+    timer_add(&sleeper.timer, timer_now() + ns);
 
-    return 1;
+    thread_suspend(&sleeper.lock);
+
+    // Wait for the timer function to be done with 'sleeper'
+    timer_cancel(&sleeper.timer);
 }
 
 
 
-void thread_init()
+// Entry point for all threads.
+static void thread_entry()
 {
-    thread0.state = THREAD_RUNNING;
-    thread0.stack = NULL;               //todo: allocate a proper stack (with guard pages) for thread 0
-    thread0.interrupt_frame = NULL;
-    thread0.context = NULL;
-    thread0.next = NULL;
-    thread0.blocker = NULL;
-
-    current_thread = &thread0;
+    printf("%p: thread_entry()\n", thread_current());
 
-    timer_init(1000, timer_callback);
+    // We got here immediately after a call to switch_context(). This means we
+    // still have the run queue lock and we must release it.
+    thread_unlock_local_runqueue();
 }
 
 
 
-thread_t* thread_current()
+void preempt_schedule()
 {
-    return current_thread;
+    // Code running with interrupts disabled can't be preempted
+    if (!interrupt_enabled())
+        return;
+
+    interrupt_disable();
+
+    const cpu_t* cpu = cpu_get();
+
+    if (cpu->need_resched && cpu->preempt_count == 0 && cpu->spinlock_count == 0)
+        thread_yield();
+
+    interrupt_enable();
 }
 
 
 
-// This is the scheduler
-static void thread_schedule()
+void thread_idle()
 {
-//    printf("%p: LIST SIZES: %d, %d\n", thread_current(), list_size(ready_list), list_size(suspended_list));
+    interrupt_disable();
 
-    if (!scheduler_lock)
-    {
-        fatal("%p: thread_schedule() - scheduler not locked!", thread_current());
-    }
+    // Never queued, the idle thread can't migrate
+    cpu_t* cpu = cpu_get();
+    runqueue_t* runqueue = &cpu->runqueue;
+    thread_t* thread = cpu->current_thread;
 
-    if (g_spinLockCount != 1)
-    {
-        fatal("%p: thread_schedule() - spin lock count is not 1", thread_current());
-    }
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+    const int mwait = (ecx & X86_CPUID1_ECX_MONITOR) != 0;
 
-    if (current_thread->state == THREAD_RUNNING)
-    {
-        fatal("%p: thread_schedule() - Current thread is running!", thread_current());
-    }
+    thread_lock_local_runqueue();
 
-    if (interrupt_enabled())
-    {
-        fatal("%p: thread_schedule() - interrupts are enabled!", thread_current());
-    }
+    thread->priority = THREAD_PRIORITY_LOWEST;
+    thread->base_priority = THREAD_PRIORITY_LOWEST;
+    cpu->current_rank = thread_rank(thread);
+    cpu->idle_thread = thread;
+    cpu->idle_timestamp = x86_rdtsc();
+
+    thread_unlock_local_runqueue();
 
-    if (ready_list == NULL && current_thread->state == THREAD_READY)
+    for (;;)
     {
-        current_thread->state = THREAD_RUNNING;
-        return;
-    }
+        // Interrupts are disabled: nothing can be queued by this CPU behind our back. Other
+        // CPUs see that we are idle before we look at the wakelist (see thread_wakeup_remote()).
+        __sync_synchronize();
 
-    // Append current thread to ready_list or suspended_list
-    thread_t* volatile* list = (current_thread->state == THREAD_READY) ? &ready_list : &suspended_list;
-    list_append(list, current_thread);
+        if (!runqueue_empty(runqueue) || runqueue->wakelist)
+        {
+            thread_yield();
+            continue;
+        }
 
-    // Pop the new thread to run
-    thread_t* new_thread = list_pop(&ready_list);
-    thread_t* old_thread = current_thread;
+        const uint64_t start = x86_rdtsc();
 
-    //printf("%p: thread_schedule() - Switching to thread %p (%d -> %d)\n", old_thread, new_thread, old_thread->state, new_thread->state);
+        if (mwait)
+        {
+            // Remote CPUs skip the IPI while 'idle_polling' is set: their update of the
+            // run queue ends the mwait. Arm the monitor before checking the run queue
+            // again so that no update can be missed.
+            cpu->idle_polling = 1;
+            __sync_synchronize();
 
-    new_thread->state = THREAD_RUNNING;
-    current_thread = new_thread;
+            x86_monitor(&runqueue->count);
 
-    int interruptsEnabled = g_interruptsEnabled;
-    thread_switch(&old_thread->context, new_thread->context);
-    g_interruptsEnabled = interruptsEnabled;
+            if (runqueue_empty(runqueue) && !runqueue->wakelist)
+                x86_sti_mwait();
+        }
+        else
+        {
+            x86_sti_hlt();
+        }
+
+        interrupt_disable();
+
+        cpu->idle_polling = 0;
+        cpu->idle_cycles += x86_rdtsc() - start;
+        cpu->idle_wakeups++;
+    }
 }
 
 
 
-void thread_wakeup(thread_t* thread)
+// Free terminated threads. This can't be done by the threads themselves as they are
+// running on the stack being freed.
+static void thread_reap(work_t* work)
 {
-    spin_lock(&scheduler_lock);
-
-    //printf("%p: thread_wakeup(%p)\n", thread_current(), thread);
+    (void)work;
 
-    if (thread->state != THREAD_SUSPENDED)
+    for (;;)
     {
-        fatal("%p: thread_wakeup() - Thread isn't suspended! (%d)\n", thread, thread->state);
-    }
+        spin_lock(&thread_zombies_lock);
 
-    thread->state = THREAD_READY;
-    thread->blocker = NULL;
+        thread_t* thread = thread_zombies;
+        if (thread)
+            thread_zombies = thread->next;
+
+        spin_unlock(&thread_zombies_lock);
+
+        if (!thread)
+            break;
+
+        // The thread's CPU holds its run queue lock until the thread is switched out
+        runqueue_t* runqueue = thread_lock_runqueue(thread);
+        spin_unlock(&runqueue->lock);
 
-    list_remove(&suspended_list, thread);
-    list_append(&ready_list, thread);
+        thread_unregister(thread);
 
-    spin_unlock(&scheduler_lock);
+        // The thread structure and FPU state live on the stack
+        stack_free(thread->stack);
+    }
 }
 
 
 
-// This code assumes interrupts are disabled, which is the case if we are coming from the timer interrupt
-//todo: make sure interrupts are disabled!
-void thread_yield()
+void thread_exit()
 {
-    spin_lock(&scheduler_lock);
+    thread_t* thread = thread_current();
 
-    if (current_thread->state != THREAD_RUNNING && current_thread->state != THREAD_SUSPENDED)
-    {
-        fatal("%p: thread_yield() - Current thread isn't running! (%d)\n", current_thread, current_thread->state);
-    }
+    //printf("%p: thread_exit()\n", thread);
 
-    if (current_thread->state == THREAD_RUNNING)
+    // Threads wrapping a CPU's boot flow of execution don't own their stack
+    if (thread->function == NULL)
     {
-        current_thread->state = THREAD_READY;
+        fatal("%p: thread_exit() - boot threads can't exit", thread);
     }
 
-    thread_schedule();
-
-    spin_unlock(&scheduler_lock);
-}
+    // Give back the CPU time reserved for this thread
+    if (thread->sched_class == THREAD_CLASS_DEADLINE)
+        thread_set_normal(thread);
 
+    spin_lock(&thread_zombies_lock);
 
+    thread->next = thread_zombies;
+    thread_zombies = thread;
 
-// Entry point for all threads.
-static void thread_entry()
-{
-    printf("%p: thread_entry()\n", thread_current());
+    work_queue(&thread_reaper_work);
 
-    // We got here immediately after a call to switch_context(). This means we
-    // still have the scheduler lock and we must release it.
-    spin_unlock(&scheduler_lock);
+    // This releases the zombies lock
+    thread_stop(&thread_zombies_lock, THREAD_TERMINATED);
 
-    // IRQ 0 (PIT) is disabled at this point, re-enable it
-    pic_enable_irq(0);
+    fatal("%p: thread_exit() - terminated thread resumed", thread);
 }
 
 
 
-// Exit point for threads that exit normally (returning from their thread function).
-static void thread_exit()
+// First code executed by a new thread (returned to from the scheduler's interrupt frame)
+static void thread_start()
 {
-    printf("%p: thread_exit()\n", thread_current());
+    thread_t* thread = thread_current();
 
-    //todo: kill current thread (i.e. zombify it)
-    //todo: yield() / schedule()
+    thread->function(thread->argument);
 
-    cpu_halt();
+    thread_exit();
 }
 
 
 
-thread_t* thread_create(thread_function_t user_thread_function)
+thread_t* thread_create(thread_function_t function, void* argument)
 {
-    //todo: don't like this malloc
-    thread_t* thread = malloc(sizeof(*thread));
+    /*
+        The thread structure and its FPU save area are carved from the top of the stack:
+        creating a thread is only a pop from the stack cache.
+    */
+
+    char* stack = stack_alloc();
+    char* top = stack + STACK_SIZE;
+
+    thread_t* thread = (thread_t*)(top - THREAD_ALIGN(sizeof(thread_t)));
+    void* fpuState = (char*)thread - THREAD_ALIGN(fpu_state_size());
 
-    //todo: proper stack allocation with guard pages
     thread->state = THREAD_READY;
-    thread->stack = vmm_alloc(THREAD_STACK_SIZE);
+    thread->priority = THREAD_PRIORITY_NORMAL;
+    thread->base_priority = THREAD_PRIORITY_NORMAL;
+    thread->inherited_priority = THREAD_PRIORITY_COUNT;
+    thread->sched_class = THREAD_CLASS_NORMAL;
+    thread->rt_priority = 0;
+    thread->dl_runtime = 0;
+    thread->dl_period = 0;
+    thread->dl_deadline = 0;
+    thread->dl_budget = 0;
+    thread->stack = stack;
+    thread->function = function;
+    thread->argument = argument;
+    fpu_thread_init(thread, fpuState);
+    thread_register(thread);
 
 
     /*
         We are going to build multiple frames on the stack
     */
 
-    char* stack = thread->stack + THREAD_STACK_SIZE;
+    stack = fpuState;
 
 
     /*
@@ -302,7 +1184,7 @@ thread_t* thread_create(thread_function_t user_thread_function)
 
 
     /*
-        Setup an interrupt_context_t frame that returns to the user's thread function.
+        Setup an interrupt_context_t frame that returns to thread_start().
     */
 
     stack = stack - sizeof(interrupt_context_t);
@@ -318,11 +1200,11 @@ thread_t* thread_create(thread_function_t user_thread_function)
 
 #if defined(__i386__)
     thread->interrupt_frame->eflags = X86_EFLAGS_IF; // IF = Interrupt Enable
-    thread->interrupt_frame->eip = (uintptr_t)user_thread_function;
+    thread->interrupt_frame->eip = (uintptr_t)thread_start;
     thread->interrupt_frame->esp = (uintptr_t)(stack + sizeof(interrupt_context_t));
 #elif defined(__x86_64__)
     thread->interrupt_frame->rflags = X86_EFLAGS_IF; // IF = Interrupt Enable
-    thread->interrupt_frame->rip = (uintptr_t)user_thread_function;
+    thread->interrupt_frame->rip = (uintptr_t)thread_start;
     thread->interrupt_frame->rsp = (uintptr_t)(stack + sizeof(interrupt_context_t));
 #endif
 
@@ -354,13 +1236,327 @@ thread_t* thread_create(thread_function_t user_thread_function)
     */
 
     assert(interrupt_enabled());
-    spin_lock(&scheduler_lock);
+    runqueue_t* runqueue = thread_lock_local_runqueue();
 
+    // Start on this CPU, the load balancer will move the thread if needed
+    thread->cpu = cpu_get();
+    thread->affinity = THREAD_AFFINITY_ALL;
+    thread->last_run = 0;
+    thread->wake_next = NULL;
     thread->blocker = NULL;
+    thread->blocked_on = NULL;
+    thread->mutex_waiter = NULL;
+    thread->pi_mutexes = NULL;
 
-    list_append(&ready_list, thread);
+    runqueue_push(runqueue, thread);
 
-    spin_unlock(&scheduler_lock);
+    thread_notify_cpu(thread->cpu, thread);
+
+    spin_unlock(&runqueue->lock);
 
     return thread;
 }
+
+
+
+// Recompute the effective priority of a thread (its run queue is locked)
+static void thread_update_priority(runqueue_t* runqueue, thread_t* thread)
+{
+    const int priority = thread->inherited_priority < thread->base_priority ? thread->inherited_priority : thread->base_priority;
+
+    if (priority == thread->priority)
+        return;
+
+    if (thread->state == THREAD_READY && thread->sched_class == THREAD_CLASS_NORMAL)
+    {
+        // Move the thread to the queue matching its new priority
+        runqueue_remove(runqueue, thread);
+        thread->priority = priority;
+        runqueue_push(runqueue, thread);
+    }
+    else
+    {
+        thread->priority = priority;
+
+        if (thread->state == THREAD_RUNNING)
+            thread->cpu->current_rank = thread_rank(thread);
+    }
+}
+
+
+
+void thread_set_priority(thread_t* thread, int priority)
+{
+    assert(priority >= THREAD_PRIORITY_HIGHEST && priority <= THREAD_PRIORITY_LOWEST);
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+
+    thread->base_priority = priority;
+    thread_update_priority(runqueue, thread);
+
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+void thread_set_inherited_priority(thread_t* thread, int priority)
+{
+    assert(priority >= THREAD_PRIORITY_HIGHEST && priority <= THREAD_PRIORITY_COUNT);
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+
+    thread->inherited_priority = priority;
+    thread_update_priority(runqueue, thread);
+
+    // A boosted thread waiting in a run queue might now deserve its CPU
+    if (thread->state == THREAD_READY)
+        thread_notify_cpu(thread->cpu, thread);
+
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+int thread_compare(const thread_t* a, const thread_t* b)
+{
+    if (a->sched_class != b->sched_class)
+        return a->sched_class < b->sched_class ? -1 : 1;
+
+    return sched_class(a)->compare(a, b);
+}
+
+
+
+// Scheduling class and parameters (see thread_t)
+typedef struct
+{
+    thread_class_t  sched_class;
+    int             rt_priority;
+    uint64_t        dl_runtime;
+    uint64_t        dl_period;
+} thread_sched_params_t;
+
+
+
+// Fixed point fraction of a CPU reserved by a deadline thread
+static inline uint32_t thread_dl_bandwidth(uint64_t runtime, uint64_t period)
+{
+    return (uint32_t)(runtime * THREAD_DL_BANDWIDTH_UNIT / period);
+}
+
+
+
+// Change the scheduling class and parameters of a thread (its run queue is locked)
+static void thread_change_class(runqueue_t* runqueue, thread_t* thread, const thread_sched_params_t* params)
+{
+    // Class and parameters decide where the thread is queued
+    const int queued = thread->state == THREAD_READY;
+    if (queued)
+        runqueue_remove(runqueue, thread);
+
+    if (thread->sched_class == THREAD_CLASS_DEADLINE)
+        runqueue->dl_bandwidth -= thread_dl_bandwidth(thread->dl_runtime, thread->dl_period);
+
+    thread->sched_class = params->sched_class;
+    thread->rt_priority = params->rt_priority;
+    thread->dl_runtime = params->dl_runtime;
+    thread->dl_period = params->dl_period;
+
+    if (thread->sched_class == THREAD_CLASS_DEADLINE)
+    {
+        // Start with a full budget
+        thread->dl_deadline = timer_now() + thread->dl_period;
+        thread->dl_budget = thread->dl_runtime;
+        runqueue->dl_bandwidth += thread_dl_bandwidth(thread->dl_runtime, thread->dl_period);
+    }
+
+    if (queued)
+    {
+        runqueue_push(runqueue, thread);
+        thread_notify_cpu(thread->cpu, thread);
+    }
+    else if (thread->state == THREAD_RUNNING)
+    {
+        thread->cpu->current_rank = thread_rank(thread);
+
+        // The thread might not deserve its CPU anymore
+        if (thread->cpu == cpu_get())
+            thread->cpu->need_resched = 1;
+        else
+            smp_send_reschedule(thread->cpu);
+    }
+}
+
+
+
+void thread_set_normal(thread_t* thread)
+{
+    const thread_sched_params_t params = { THREAD_CLASS_NORMAL, 0, 0, 0 };
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+    thread_change_class(runqueue, thread, &params);
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+void thread_set_fifo(thread_t* thread, int priority)
+{
+    assert(priority >= THREAD_RT_PRIORITY_HIGHEST && priority <= THREAD_RT_PRIORITY_LOWEST);
+
+    const thread_sched_params_t params = { THREAD_CLASS_FIFO, priority, 0, 0 };
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+    thread_change_class(runqueue, thread, &params);
+    spin_unlock(&runqueue->lock);
+}
+
+
+
+int thread_set_deadline(thread_t* thread, uint64_t runtime, uint64_t period)
+{
+    if (runtime == 0 || runtime > period || period > THREAD_DL_MAX_PERIOD)
+        return 0;
+
+    const thread_sched_params_t params = { THREAD_CLASS_DEADLINE, 0, runtime, period };
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+
+    // Admission control: the reservations of a CPU can't add up to more than the limit
+    uint32_t bandwidth = runqueue->dl_bandwidth + thread_dl_bandwidth(runtime, period);
+    if (thread->sched_class == THREAD_CLASS_DEADLINE)
+        bandwidth -= thread_dl_bandwidth(thread->dl_runtime, thread->dl_period);
+
+    if (bandwidth > THREAD_DL_BANDWIDTH_MAX)
+    {
+        spin_unlock(&runqueue->lock);
+        return 0;
+    }
+
+    thread->affinity = 1u << thread->cpu->id;
+    thread_change_class(runqueue, thread, &params);
+
+    spin_unlock(&runqueue->lock);
+
+    return 1;
+}
+
+
+
+int thread_set_affinity(thread_t* thread, uint32_t affinity)
+{
+    int online = 0;
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        if (g_cpus[i].online && ((affinity >> i) & 1))
+            online = 1;
+    }
+
+    if (!online)
+        return 0;
+
+    runqueue_t* runqueue = thread_lock_runqueue(thread);
+    cpu_t* cpu = thread->cpu;
+    int migrate = 0;
+
+    // The deadline reservation belongs to the CPU's run queue
+    if (thread->sched_class == THREAD_CLASS_DEADLINE)
+    {
+        spin_unlock(&runqueue->lock);
+        return 0;
+    }
+
+    thread->affinity = affinity;
+
+    if (!thread_allowed(thread, cpu))
+    {
+        if (thread->state == THREAD_READY)
+        {
+            runqueue_remove(runqueue, thread);
+            thread->state = THREAD_MIGRATING;
+            migrate = 1;
+        }
+        else if (thread->state == THREAD_RUNNING)
+        {
+            // thread_schedule() moves it once it is switched out
+            if (cpu == cpu_get())
+                cpu->need_resched = 1;
+            else
+                smp_send_reschedule(cpu);
+        }
+
+        // Suspended threads move when woken up, migrating ones go to an allowed CPU anyway
+    }
+
+    // If we just moved ourselves away, this is where the switch happens
+    spin_unlock(&runqueue->lock);
+
+    if (migrate)
+        thread_migrate(thread);
+
+    return 1;
+}
+
+
+
+void thread_dump_stats()
+{
+    static const char* const states[] = { "running", "ready", "suspended", "terminated", "migrating" };
+
+    // printf() has no 64 bits support, show times as unsigned long microseconds
+    printf("%-18s %-10s %-8s %4s %12s %12s %10s %10s\n", "thread", "state", "class", "prio", "run (us)", "wait (us)", "voluntary", "preempted");
+
+    spin_lock(&thread_list_lock);
+
+    for (thread_t* thread = thread_list; thread; thread = thread->list_next)
+    {
+        printf("%-18p %-10s %-8s %4d %12lu %12lu %10lu %10lu\n",
+            thread,
+            states[thread->state],
+            sched_class(thread)->name,
+            thread->sched_class == THREAD_CLASS_FIFO ? thread->rt_priority : thread->priority,
+            (unsigned long)(ns_from_tsc_cycles(thread->run_cycles) / 1000),
+            (unsigned long)(ns_from_tsc_cycles(thread->wait_cycles) / 1000),
+            (unsigned long)thread->voluntary_switches,
+            (unsigned long)thread->involuntary_switches);
+    }
+
+    spin_unlock(&thread_list_lock);
+
+    printf("\n%-4s %12s %12s %6s %10s %10s\n", "cpu", "idle (us)", "wakeups", "idle %", "migr in", "migr out");
+
+    const uint64_t now = x86_rdtsc();
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        const cpu_t* cpu = &g_cpus[i];
+        if (!cpu->idle_thread)
+            continue;
+
+        const uint64_t elapsed = now - cpu->idle_timestamp;
+
+        printf("%-4d %12lu %12lu %5lu%% %10lu %10lu\n",
+            cpu->id,
+            (unsigned long)(ns_from_tsc_cycles(cpu->idle_cycles) / 1000),
+            (unsigned long)cpu->idle_wakeups,
+            (unsigned long)(elapsed ? cpu->idle_cycles * 100 / elapsed : 0),
+            (unsigned long)cpu->migrations_in,
+            (unsigned long)cpu->migrations_out);
+    }
+
+    printf("\nRun queue latency (wakeup to running):\n");
+
+    for (int bucket = 0; bucket != THREAD_LATENCY_BUCKETS; ++bucket)
+    {
+        // Counters of other CPUs might be in the middle of an update, close enough
+        unsigned long count = 0;
+        for (int cpu = 0; cpu != g_cpu_count; ++cpu)
+            count += g_cpus[cpu].latency_histogram[bucket];
+
+        if (count)
+        {
+            printf("    >= %10lu ns: %lu\n", (unsigned long)ns_from_tsc_cycles(1ull << bucket), count);
+        }
+    }
+}
@@ -0,0 +1,359 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <kernel/timer.h>
+#include <kernel/clockevent.h>
+#include <kernel/cpu.h>
+
+#include <stddef.h>
+#include <xmmintrin.h>
+
+
+#define TIMER_WHEEL_SLOT_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_TICK        (1ull << TIMER_WHEEL_SHIFT)
+
+// Ticks covered by levels 0..N
+#define TIMER_WHEEL_RANGE(level)    (1ull << (TIMER_WHEEL_SLOT_BITS * ((level) + 1)))
+
+
+
+// Index of the first bit set in 'bitmap' starting at 'start' and wrapping around.
+// Returns the distance from 'start'. 'bitmap' must not be 0.
+static inline int timer_bitmap_distance(uint64_t bitmap, int start)
+{
+    const uint64_t rotated = start ? (bitmap >> start) | (bitmap << (64 - start)) : bitmap;
+    return __builtin_ctzll(rotated);
+}
+
+
+
+static void timer_wheel_insert(timer_wheel_t* wheel, timer_t* timer)
+{
+    uint64_t expires = timer->expires;
+
+    // Expired timers go in the next slot to process
+    if (expires < wheel->clock)
+        expires = wheel->clock;
+
+    // Timers beyond the wheel's range are parked in the last level
+    if (expires - wheel->clock >= TIMER_WHEEL_RANGE(TIMER_WHEEL_LEVELS - 1))
+        expires = wheel->clock + TIMER_WHEEL_RANGE(TIMER_WHEEL_LEVELS - 1) - 1;
+
+    int level = 0;
+    while (expires - wheel->clock >= TIMER_WHEEL_RANGE(level))
+        ++level;
+
+    const int index = (expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+    timer_t** slot = &wheel->slots[level][index];
+
+    timer->prev = NULL;
+    timer->next = *slot;
+
+    if (*slot)
+        (*slot)->prev = timer;
+
+    *slot = timer;
+    timer->slot = slot;
+
+    wheel->bitmap[level] |= 1ull << index;
+    wheel->count++;
+}
+
+
+
+static void timer_wheel_remove(timer_wheel_t* wheel, timer_t* timer)
+{
+    timer_t** slot = timer->slot;
+
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *slot = timer->next;
+
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (!*slot)
+    {
+        const int offset = slot - &wheel->slots[0][0];
+        wheel->bitmap[offset / TIMER_WHEEL_SLOTS] &= ~(1ull << (offset % TIMER_WHEEL_SLOTS));
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+
+
+// Move the timers of a slot down the wheel. Returns the slot index.
+static int timer_wheel_cascade(timer_wheel_t* wheel, int level)
+{
+    const int index = (wheel->clock >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+    timer_t** slot = &wheel->slots[level][index];
+
+    while (*slot)
+    {
+        timer_t* timer = *slot;
+        timer_wheel_remove(wheel, timer);
+        timer_wheel_insert(wheel, timer);
+    }
+
+    return index;
+}
+
+
+
+// Next tick with something to process (UINT64_MAX if the wheel is empty)
+static uint64_t timer_wheel_next_tick(const timer_wheel_t* wheel)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (!wheel->count)
+        return next;
+
+    for (int level = 0; level != TIMER_WHEEL_LEVELS; ++level)
+    {
+        const uint64_t bitmap = wheel->bitmap[level];
+        if (!bitmap)
+            continue;
+
+        // Slots of this level are reached when all lower levels wrap around
+        const int shift = TIMER_WHEEL_SLOT_BITS * level;
+        const uint64_t start = (wheel->clock + (1ull << shift) - 1) >> shift;
+        const uint64_t tick = (start + timer_bitmap_distance(bitmap, start & TIMER_WHEEL_SLOT_MASK)) << shift;
+
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+
+
+void timer_init_cpu()
+{
+    timer_wheel_t* wheel = &cpu_get()->timers;
+
+    spin_lock_init(&wheel->lock, "timer_wheel");
+    wheel->clock = timer_now() >> TIMER_WHEEL_SHIFT;
+    wheel->count = 0;
+    wheel->running = NULL;
+
+    for (int level = 0; level != TIMER_WHEEL_LEVELS; ++level)
+    {
+        wheel->bitmap[level] = 0;
+
+        for (int index = 0; index != TIMER_WHEEL_SLOTS; ++index)
+            wheel->slots[level][index] = NULL;
+    }
+}
+
+
+
+void timer_stall(uint64_t ns)
+{
+    const uint64_t end = timer_now() + ns;
+
+    while (timer_now() < end)
+        _mm_pause();
+}
+
+
+
+void timer_expire()
+{
+    timer_wheel_t* wheel = &cpu_get()->timers;
+
+    spin_lock(&wheel->lock);
+
+    const uint64_t now = timer_now() >> TIMER_WHEEL_SHIFT;
+
+    while (wheel->clock <= now)
+    {
+        // Skip over empty slots, catching up with the current time if nothing is due
+        const uint64_t next = timer_wheel_next_tick(wheel);
+
+        if (next > wheel->clock)
+        {
+            wheel->clock = next <= now ? next : now + 1;
+            continue;
+        }
+
+        const int index = wheel->clock & TIMER_WHEEL_SLOT_MASK;
+
+        if (index == 0)
+        {
+            // Level 0 wrapped around, bring down the next batch of timers
+            for (int level = 1; level != TIMER_WHEEL_LEVELS; ++level)
+            {
+                if (timer_wheel_cascade(wheel, level))
+                    break;
+            }
+        }
+
+        // Timers re-armed by their function for the current tick go to the next slot
+        wheel->clock++;
+
+        timer_t** slot = &wheel->slots[0][index];
+
+        while (*slot)
+        {
+            timer_t* timer = *slot;
+            timer_wheel_remove(wheel, timer);
+            wheel->running = timer;
+
+            // The function is free to re-arm the timer
+            spin_unlock(&wheel->lock);
+            timer->function(timer);
+            spin_lock(&wheel->lock);
+
+            wheel->running = NULL;
+        }
+    }
+
+    spin_unlock(&wheel->lock);
+}
+
+
+
+uint64_t timer_next_deadline()
+{
+    timer_wheel_t* wheel = &cpu_get()->timers;
+
+    spin_lock(&wheel->lock);
+
+    const uint64_t tick = timer_wheel_next_tick(wheel);
+
+    spin_unlock(&wheel->lock);
+
+    return tick == UINT64_MAX ? TIMER_INFINITE : tick << TIMER_WHEEL_SHIFT;
+}
+
+
+
+void timer_setup(timer_t* timer, timer_function_t function, void* context)
+{
+    timer->deadline = 0;
+    timer->function = function;
+    timer->context = context;
+    timer->expires = 0;
+    timer->wheel = NULL;
+    timer->slot = NULL;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+
+
+// Lock the wheel a timer was last added to. Returns NULL if the timer was never added.
+static timer_wheel_t* timer_lock_wheel(timer_t* timer)
+{
+    for (;;)
+    {
+        timer_wheel_t* wheel = *(timer_wheel_t* volatile*)&timer->wheel;
+
+        if (!wheel)
+            return NULL;
+
+        spin_lock(&wheel->lock);
+
+        if (timer->wheel == wheel)
+            return wheel;
+
+        // The timer was re-armed on another CPU
+        spin_unlock(&wheel->lock);
+    }
+}
+
+
+
+void timer_add(timer_t* timer, uint64_t deadline)
+{
+    // Take the timer off the wheel it is currently on, it might belong to another CPU
+    timer_wheel_t* wheel = timer_lock_wheel(timer);
+
+    if (wheel)
+    {
+        if (timer->slot)
+            timer_wheel_remove(wheel, timer);
+
+        spin_unlock(&wheel->lock);
+    }
+
+    // cpu_get() isn't stable until a lock is held (interrupts are disabled)
+    for (;;)
+    {
+        wheel = &cpu_get()->timers;
+        spin_lock(&wheel->lock);
+
+        if (wheel == &cpu_get()->timers)
+            break;
+
+        spin_unlock(&wheel->lock);
+    }
+
+    timer->deadline = deadline;
+    timer->expires = (deadline >> TIMER_WHEEL_SHIFT) + ((deadline & (TIMER_WHEEL_TICK - 1)) != 0);
+    timer->wheel = wheel;
+
+    timer_wheel_insert(wheel, timer);
+
+    // Make sure this CPU wakes up in time
+    clockevent_set_earlier(timer->expires << TIMER_WHEEL_SHIFT);
+
+    spin_unlock(&wheel->lock);
+}
+
+
+
+int timer_cancel(timer_t* timer)
+{
+    for (;;)
+    {
+        timer_wheel_t* wheel = timer_lock_wheel(timer);
+
+        if (!wheel)
+            return 0;
+
+        if (wheel->running != timer)
+        {
+            const int pending = timer->slot != NULL;
+
+            if (pending)
+                timer_wheel_remove(wheel, timer);
+
+            spin_unlock(&wheel->lock);
+            return pending;
+        }
+
+        spin_unlock(&wheel->lock);
+
+        // The timer function is running on another CPU (and might re-arm the timer)
+        _mm_pause();
+    }
+}
@@ -0,0 +1,211 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <kernel/workqueue.h>
+#include <kernel/cpu.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+#define WORK_WORKERS_PER_POOL 2     // Workers per CPU and priority class, more than one so that blocking work doesn't stall the pool
+
+
+// Pool of worker threads serving one CPU and priority class
+typedef struct work_pool
+{
+    spinlock_t      lock;           // Protects the pool
+    work_t*         head;           // Queued work (FIFO)
+    work_t*         tail;
+    int             running;        // Number of work functions running
+    semaphore_t     ready;          // Count of queued work, workers wait on it
+    wait_queue_t    idle_waiters;   // Threads waiting for the pool to be idle (work_flush())
+} work_pool_t;
+
+
+// Thread priority of the workers of each class
+static const int work_thread_priorities[WORK_PRIORITY_COUNT] =
+{
+    THREAD_PRIORITY_NORMAL - 8,     // WORK_PRIORITY_HIGH
+    THREAD_PRIORITY_NORMAL,         // WORK_PRIORITY_NORMAL
+    THREAD_PRIORITY_LOWEST - 1,     // WORK_PRIORITY_LOW
+};
+
+
+static work_pool_t work_pools[MAX_CPUS][WORK_PRIORITY_COUNT];
+
+
+
+static inline int work_pool_idle(const work_pool_t* pool)
+{
+    return pool->head == NULL && pool->running == 0;
+}
+
+
+
+static void work_worker(void* argument)
+{
+    work_pool_t* pool = argument;
+
+    for (;;)
+    {
+        semaphore_lock(&pool->ready);
+
+        spin_lock(&pool->lock);
+
+        work_t* work = pool->head;
+        pool->head = work->next;
+        if (!pool->head)
+            pool->tail = NULL;
+
+        work->next = NULL;
+        work->pending = 0;
+        pool->running++;
+
+        spin_unlock(&pool->lock);
+
+        // The function is free to block, queue the work again or free it
+        work->function(work);
+
+        spin_lock(&pool->lock);
+
+        pool->running--;
+
+        if (work_pool_idle(pool))
+        {
+            while (pool->idle_waiters.head)
+            {
+                waiter_t* waiter = pool->idle_waiters.head;
+                wait_queue_remove(&pool->idle_waiters, waiter);
+                waiter->status = WAITER_WOKEN;
+                thread_wakeup(waiter->thread);
+            }
+        }
+
+        spin_unlock(&pool->lock);
+    }
+}
+
+
+
+void work_init()
+{
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        for (int priority = 0; priority != WORK_PRIORITY_COUNT; ++priority)
+        {
+            work_pool_t* pool = &work_pools[i][priority];
+
+            spin_lock_init(&pool->lock, "work_pool");
+            pool->head = NULL;
+            pool->tail = NULL;
+            pool->running = 0;
+            semaphore_init(&pool->ready, 0);
+            wait_queue_init(&pool->idle_waiters);
+
+            for (int worker = 0; worker != WORK_WORKERS_PER_POOL; ++worker)
+            {
+                // Keep workers on their pool's CPU (this fails for CPUs that didn't start)
+                thread_t* thread = thread_create(work_worker, pool);
+                thread_set_priority(thread, work_thread_priorities[priority]);
+                thread_set_affinity(thread, 1u << g_cpus[i].id);
+            }
+        }
+    }
+
+    printf("Work queues: %d worker threads per CPU\n", WORK_PRIORITY_COUNT * WORK_WORKERS_PER_POOL);
+}
+
+
+
+void work_setup(work_t* work, work_function_t function, void* context, work_priority_t priority)
+{
+    work->function = function;
+    work->context = context;
+    work->priority = priority;
+    work->pending = 0;
+    work->next = NULL;
+}
+
+
+
+int work_queue(work_t* work)
+{
+    // Only one caller gets to queue the work
+    if (__sync_lock_test_and_set(&work->pending, 1))
+        return 0;
+
+    // Migrating right after reading the CPU id is harmless: any pool will do
+    work_pool_t* pool = &work_pools[cpu_read(id)][work->priority];
+
+    spin_lock(&pool->lock);
+
+    work->next = NULL;
+
+    if (pool->tail)
+        pool->tail->next = work;
+    else
+        pool->head = work;
+
+    pool->tail = work;
+
+    spin_unlock(&pool->lock);
+
+    semaphore_unlock(&pool->ready);
+
+    return 1;
+}
+
+
+
+void work_flush()
+{
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        for (int priority = 0; priority != WORK_PRIORITY_COUNT; ++priority)
+        {
+            work_pool_t* pool = &work_pools[i][priority];
+
+            spin_lock(&pool->lock);
+
+            while (!work_pool_idle(pool))
+            {
+                waiter_t waiter;
+                waiter.thread = thread_current();
+                wait_queue_append(&pool->idle_waiters, &waiter);
+
+                // This releases the pool lock
+                thread_suspend(&pool->lock);
+
+                spin_lock(&pool->lock);
+            }
+
+            spin_unlock(&pool->lock);
+        }
+    }
+}
@@ -0,0 +1,222 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <kernel/x86/apic.h>
+#include <kernel/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/timer.h>
+#include <kernel/vmm.h>
+#include <kernel/x86/cpu.h>
+
+#include <assert.h>
+#include <xmmintrin.h>
+
+
+// Local APIC registers (offsets from the APIC base)
+#define APIC_ID             0x020
+#define APIC_TPR            0x080   // Task Priority Register
+#define APIC_EOI            0x0B0
+#define APIC_SVR            0x0F0   // Spurious Interrupt Vector Register
+#define APIC_ICR_LOW        0x300   // Interrupt Command Register
+#define APIC_ICR_HIGH       0x310
+#define APIC_LVT_TIMER      0x320
+#define APIC_TIMER_INITIAL  0x380   // Initial count
+#define APIC_TIMER_CURRENT  0x390   // Current count
+#define APIC_TIMER_DIVIDE   0x3E0   // Divide configuration
+
+#define APIC_SVR_ENABLE     0x100
+
+#define APIC_ICR_FIXED      0x00000
+#define APIC_ICR_INIT       0x00500
+#define APIC_ICR_STARTUP    0x00600
+#define APIC_ICR_PENDING    0x01000 // Delivery status
+#define APIC_ICR_ASSERT     0x04000
+#define APIC_ICR_LEVEL      0x08000
+
+#define APIC_LVT_MASKED             0x10000
+#define APIC_LVT_TIMER_ONESHOT      0x00000
+#define APIC_LVT_TIMER_TSC_DEADLINE 0x40000
+
+#define APIC_TIMER_DIVIDE_16        0x3
+
+
+static volatile uint32_t* apic_registers;
+
+
+
+static inline uint32_t apic_read(int reg)
+{
+    return apic_registers[reg >> 2];
+}
+
+
+
+static inline void apic_write(int reg, uint32_t value)
+{
+    apic_registers[reg >> 2] = value;
+}
+
+
+
+static int apic_spurious_handler(interrupt_context_t* context)
+{
+    // Spurious interrupts must not be acknowledged
+    (void)context;
+    return 1;
+}
+
+
+
+void apic_init(physaddr_t address)
+{
+    printf("apic_init(%p)\n", (void*)(uintptr_t)address);
+
+    apic_registers = vmm_map(address, PAGE_SIZE);
+
+    interrupt_register(APIC_SPURIOUS_VECTOR, apic_spurious_handler);
+
+    apic_init_ap();
+}
+
+
+
+void apic_init_ap()
+{
+    // Accept all interrupts
+    apic_write(APIC_TPR, 0);
+
+    // Software enable the APIC
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+
+
+int apic_available()
+{
+    return apic_registers != NULL;
+}
+
+
+
+int apic_id()
+{
+    return apic_read(APIC_ID) >> 24;
+}
+
+
+
+void apic_eoi()
+{
+    apic_write(APIC_EOI, 0);
+}
+
+
+
+static void apic_send_command(int apic_id, uint32_t command)
+{
+    assert(apic_registers);
+
+    // Don't let an interrupt handler use the ICR between the two writes
+    int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    apic_write(APIC_ICR_HIGH, apic_id << 24);
+    apic_write(APIC_ICR_LOW, command);
+
+    while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+    {
+        _mm_pause();
+    }
+
+    if (interruptsEnabled)
+    {
+        interrupt_enable();
+    }
+}
+
+
+
+void apic_send_init(int apic_id)
+{
+    apic_send_command(apic_id, APIC_ICR_INIT | APIC_ICR_ASSERT | APIC_ICR_LEVEL);
+}
+
+
+
+void apic_send_startup(int apic_id, physaddr_t address)
+{
+    assert(IS_PAGE_ALIGNED(address) && address < 0x100000);
+
+    apic_send_command(apic_id, APIC_ICR_STARTUP | APIC_ICR_ASSERT | (address >> 12));
+}
+
+
+
+void apic_send_ipi(int apic_id, int vector)
+{
+    apic_send_command(apic_id, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector);
+}
+
+
+
+uint32_t apic_timer_calibrate()
+{
+    // Count down from the maximum for 10 ms
+    apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+    apic_write(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+    timer_delay(10000);
+
+    const uint32_t ticks = 0xFFFFFFFF - apic_read(APIC_TIMER_CURRENT);
+
+    apic_write(APIC_TIMER_INITIAL, 0);
+
+    return ticks * 100;
+}
+
+
+
+void apic_timer_init(int vector, int tscDeadline)
+{
+    apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_LVT_TIMER, vector | (tscDeadline ? APIC_LVT_TIMER_TSC_DEADLINE : APIC_LVT_TIMER_ONESHOT));
+    apic_write(APIC_TIMER_INITIAL, 0);
+}
+
+
+
+void apic_timer_set_count(uint32_t count)
+{
+    apic_write(APIC_TIMER_INITIAL, count);
+}
+
+
+
+void apic_timer_set_deadline(uint64_t deadline)
+{
+    x86_write_msr(X86_MSR_TSC_DEADLINE, deadline);
+}
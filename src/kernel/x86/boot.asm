@@ -28,6 +28,8 @@ global _start
 global _print_error
 global _BootMemoryMapSize
 global _BootMemoryMap
+global _BootFirmwareMapSize
+global _BootFirmwareMap
 global _BootStackBottom
 global _BootStackTop
 
@@ -35,6 +37,7 @@ extern _start_kernel
 
 
 MAX_MEMORY_MAP_ENTRIES equ 256
+MAX_FIRMWARE_MAP_ENTRIES equ 64
 
 
 
@@ -75,6 +78,7 @@ _start:
     add edx, esi                                    ; edx = end of multiboot memory map
     mov edi, _BootMemoryMap - KERNEL_VIRTUAL_BASE   ; edi = _BootMemoryMap
     xor ecx, ecx                                    ; ecx = _BootMemoryMapSize
+    mov dword [_BootFirmwareMapSize - KERNEL_VIRTUAL_BASE], 0
 
 .memory_map_loop:
     cmp ecx, MAX_MEMORY_MAP_ENTRIES                 ; Max entries reached?
@@ -85,8 +89,36 @@ _start:
 
     mov eax, [esi + multiboot_mmap_entry.type]      ; eax = memory type
     cmp eax, MULTIBOOT_MEMORY_AVAILABLE             ; Available memory?
-    jne .next_entry                                 ; No...
+    je .available_entry
+    cmp eax, MULTIBOOT_MEMORY_ACPI_RECLAIMABLE      ; ACPI tables?
+    je .firmware_entry
+    cmp eax, MULTIBOOT_MEMORY_NVS                   ; ACPI non-volatile storage?
+    je .firmware_entry
+    jmp .next_entry                                 ; Something else (reserved, device memory)...
+
+.firmware_entry:
+    mov eax, [_BootFirmwareMapSize - KERNEL_VIRTUAL_BASE]
+    cmp eax, MAX_FIRMWARE_MAP_ENTRIES               ; Max entries reached?
+    je .next_entry
+
+    inc dword [_BootFirmwareMapSize - KERNEL_VIRTUAL_BASE]
+    shl eax, 4
+    lea ebp, [eax + _BootFirmwareMap - KERNEL_VIRTUAL_BASE] ; ebp = _BootFirmwareMap entry
+
+    ; Copy 'addr' and 'len' from multiboot memory map to _BootFirmwareMap
+    mov eax, [esi + multiboot_mmap_entry.addr]
+    mov ebx, [esi + multiboot_mmap_entry.addr + 4]
+    mov [ebp], eax
+    mov [ebp + 4], ebx
+
+    mov eax, [esi + multiboot_mmap_entry.len]
+    mov ebx, [esi + multiboot_mmap_entry.len + 4]
+    mov [ebp + 8], eax
+    mov [ebp + 12], ebx
+
+    jmp .next_entry
 
+.available_entry:
     ; Copy 'addr' from multiboot memory map to _BootMemoryMap
     mov eax, [esi + multiboot_mmap_entry.addr]
     mov ebx, [esi +  multiboot_mmap_entry.addr + 4]
@@ -187,3 +219,9 @@ _BootMemoryMapSize:
 
 _BootMemoryMap:
     resq MAX_MEMORY_MAP_ENTRIES * 2
+
+_BootFirmwareMapSize:
+    resd 1
+
+_BootFirmwareMap:
+    resq MAX_FIRMWARE_MAP_ENTRIES * 2
@@ -0,0 +1,183 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <kernel/clockevent.h>
+#include <kernel/cpu.h>
+#include <kernel/kernel.h>
+#include <kernel/timer.h>
+#include <kernel/x86/apic.h>
+#include <kernel/x86/cpu.h>
+#include <kernel/x86/pic.h>
+#include <kernel/x86/timer.h>
+
+#include <assert.h>
+
+
+#define PIT_IRQ_VECTOR 32           //todo: use PIC_IRQ_OFFSET constant!
+
+#define CLOCKEVENT_MAX_DELAY 1000000000ull  // Don't program more than 1 second ahead
+
+
+typedef enum
+{
+    CLOCKEVENT_PIT,                 // PIT channel 0, boot processor only
+    CLOCKEVENT_APIC,                // Local APIC timer in one-shot mode
+    CLOCKEVENT_TSC_DEADLINE,        // Local APIC timer in TSC-deadline mode
+} clockevent_type_t;
+
+
+static const char* const clockevent_names[] =
+{
+    "PIT",
+    "local APIC timer",
+    "TSC-deadline",
+};
+
+
+static clockevent_type_t clockevent_type;
+static interrupt_handler_t clockevent_handler;
+static uint32_t apic_timer_frequency;   // Local APIC timer ticks per second
+
+
+
+static int clockevent_interrupt(interrupt_context_t* context)
+{
+    if (clockevent_type != CLOCKEVENT_PIT)
+    {
+        apic_eoi();
+    }
+
+    cpu_get()->clockevent_deadline = TIMER_INFINITE;
+
+    return clockevent_handler(context);
+}
+
+
+
+void clockevent_init(interrupt_handler_t handler)
+{
+    clockevent_handler = handler;
+
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (edx & X86_CPUID1_EDX_APIC)
+    {
+        apic_init(x86_read_msr(X86_MSR_APIC_BASE) & ~(uint64_t)0xFFF);
+
+        if (ecx & X86_CPUID1_ECX_TSC_DEADLINE)
+        {
+            clockevent_type = CLOCKEVENT_TSC_DEADLINE;
+        }
+        else
+        {
+            clockevent_type = CLOCKEVENT_APIC;
+            apic_timer_frequency = apic_timer_calibrate();
+        }
+
+        interrupt_register(APIC_TIMER_VECTOR, clockevent_interrupt);
+        clockevent_init_ap();
+    }
+    else
+    {
+        clockevent_type = CLOCKEVENT_PIT;
+        interrupt_register(PIT_IRQ_VECTOR, clockevent_interrupt);
+        pic_enable_irq(0);
+        cpu_get()->clockevent_deadline = TIMER_INFINITE;
+    }
+
+    printf("clockevent_init(): using %s\n", clockevent_names[clockevent_type]);
+}
+
+
+
+void clockevent_init_ap()
+{
+    assert(clockevent_type != CLOCKEVENT_PIT);
+
+    apic_timer_init(APIC_TIMER_VECTOR, clockevent_type == CLOCKEVENT_TSC_DEADLINE);
+
+    cpu_get()->clockevent_deadline = TIMER_INFINITE;
+}
+
+
+
+void clockevent_set(uint64_t deadline)
+{
+    assert(!interrupt_enabled());
+
+    cpu_t* cpu = cpu_get();
+
+    if (deadline == cpu->clockevent_deadline)
+        return;
+
+    cpu->clockevent_deadline = deadline;
+
+    if (clockevent_type == CLOCKEVENT_TSC_DEADLINE)
+    {
+        // Writing 0 disarms the timer, a deadline in the past fires immediately
+        apic_timer_set_deadline(deadline == TIMER_INFINITE ? 0 : tsc_from_ns(deadline));
+        return;
+    }
+
+    if (deadline == TIMER_INFINITE)
+    {
+        // There is no way to stop the PIT, it will interrupt one last time for nothing
+        if (clockevent_type == CLOCKEVENT_APIC)
+            apic_timer_set_count(0);
+
+        return;
+    }
+
+    // Interrupting too early is fine, the handler will program the next expiry
+    const uint64_t now = timer_now();
+    uint64_t delay = deadline > now ? deadline - now : 0;
+    if (delay > CLOCKEVENT_MAX_DELAY)
+        delay = CLOCKEVENT_MAX_DELAY;
+
+    if (clockevent_type == CLOCKEVENT_APIC)
+    {
+        uint64_t count = delay * apic_timer_frequency / 1000000000ull;
+        if (count < 1) count = 1;
+        else if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+        apic_timer_set_count(count);
+    }
+    else
+    {
+        pit_set_oneshot(delay);
+    }
+}
+
+
+
+void clockevent_set_earlier(uint64_t deadline)
+{
+    if (deadline < cpu_get()->clockevent_deadline)
+    {
+        clockevent_set(deadline);
+    }
+}
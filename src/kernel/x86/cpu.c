@@ -25,6 +25,8 @@
 */
 
 #include <kernel/kernel.h>
+#include <kernel/cpu.h>
+#include <kernel/x86/cpu.h>
 
 typedef struct gdt_descriptor gdt_descriptor;
 
@@ -49,7 +51,13 @@ struct gdt_ptr
 
 
 
-static gdt_descriptor GDT[] __attribute__((aligned(16))) =
+#if defined(__i386__)
+#define GDT_COUNT (3 + MAX_CPUS)    // Null, code, data + one GS descriptor per CPU
+#elif defined(__x86_64__)
+#define GDT_COUNT 3                 // Null, code, data (GS base is set through an MSR)
+#endif
+
+static gdt_descriptor GDT[GDT_COUNT] __attribute__((aligned(16))) =
 {
     // 0x00 - Null Descriptor
     { 0, 0, 0, 0 },
@@ -95,6 +103,11 @@ static gdt_descriptor GDT[] __attribute__((aligned(16))) =
 
 #define GDT_KERNEL_CODE 0x08
 #define GDT_KERNEL_DATA 0x10
+#define GDT_CPU_BASE    0x18    // i386 only: per-CPU data descriptors
+
+
+cpu_t g_cpus[MAX_CPUS];
+int g_cpu_count = 1;
 
 
 static gdt_ptr GDT_PTR =
@@ -105,7 +118,7 @@ static gdt_ptr GDT_PTR =
 
 
 
-void cpu_init()
+static void cpu_load_gdt()
 {
     // Load GDT
 #if defined(__i386__)
@@ -144,3 +157,55 @@ void cpu_init()
         : : "r" (GDT_KERNEL_DATA) : "memory"
     );
 }
+
+
+
+// Make GS point to the specified per-CPU data
+static void cpu_load_gs(cpu_t* cpu)
+{
+#if defined(__i386__)
+    const int selector = GDT_CPU_BASE + cpu->id * sizeof(gdt_descriptor);
+    asm volatile ("movl %0, %%gs" : : "r" (selector) : "memory");
+#elif defined(__x86_64__)
+    // Loading a selector in GS clears the base, so this must be done after cpu_load_gdt()
+    x86_write_msr(X86_MSR_GS_BASE, (uintptr_t)cpu);
+#endif
+}
+
+
+
+void cpu_init()
+{
+#if defined(__i386__)
+    // Per-CPU data descriptors - flat 4 GB segments based at each g_cpus[] entry
+    for (int i = 0; i != MAX_CPUS; ++i)
+    {
+        uintptr_t base = (uintptr_t)&g_cpus[i];
+        gdt_descriptor* descriptor = &GDT[3 + i];
+
+        descriptor->limit = 0xFFFF;
+        descriptor->base = base & 0xFFFF;
+        descriptor->flags1 = 0x9200 | ((base >> 16) & 0xFF);   // P + DPL 0 + S + Data + Read + Write
+        descriptor->flags2 = 0x00CF | ((base >> 24) << 8);     // G + B (32 bits)
+    }
+#endif
+
+    cpu_t* cpu = &g_cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->online = 1;
+
+    cpu_load_gdt();
+    cpu_load_gs(cpu);
+}
+
+
+
+void cpu_init_ap(cpu_t* cpu)
+{
+    cpu_load_gdt();
+    cpu_load_gs(cpu);
+
+    // Initialize FPU
+    asm volatile ("fninit");
+}
@@ -0,0 +1,287 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <kernel/fpu.h>
+#include <kernel/cpu.h>
+#include <kernel/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/thread.h>
+#include <kernel/x86/cpu.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define FPU_NM_VECTOR           7           // Device not available exception
+
+#define FPU_FXSAVE_SIZE         512         // Legacy FXSAVE area
+
+#define FPU_DEFAULT_FCW         0x037F      // x87 control word after FNINIT
+#define FPU_DEFAULT_MXCSR       0x1F80      // All SIMD exceptions masked, round to nearest
+
+
+// Legacy region of the save area (same layout for FXSAVE and XSAVE)
+typedef struct fpu_legacy_state
+{
+    uint16_t    fcw;
+    uint16_t    fsw;
+    uint8_t     ftw;
+    uint8_t     reserved;
+    uint16_t    fop;
+    uint64_t    fip;
+    uint64_t    fdp;
+    uint32_t    mxcsr;
+    uint32_t    mxcsr_mask;
+} fpu_legacy_state_t;
+
+
+static int fpu_xsave;               // Use XSAVE/XRSTOR (otherwise FXSAVE/FXRSTOR)
+static uint64_t fpu_xcr0;           // State components enabled in XCR0
+static size_t fpu_save_size;        // Size of a thread's save area
+
+
+
+static inline void fpu_save(void* state)
+{
+#if defined(__i386__)
+    if (fpu_xsave)
+        asm volatile ("xsave %0" : "=m"(*(char*)state) : "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxsave %0" : "=m"(*(char*)state) : : "memory");
+#elif defined(__x86_64__)
+    if (fpu_xsave)
+        asm volatile ("xsave64 %0" : "=m"(*(char*)state) : "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxsave64 %0" : "=m"(*(char*)state) : : "memory");
+#endif
+}
+
+
+
+static inline void fpu_restore(const void* state)
+{
+#if defined(__i386__)
+    if (fpu_xsave)
+        asm volatile ("xrstor %0" : : "m"(*(const char*)state), "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxrstor %0" : : "m"(*(const char*)state) : "memory");
+#elif defined(__x86_64__)
+    if (fpu_xsave)
+        asm volatile ("xrstor64 %0" : : "m"(*(const char*)state), "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxrstor64 %0" : : "m"(*(const char*)state) : "memory");
+#endif
+}
+
+
+
+// Set CR0.TS: the next FPU / SIMD instruction raises #NM
+static inline void fpu_disable()
+{
+    x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
+}
+
+
+
+// #NM handler - load the current thread's state if the registers don't already hold it
+static int fpu_nm_handler(interrupt_context_t* context)
+{
+    (void)context;
+
+    cpu_t* cpu = cpu_get();
+    thread_t* thread = cpu->current_thread;
+
+    x86_clts();
+    cpu->fpu_active = 1;
+
+    if (cpu->fpu_owner != thread || thread->fpu_cpu != cpu)
+    {
+        fpu_restore(thread->fpu_state);
+        cpu->fpu_owner = thread;
+        thread->fpu_cpu = cpu;
+    }
+
+    return 1;
+}
+
+
+
+// Enable FPU / SSE / XSAVE features on the current CPU. The registers are left enabled
+// for the initial flow of execution: they get saved in its thread's area on the first
+// context switch.
+static void fpu_setup_cpu()
+{
+    uintptr_t cr0 = x86_get_cr0();
+    cr0 &= ~(X86_CR0_EM | X86_CR0_TS);
+    cr0 |= X86_CR0_MP;
+
+    uintptr_t cr4 = x86_get_cr4() | X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+    if (fpu_xsave)
+        cr4 |= X86_CR4_OSXSAVE;
+
+    x86_set_cr4(cr4);
+
+    if (fpu_xsave)
+        x86_xsetbv(0, fpu_xcr0);
+
+    x86_set_cr0(cr0);
+
+    cpu_t* cpu = cpu_get();
+    cpu->fpu_owner = NULL;
+    cpu->fpu_active = 1;
+    cpu->fpu_kernel = 0;
+}
+
+
+
+void fpu_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & X86_CPUID1_EDX_FXSR) || !(edx & X86_CPUID1_EDX_SSE))
+    {
+        fatal("FXSAVE / SSE not supported");
+    }
+
+    fpu_xsave = (ecx & X86_CPUID1_ECX_XSAVE) != 0;
+    fpu_save_size = FPU_FXSAVE_SIZE;
+
+    if (fpu_xsave)
+    {
+        // Leaf 0xD: supported state components and the save area size for what XCR0 enables
+        uint32_t supportedLow, supportedHigh, size;
+        x86_cpuid(0xD, &supportedLow, &ebx, &size, &supportedHigh);
+
+        fpu_xcr0 = (((uint64_t)supportedHigh << 32) | supportedLow) & (X86_XCR0_X87 | X86_XCR0_SSE | X86_XCR0_AVX);
+        if (!(ecx & X86_CPUID1_ECX_AVX))
+            fpu_xcr0 &= ~(uint64_t)X86_XCR0_AVX;
+    }
+
+    fpu_setup_cpu();
+
+    if (fpu_xsave)
+    {
+        x86_cpuid(0xD, &eax, &ebx, &ecx, &edx);
+        fpu_save_size = ebx;
+    }
+
+    interrupt_register(FPU_NM_VECTOR, fpu_nm_handler);
+
+    printf("FPU: %s, %u bytes per thread\n", fpu_xsave ? "XSAVE" : "FXSAVE", (unsigned)fpu_save_size);
+}
+
+
+
+void fpu_init_ap()
+{
+    fpu_setup_cpu();
+}
+
+
+
+size_t fpu_state_size()
+{
+    return fpu_save_size;
+}
+
+
+
+void fpu_thread_init(thread_t* thread, void* state)
+{
+    // Default state. With XSAVE, the header is zero: XRSTOR puts all components in their
+    // initial configuration except MXCSR which it always loads.
+    memset(state, 0, fpu_save_size);
+
+    fpu_legacy_state_t* legacy = state;
+    legacy->fcw = FPU_DEFAULT_FCW;
+    legacy->mxcsr = FPU_DEFAULT_MXCSR;
+
+    thread->fpu_state = state;
+    thread->fpu_cpu = NULL;
+}
+
+
+
+void fpu_switch(thread_t* thread)
+{
+    cpu_t* cpu = cpu_get();
+
+    // Nothing to do if the thread didn't touch the FPU during its time slice
+    if (!cpu->fpu_active)
+        return;
+
+    // The thread might be resumed on another CPU, so save its state now. It stays the
+    // owner: if it's the next one to use the FPU here, there is nothing to restore.
+    fpu_save(thread->fpu_state);
+    fpu_disable();
+    cpu->fpu_active = 0;
+}
+
+
+
+void kernel_fpu_begin()
+{
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    cpu_t* cpu = cpu_get();
+    assert(!cpu->fpu_kernel);
+
+    // Live registers belong to the current thread, park them in its save area
+    if (cpu->fpu_active)
+    {
+        fpu_save(cpu->current_thread->fpu_state);
+        cpu->fpu_active = 0;
+    }
+    else
+    {
+        x86_clts();
+    }
+
+    cpu->fpu_owner = NULL;
+    cpu->fpu_kernel = 1;
+    cpu->fpu_interrupts_enabled = interruptsEnabled;
+
+    // Start from a clean state
+    const uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+    asm volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+}
+
+
+
+void kernel_fpu_end()
+{
+    cpu_t* cpu = cpu_get();
+    assert(cpu->fpu_kernel);
+
+    cpu->fpu_kernel = 0;
+
+    fpu_disable();
+
+    if (cpu->fpu_interrupts_enabled)
+        interrupt_enable();
+}
@@ -25,7 +25,9 @@
 */
 
 #include <kernel/interrupt.h>
+#include <kernel/cpu.h>
 #include <kernel/kernel.h>
+#include <kernel/thread.h>
 #include <kernel/x86/pic.h>
 
 #include <assert.h>
@@ -196,6 +198,14 @@ void interrupt_init()
 
 
 
+void interrupt_init_ap()
+{
+    // The IDT is shared by all processors
+    asm volatile ("lidt %0"::"m" (IDT_PTR));
+}
+
+
+
 int interrupt_register(int interrupt, interrupt_handler_t handler)
 {
     assert(interrupt >= 0 && interrupt <= 255);
@@ -234,6 +244,10 @@ void interrupt_dispatch(interrupt_context_t* context)
         //printf("interrupt_dispatch - eoi sent\n");
     }
 
+    // Handlers don't switch threads, they set 'need_resched' instead
+    cpu_t* cpu = cpu_get();
+    cpu->preempt_count++;
+
     // Dispatch to interrupt handler
     interrupt_handler_t handler = interrupt_handlers[context->interrupt];
 
@@ -257,4 +271,19 @@ void interrupt_dispatch(interrupt_context_t* context)
         pic_enable_irq(irq);
         //printf("interrupt_dispatch - enabled interrupts\n");
     }
+
+    cpu->preempt_count--;
+
+    // Leaving the outermost interrupt: preempt the interrupted thread if it asked for it
+    // and nothing prevents it (interrupts were enabled, so it held no spin lock).
+#if defined(__i386__)
+    const int interruptsEnabled = (context->eflags & X86_EFLAGS_IF) != 0;
+#elif defined(__x86_64__)
+    const int interruptsEnabled = (context->rflags & X86_EFLAGS_IF) != 0;
+#endif
+
+    if (cpu->need_resched && cpu->preempt_count == 0 && cpu->spinlock_count == 0 && interruptsEnabled)
+    {
+        thread_yield();
+    }
 }
@@ -82,7 +82,7 @@ interrupt_exit:
 o16 pop ds
 o16 pop es
 o16 pop fs
-o16 pop gs
+    add esp, 2          ; GS is per-CPU, don't restore it (the thread might have migrated)
     pop eax
     pop ebx
     pop ecx
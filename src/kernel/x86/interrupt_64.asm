@@ -94,7 +94,7 @@ interrupt_exit:
     mov es, word [rsp+2]
     add rsp, 4
 o16 pop fs
-o16 pop gs
+    add rsp, 2          ; Don't restore GS, loading a selector would clear the per-CPU GS base
     pop rax
     pop rbx
     pop rcx
@@ -25,8 +25,17 @@
 */
 
 #include <kernel/pmm.h>
+#include <kernel/cpu.h>
+#include <kernel/interrupt.h>
+#include <kernel/preempt.h>
+#include <kernel/thread.h>
 #include <kernel/vmm.h>
 #include <kernel/kernel.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+#include <assert.h>
+#include <string.h>
 
 
 extern const char kernel_image_start[];
@@ -44,7 +53,10 @@ struct MemoryMapEntry
 };
 
 extern int _BootMemoryMapSize;
-extern MemoryMapEntry _BootMemoryMap[];
+extern MemoryMapEntry _BootMemoryMap[];         // Available memory
+
+extern int _BootFirmwareMapSize;
+extern MemoryMapEntry _BootFirmwareMap[];       // ACPI tables and NVS
 
 
 /*
@@ -56,26 +68,45 @@ extern MemoryMapEntry _BootMemoryMap[];
     0x01000000 - 0x01400000     Kiznix Kernel
 */
 
-//todo: move inside pmm.c once vmm.c doesn't depend on PMM_STACK_VMA
+
+/*
+    Buddy Allocator
+
+    Free memory is kept as naturally aligned blocks of 2^order pages, order 0 (4 KB)
+    to PMM_MAX_ORDER (1 GB). Each zone has one bitmap per order with a bit per block:
+    the bit is set when a free block of exactly that order starts there. Freeing a
+    block checks the bit of its buddy (block ^ size) and merges while it is free,
+    which is at most PMM_MAX_ORDER steps.
+
+    i386 has no direct map of physical memory, so we can't keep links inside free
+    blocks. The bitmaps take 2 bits per page in total (4 MB for 64 GB with PAE) and
+    are mapped at PMM_BITMAP_VMA. On x86_64 they are read through the direct map.
+
+    Single pages go through per-CPU magazines, one per zone, so the common case takes
+    no lock. An empty magazine is refilled with PMM_MAGAZINE_BATCH pages from its zone
+    and a full one gives its PMM_MAGAZINE_BATCH coldest pages back.
+
+    A low priority thread keeps a pool of zeroed pages for page faults and new page
+    tables. It clears pages with non-temporal stores so that it doesn't evict what the
+    other threads are working on.
+*/
+
 #if defined(__i386__)
-#define PMM_STACK_SIZE 0x400000
-#define PMM_STACK_VMA  0xFF000000
-#elif defined(__x86_64__)
-#define PMM_STACK_SIZE 0x8000000000ull
-#define PMM_STACK_VMA  0xFFFFF00000000000ull
+#define PMM_BITMAP_SIZE 0x800000
+#define PMM_BITMAP_VMA  0xFF000000
 #endif
 
 #define MEM_1_GB 0x100000ull
+#define MEM_16_MB 0x1000000ull
 #define MEM_4_GB 0x100000000ull
 
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
 static uint64_t pmm_system_memory;         // Detected system memory
 static uint64_t pmm_free_memory;           // Free memory
 static uint64_t pmm_used_memory;           // Used memory
 static uint64_t pmm_unavailable_memory;    // Memory that can't be used
 
-static physaddr_t* const pmm_stack_base = (physaddr_t*)PMM_STACK_VMA;
-static physaddr_t* pmm_stack_top = (physaddr_t*)PMM_STACK_VMA;
-
 typedef struct FreeMemory FreeMemory;
 
 struct FreeMemory
@@ -84,11 +115,325 @@ struct FreeMemory
     physaddr_t end;
 };
 
+// Memory map ranges, used to allocate pages until the buddy allocator is ready
 static FreeMemory s_free_memory[1000];
 static int s_free_memory_count;
 static int s_free_memory_current;
 
 
+typedef struct pmm_zone pmm_zone_t;
+
+struct pmm_zone
+{
+    const char*     name;
+    uint64_t        limit;                          // Zone covers physical memory below this address
+    uintptr_t       base;                           // First page frame of the bitmaps, aligned on the largest block
+    uintptr_t       start;                          // First page frame that can be free
+    uintptr_t       end;                            // One past the last page frame that can be free
+    uintptr_t       managed_pages;                  // Pages given to the allocator
+    uintptr_t       free_pages;                     // Pages currently free
+    unsigned long*  free_map[PMM_ORDER_COUNT];      // A free block of this order starts at this bit
+    size_t          free_words[PMM_ORDER_COUNT];    // Size of each bitmap in words
+    size_t          free_hint[PMM_ORDER_COUNT];     // There is no free block in words below this one
+    uintptr_t       free_blocks[PMM_ORDER_COUNT];   // Number of free blocks of each order
+};
+
+static pmm_zone_t pmm_zones[PMM_ZONE_COUNT] =
+{
+    { .name = "DMA",   .limit = MEM_16_MB },
+    { .name = "DMA32", .limit = MEM_4_GB },
+    { .name = "High",  .limit = ~0ull },
+};
+
+static int pmm_ready;                   // Is the buddy allocator initialized?
+static DEFINE_SPINLOCK(pmm_lock);       // Protects pmm_zones and pmm_free_memory
+
+
+#define PMM_ZERO_POOL_SIZE  128         // Pre-zeroed pages to keep around
+#define PMM_ZERO_POLL_NS    10000000    // How often a full pool is checked (10 ms)
+
+static physaddr_t pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static volatile int pmm_zero_pool_count;
+static uint64_t pmm_zero_hits;          // pmm_take_zeroed_page() calls served from the pool
+static uint64_t pmm_zero_misses;        // pmm_take_zeroed_page() calls finding the pool empty
+static int pmm_zero_nt;                 // Clear pages with movnti (SSE2)
+static DEFINE_SPINLOCK(pmm_zero_lock);  // Protects the pool and its counters
+
+
+
+static inline int pmm_test_block(const pmm_zone_t* zone, uintptr_t frame, int order)
+{
+    const size_t bit = (frame - zone->base) >> order;
+    return (zone->free_map[order][bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+
+
+static inline void pmm_insert_block(pmm_zone_t* zone, uintptr_t frame, int order)
+{
+    const size_t bit = (frame - zone->base) >> order;
+    const size_t word = bit / BITS_PER_WORD;
+
+    zone->free_map[order][word] |= 1ul << (bit % BITS_PER_WORD);
+    ++zone->free_blocks[order];
+
+    if (word < zone->free_hint[order])
+        zone->free_hint[order] = word;
+}
+
+
+
+static inline void pmm_remove_block(pmm_zone_t* zone, uintptr_t frame, int order)
+{
+    const size_t bit = (frame - zone->base) >> order;
+
+    zone->free_map[order][bit / BITS_PER_WORD] &= ~(1ul << (bit % BITS_PER_WORD));
+    --zone->free_blocks[order];
+}
+
+
+
+// Find and remove a free block of exactly this order. The caller checked free_blocks.
+static uintptr_t pmm_take_block(pmm_zone_t* zone, int order)
+{
+    unsigned long* map = zone->free_map[order];
+
+    for (size_t word = zone->free_hint[order]; word != zone->free_words[order]; ++word)
+    {
+        if (map[word])
+        {
+            const size_t bit = word * BITS_PER_WORD + __builtin_ctzl(map[word]);
+            const uintptr_t frame = zone->base + ((uintptr_t)bit << order);
+
+            zone->free_hint[order] = word;
+            pmm_remove_block(zone, frame, order);
+
+            return frame;
+        }
+    }
+
+    fatal("pmm_take_block() - free block count is wrong");
+}
+
+
+
+// Return a block to the zone, merging it with its buddy for as long as the buddy is free
+static void pmm_free_block(pmm_zone_t* zone, uintptr_t frame, int order)
+{
+    zone->free_pages += (uintptr_t)1 << order;
+
+    while (order != PMM_MAX_ORDER)
+    {
+        const uintptr_t buddy = frame ^ ((uintptr_t)1 << order);
+
+        // Blocks are only inserted when they fit entirely in the zone
+        if (buddy < zone->start || buddy >= zone->end || !pmm_test_block(zone, buddy, order))
+            break;
+
+        pmm_remove_block(zone, buddy, order);
+
+        frame &= ~((uintptr_t)1 << order);
+        ++order;
+    }
+
+    pmm_insert_block(zone, frame, order);
+}
+
+
+
+static uintptr_t pmm_alloc_block(pmm_zone_t* zone, int order)
+{
+    for (int current = order; current <= PMM_MAX_ORDER; ++current)
+    {
+        if (zone->free_blocks[current] == 0)
+            continue;
+
+        const uintptr_t frame = pmm_take_block(zone, current);
+
+        // Split, giving back the upper halves
+        while (current != order)
+        {
+            --current;
+            pmm_insert_block(zone, frame + ((uintptr_t)1 << current), current);
+        }
+
+        zone->free_pages -= (uintptr_t)1 << order;
+
+        return frame;
+    }
+
+    return 0;
+}
+
+
+
+static pmm_zone_t* pmm_find_zone(uint64_t address)
+{
+    for (int i = 0; i != PMM_ZONE_COUNT; ++i)
+    {
+        if (address < pmm_zones[i].limit)
+            return &pmm_zones[i];
+    }
+
+    return NULL;
+}
+
+
+
+// Allocate a page from the memory map ranges, only used before the buddy allocator is ready
+static physaddr_t pmm_early_alloc_page()
+{
+    while (s_free_memory_current != s_free_memory_count)
+    {
+        FreeMemory* entry = &s_free_memory[s_free_memory_current];
+        if (entry->start != entry->end)
+        {
+            physaddr_t page = entry->start;
+            entry->start += PAGE_SIZE;
+            pmm_free_memory -= PAGE_SIZE;
+            return page;
+        }
+
+        ++s_free_memory_current;
+    }
+
+    fatal("Out of physical memory");
+}
+
+
+
+#if defined(__x86_64__)
+
+// Allocate physically contiguous pages from a single memory map range, only used before the buddy allocator is ready
+static physaddr_t pmm_early_alloc_range(physaddr_t size)
+{
+    for (int i = s_free_memory_current; i != s_free_memory_count; ++i)
+    {
+        FreeMemory* entry = &s_free_memory[i];
+
+        if (entry->end - entry->start >= size)
+        {
+            physaddr_t start = entry->start;
+            entry->start += size;
+            pmm_free_memory -= size;
+            return start;
+        }
+    }
+
+    fatal("Out of physical memory");
+}
+
+#endif
+
+
+
+// Size the zones and map their bitmaps
+static void pmm_init_zones()
+{
+    uintptr_t size = 0;
+
+    for (int i = 0; i != s_free_memory_count; ++i)
+    {
+        const FreeMemory* entry = &s_free_memory[i];
+        uint64_t low = 0;
+
+        for (int z = 0; z != PMM_ZONE_COUNT; low = pmm_zones[z].limit, ++z)
+        {
+            pmm_zone_t* zone = &pmm_zones[z];
+
+            const uint64_t start = entry->start > low ? entry->start : low;
+            const uint64_t end = entry->end < zone->limit ? entry->end : zone->limit;
+
+            if (start >= end)
+                continue;
+
+            if (zone->start == zone->end || start / PAGE_SIZE < zone->start)
+                zone->start = start / PAGE_SIZE;
+
+            if (zone->start == zone->end || end / PAGE_SIZE > zone->end)
+                zone->end = end / PAGE_SIZE;
+        }
+    }
+
+    for (int z = 0; z != PMM_ZONE_COUNT; ++z)
+    {
+        pmm_zone_t* zone = &pmm_zones[z];
+
+        if (zone->start == zone->end)
+            continue;
+
+        zone->base = zone->start & ~(((uintptr_t)1 << PMM_MAX_ORDER) - 1);
+
+        for (int order = 0; order <= PMM_MAX_ORDER; ++order)
+        {
+            const size_t bits = ((zone->end - 1 - zone->base) >> order) + 1;
+
+            zone->free_words[order] = (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+            size += zone->free_words[order] * sizeof(unsigned long);
+        }
+    }
+
+#if defined(__x86_64__)
+    // The bitmaps are physically contiguous and used through the direct map
+    char* bitmaps = phys_to_virt(pmm_early_alloc_range(PAGE_ALIGN_UP(size)));
+#else
+    char* bitmaps = (char*)PMM_BITMAP_VMA;
+
+    if (size > PMM_BITMAP_SIZE)
+    {
+        fatal("pmm_init() - too much memory for the buddy bitmaps");
+    }
+
+    // Page tables needed by vmm_map_page() come from pmm_early_alloc_page()
+    for (uintptr_t offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        if (vmm_map_page(pmm_early_alloc_page(), bitmaps + offset) != 0)
+        {
+            fatal("Failed to map page");
+        }
+    }
+#endif
+
+    memset(bitmaps, 0, size);
+
+    for (int z = 0; z != PMM_ZONE_COUNT; ++z)
+    {
+        pmm_zone_t* zone = &pmm_zones[z];
+
+        if (zone->start == zone->end)
+            continue;
+
+        for (int order = 0; order <= PMM_MAX_ORDER; ++order)
+        {
+            zone->free_map[order] = (unsigned long*)bitmaps;
+            bitmaps += zone->free_words[order] * sizeof(unsigned long);
+        }
+    }
+}
+
+
+
+// Give a range of page frames to a zone as the largest aligned blocks that fit
+static void pmm_add_range(pmm_zone_t* zone, uintptr_t start, uintptr_t end)
+{
+    while (start != end)
+    {
+        int order = start ? __builtin_ctzl(start) : PMM_MAX_ORDER;
+
+        if (order > PMM_MAX_ORDER)
+            order = PMM_MAX_ORDER;
+
+        while (start + ((uintptr_t)1 << order) > end)
+            --order;
+
+        zone->managed_pages += (uintptr_t)1 << order;
+        pmm_free_block(zone, start, order);
+
+        start += (uintptr_t)1 << order;
+    }
+}
+
+
 
 void pmm_init()
 {
@@ -147,6 +492,52 @@ void pmm_init()
             break;
     }
 
+#if defined(__x86_64__)
+    // All of RAM, the kernel and first 1 MB included. Nothing else goes in the direct map:
+    // vmm_map() maps firmware memory write-back and device memory uncached (UC-).
+    for (int i = 0; i != _BootMemoryMapSize; ++i)
+    {
+        const MemoryMapEntry* entry = &_BootMemoryMap[i];
+        vmm_init_direct_map(entry->base, entry->base + entry->length);
+    }
+
+    for (int i = 0; i != _BootFirmwareMapSize; ++i)
+    {
+        const MemoryMapEntry* entry = &_BootFirmwareMap[i];
+        vmm_init_firmware_range(entry->base, entry->base + entry->length);
+    }
+
+    vmm_report_direct_map();
+#endif
+
+    // Whatever the ranges still hold after the bitmaps are mapped goes to the zones
+    pmm_init_zones();
+
+    pmm_free_memory = 0;
+
+    for (int i = s_free_memory_current; i != s_free_memory_count; ++i)
+    {
+        const FreeMemory* entry = &s_free_memory[i];
+        uint64_t low = 0;
+
+        for (int z = 0; z != PMM_ZONE_COUNT; low = pmm_zones[z].limit, ++z)
+        {
+            pmm_zone_t* zone = &pmm_zones[z];
+
+            const uint64_t start = entry->start > low ? entry->start : low;
+            const uint64_t end = entry->end < zone->limit ? entry->end : zone->limit;
+
+            if (start >= end)
+                continue;
+
+            pmm_add_range(zone, start / PAGE_SIZE, end / PAGE_SIZE);
+            pmm_free_memory += end - start;
+        }
+    }
+
+    s_free_memory_current = s_free_memory_count;
+    pmm_ready = 1;
+
     // Calculate how much of the system memory we used so far
     pmm_used_memory = pmm_system_memory - pmm_free_memory - pmm_unavailable_memory;
 
@@ -165,43 +556,144 @@ void pmm_init()
 
 
 
-physaddr_t pmm_alloc_page()
+physaddr_t pmm_alloc_zone_pages(int zone, int order)
 {
-    if (pmm_stack_top != pmm_stack_base)
-    {
-        // Grab a page off the stack
-        --pmm_stack_top;
+    assert(zone >= 0 && zone < PMM_ZONE_COUNT);
+    assert(order >= 0 && order <= PMM_MAX_ORDER);
+
+    spin_lock(&pmm_lock);
 
-        physaddr_t page = *pmm_stack_top;
+    // Prefer the highest zone allowed, low memory is scarce and needed by old devices
+    for (int z = zone; z >= 0; --z)
+    {
+        const uintptr_t frame = pmm_alloc_block(&pmm_zones[z], order);
 
-        if (IS_PAGE_ALIGNED(pmm_stack_top))
+        if (frame != 0)
         {
-            // This unmap is not stricly required, but not doing it will
-            // trigger an assert in vmm_map_page() where we make sure we don't
-            // overwrite existing valid entries.
-            vmm_unmap_page(pmm_stack_top);
+            pmm_free_memory -= (uint64_t)PAGE_SIZE << order;
+
+            spin_unlock(&pmm_lock);
+
+            return (physaddr_t)frame * PAGE_SIZE;
         }
+    }
+
+    spin_unlock(&pmm_lock);
+
+    return 0;
+}
+
+
+
+physaddr_t pmm_alloc_pages(int order)
+{
+    return pmm_alloc_zone_pages(PMM_ZONE_HIGH, order);
+}
+
+
+
+void pmm_free_pages(physaddr_t address, int order)
+{
+    assert(pmm_ready);
+    assert(order >= 0 && order <= PMM_MAX_ORDER);
+
+    const uintptr_t frame = address / PAGE_SIZE;
+
+    pmm_zone_t* zone = pmm_find_zone(address);
+
+    assert(IS_PAGE_ALIGNED(address));
+    assert((frame & (((uintptr_t)1 << order) - 1)) == 0);
+    assert(zone && frame >= zone->start && frame + ((uintptr_t)1 << order) <= zone->end);
+
+    spin_lock(&pmm_lock);
+
+    assert(!pmm_test_block(zone, frame, order));
+
+    pmm_free_block(zone, frame, order);
+    pmm_free_memory += (uint64_t)PAGE_SIZE << order;
+
+    spin_unlock(&pmm_lock);
+}
+
+
 
+// Move up to PMM_MAGAZINE_BATCH pages from a zone to a magazine, interrupts must be disabled
+static void pmm_magazine_refill(pmm_magazine_t* magazine, int zone)
+{
+    spin_lock(&pmm_lock);
+
+    while (magazine->count != PMM_MAGAZINE_BATCH)
+    {
+        const uintptr_t frame = pmm_alloc_block(&pmm_zones[zone], 0);
+
+        if (frame == 0)
+            break;
+
+        magazine->pages[magazine->count++] = (physaddr_t)frame * PAGE_SIZE;
         pmm_free_memory -= PAGE_SIZE;
-        return page;
     }
 
-    // Try from s_free_memory_entries
-    while (s_free_memory_current != s_free_memory_count)
+    spin_unlock(&pmm_lock);
+}
+
+
+
+// Give the PMM_MAGAZINE_BATCH coldest pages of a full magazine back to its zone, interrupts must be disabled
+static void pmm_magazine_drain(pmm_magazine_t* magazine, int zone)
+{
+    spin_lock(&pmm_lock);
+
+    for (int i = 0; i != PMM_MAGAZINE_BATCH; ++i)
     {
-        FreeMemory* entry = &s_free_memory[s_free_memory_current];
-        if (entry->start != entry->end)
-        {
-            physaddr_t page = entry->start;
-            entry->start += PAGE_SIZE;
-            pmm_free_memory -= PAGE_SIZE;
-            return page;
-        }
+        pmm_free_block(&pmm_zones[zone], magazine->pages[i] / PAGE_SIZE, 0);
+    }
 
-        ++s_free_memory_current;
+    pmm_free_memory += PMM_MAGAZINE_BATCH * PAGE_SIZE;
+
+    spin_unlock(&pmm_lock);
+
+    magazine->count -= PMM_MAGAZINE_BATCH;
+    memmove(&magazine->pages[0], &magazine->pages[PMM_MAGAZINE_BATCH], magazine->count * sizeof(physaddr_t));
+}
+
+
+
+physaddr_t pmm_alloc_page()
+{
+    if (!pmm_ready)
+    {
+        return pmm_early_alloc_page();
     }
 
-    fatal("Out of physical memory");
+    physaddr_t page = 0;
+
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    cpu_t* cpu = cpu_get();
+
+    // Same zone order as pmm_alloc_pages()
+    for (int zone = PMM_ZONE_HIGH; zone >= 0 && !page; --zone)
+    {
+        pmm_magazine_t* magazine = &cpu->pmm_magazines[zone];
+
+        // Reading free_pages without the lock is only a hint to skip empty zones
+        if (magazine->count == 0 && pmm_zones[zone].free_pages != 0)
+            pmm_magazine_refill(magazine, zone);
+
+        if (magazine->count != 0)
+            page = magazine->pages[--magazine->count];
+    }
+
+    if (interruptsEnabled)
+        interrupt_enable();
+
+    if (page == 0)
+    {
+        fatal("Out of physical memory");
+    }
+
+    return page;
 }
 
 
@@ -210,17 +702,201 @@ void pmm_free_page(physaddr_t page)
 {
     //printf("pmm_free_page(): %p\n", page);
 
-    if (IS_PAGE_ALIGNED(pmm_stack_top))
+    assert(pmm_ready);
+    assert(IS_PAGE_ALIGNED(page));
+
+    const pmm_zone_t* owner = pmm_find_zone(page);
+    assert(owner && page / PAGE_SIZE >= owner->start && page / PAGE_SIZE < owner->end);
+
+    const int zone = owner - pmm_zones;
+
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    pmm_magazine_t* magazine = &cpu_get()->pmm_magazines[zone];
+
+    if (magazine->count == PMM_MAGAZINE_SIZE)
+        pmm_magazine_drain(magazine, zone);
+
+    magazine->pages[magazine->count++] = page;
+
+    if (interruptsEnabled)
+        interrupt_enable();
+}
+
+
+
+// Clear a page without pulling it into the cache
+static void pmm_zero_page(void* page)
+{
+    if (!pmm_zero_nt)
+    {
+        memset(page, 0, PAGE_SIZE);
+        return;
+    }
+
+    uintptr_t* p = page;
+
+    for (size_t i = 0; i != PAGE_SIZE / sizeof(uintptr_t); ++i)
+    {
+        asm volatile ("movnti %1, %0" : "=m"(p[i]) : "r"((uintptr_t)0));
+    }
+
+    // Non-temporal stores are weakly ordered, make them visible before the page is handed out
+    asm volatile ("sfence" : : : "memory");
+}
+
+
+
+static void pmm_zero_thread(void* argument)
+{
+    (void)argument;
+
+#if !defined(__x86_64__)
+    // Pages are cleared through this window, there is no direct map of physical memory
+    char* window = vmm_alloc(PAGE_SIZE);
+#endif
+
+    for (;;)
     {
-        // We need a page of physical memory to extend the stack
-        // Might as well use the page that is getting freed!
-        if (vmm_map_page(page, pmm_stack_top) != 0)
+        // Consumers run in page fault handlers that can hold any lock, so they don't
+        // wake us up: we poll instead when there is nothing to do.
+        if (pmm_zero_pool_count == PMM_ZERO_POOL_SIZE)
         {
-            fatal("Failed to map page");
+            thread_sleep_ns(PMM_ZERO_POLL_NS);
+            continue;
+        }
+
+        // Don't use pmm_alloc_page(), it would empty this CPU's magazine or fail fatally
+        physaddr_t page = pmm_alloc_pages(0);
+
+        if (page == 0)
+        {
+            thread_sleep_ns(PMM_ZERO_POLL_NS);
+            continue;
+        }
+
+#if defined(__x86_64__)
+        pmm_zero_page(phys_to_virt(page));
+#else
+        // The window is only valid in this CPU's TLB (vmm_map_page() invalidates locally)
+        preempt_disable();
+
+        vmm_map_page(page, window);
+        pmm_zero_page(window);
+        vmm_unmap_page(window);
+
+        preempt_enable();
+#endif
+
+        spin_lock(&pmm_zero_lock);
+
+        if (pmm_zero_pool_count != PMM_ZERO_POOL_SIZE)
+        {
+            pmm_zero_pool[pmm_zero_pool_count++] = page;
+            page = 0;
+        }
+
+        spin_unlock(&pmm_zero_lock);
+
+        if (page)
+            pmm_free_pages(page, 0);
+    }
+}
+
+
+
+void pmm_init_zero_pool()
+{
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    pmm_zero_nt = (edx & X86_CPUID1_EDX_SSE2) != 0;
+
+    thread_t* thread = thread_create(pmm_zero_thread, NULL);
+    thread_set_priority(thread, THREAD_PRIORITY_LOWEST);
+}
+
+
+
+physaddr_t pmm_take_zeroed_page()
+{
+    physaddr_t page = 0;
+
+    spin_lock(&pmm_zero_lock);
+
+    if (pmm_zero_pool_count != 0)
+    {
+        page = pmm_zero_pool[--pmm_zero_pool_count];
+        ++pmm_zero_hits;
+    }
+    else
+    {
+        ++pmm_zero_misses;
+    }
+
+    spin_unlock(&pmm_zero_lock);
+
+    return page;
+}
+
+
+
+void pmm_dump_stats()
+{
+    // Unusable index: share of free memory in blocks too small for a large page (2 MB)
+    const int large_order = 9;
+
+    printf("%-6s %10s %10s %8s %8s %9s  free blocks by order\n", "zone", "pages", "free", "cached", "largest", "unusable");
+
+    spin_lock(&pmm_lock);
+
+    for (int z = 0; z != PMM_ZONE_COUNT; ++z)
+    {
+        const pmm_zone_t* zone = &pmm_zones[z];
+
+        if (zone->managed_pages == 0)
+            continue;
+
+        int largest = -1;
+        uintptr_t large_pages = 0;
+        unsigned long cached = 0;
+
+        // Pages sitting in magazines are free but can't be merged
+        for (int i = 0; i != g_cpu_count; ++i)
+        {
+            cached += g_cpus[i].pmm_magazines[z].count;
         }
+
+        for (int order = 0; order <= PMM_MAX_ORDER; ++order)
+        {
+            if (zone->free_blocks[order] == 0)
+                continue;
+
+            largest = order;
+
+            if (order >= large_order)
+                large_pages += zone->free_blocks[order] << order;
+        }
+
+        const unsigned long unusable = zone->free_pages ? (unsigned long)((zone->free_pages - large_pages) * 100 / zone->free_pages) : 0;
+
+        printf("%-6s %10lu %10lu %8lu %8d %8lu%% ", zone->name, (unsigned long)zone->managed_pages, (unsigned long)zone->free_pages, cached, largest, unusable);
+
+        for (int order = 0; order <= PMM_MAX_ORDER; ++order)
+        {
+            printf(" %lu", (unsigned long)zone->free_blocks[order]);
+        }
+
+        printf("\n");
     }
 
-    *pmm_stack_top++ = page;
+    spin_unlock(&pmm_lock);
+
+    spin_lock(&pmm_zero_lock);
+
+    printf("Zeroed pool: %d / %d pages, %lu hits, %lu misses\n", pmm_zero_pool_count, PMM_ZERO_POOL_SIZE,
+        (unsigned long)pmm_zero_hits, (unsigned long)pmm_zero_misses);
 
-    pmm_free_memory += PAGE_SIZE;
+    spin_unlock(&pmm_zero_lock);
 }
@@ -0,0 +1,313 @@
+/*
+    Copyright (c) 2015, Thierry Tremblay
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <acpi.h>
+#include <kernel/clockevent.h>
+#include <kernel/cpu.h>
+#include <kernel/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/preempt.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/vmm.h>
+#include <kernel/x86/apic.h>
+#include <kernel/x86/cpu.h>
+
+#include <string.h>
+#include <xmmintrin.h>
+
+
+#define SMP_TRAMPOLINE_ADDRESS  0x8000          // Must match smp_trampoline_*.asm
+#define SMP_STARTUP_TIMEOUT     100000          // Microseconds
+
+
+// Trampoline code (smp_trampoline_*.asm)
+extern char smp_trampoline_start[];
+extern char smp_trampoline_data[];
+extern char smp_trampoline_end[];
+
+
+// Parameters passed to the application processors through the trampoline
+typedef struct
+{
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} smp_trampoline_data_t;
+
+
+
+static inline uintptr_t x86_get_cr3()
+{
+    uintptr_t value;
+    asm volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+
+
+// Flush all TLB entries of this CPU. Heap pages are global (see vmm_page_fault_handler()):
+// with global pages enabled, a CR3 reload isn't enough and CR4.PGE is toggled instead.
+static inline void x86_flush_tlb()
+{
+    const uintptr_t cr4 = x86_get_cr4();
+
+    if (cr4 & X86_CR4_PGE)
+    {
+        x86_set_cr4(cr4 & ~X86_CR4_PGE);
+        x86_set_cr4(cr4);
+        return;
+    }
+
+    uintptr_t value;
+    asm volatile ("mov %%cr3, %0\n mov %0, %%cr3" : "=r"(value) : : "memory");
+}
+
+
+
+static volatile uint32_t smp_tlb_generation;    // Number of smp_flush_tlb() requests so far
+
+
+
+// Entry point of application processors (called from the trampoline)
+static void smp_ap_main(cpu_t* cpu)
+{
+    cpu_init_ap(cpu);
+    interrupt_init_ap();
+    apic_init_ap();
+    clockevent_init_ap();
+    thread_init_ap();
+
+    cpu->online = 1;
+
+    interrupt_enable();
+
+    thread_idle();
+}
+
+
+
+static int smp_reschedule_interrupt(interrupt_context_t* context)
+{
+    (void)context;
+
+    apic_eoi();
+
+    // Switch on the way out of the interrupt
+    cpu_get()->need_resched = 1;
+
+    return 1;
+}
+
+
+
+void smp_send_reschedule(cpu_t* cpu)
+{
+    apic_send_ipi(cpu->apic_id, APIC_RESCHEDULE_VECTOR);
+}
+
+
+
+// Carry out all smp_flush_tlb() requests made so far on this CPU
+static void smp_flush_local_tlb(cpu_t* cpu)
+{
+    // A flush interrupt between the read and the store would record a newer generation,
+    // which we'd then move back: a CPU waiting for it would spin forever.
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    // Read the generation first: mappings changed before it was incremented are covered
+    const uint32_t generation = smp_tlb_generation;
+
+    x86_flush_tlb();
+
+    if ((int32_t)(generation - cpu->tlb_generation) > 0)
+        cpu->tlb_generation = generation;
+
+    if (interruptsEnabled)
+        interrupt_enable();
+}
+
+
+
+static int smp_tlb_flush_interrupt(interrupt_context_t* context)
+{
+    (void)context;
+
+    smp_flush_local_tlb(cpu_get());
+
+    apic_eoi();
+
+    return 1;
+}
+
+
+
+void smp_flush_tlb()
+{
+    preempt_disable();
+
+    cpu_t* self = cpu_get();
+    const uint32_t generation = __sync_add_and_fetch(&smp_tlb_generation, 1);
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        cpu_t* cpu = &g_cpus[i];
+
+        if (cpu != self && cpu->online)
+            apic_send_ipi(cpu->apic_id, APIC_TLB_FLUSH_VECTOR);
+    }
+
+    smp_flush_local_tlb(self);
+
+    for (int i = 0; i != g_cpu_count; ++i)
+    {
+        cpu_t* cpu = &g_cpus[i];
+
+        while (cpu != self && cpu->online && (int32_t)(cpu->tlb_generation - generation) < 0)
+        {
+            // Another CPU might be waiting on us with interrupts disabled, serve its request here
+            if (self->tlb_generation != smp_tlb_generation)
+                smp_flush_local_tlb(self);
+
+            _mm_pause();
+        }
+    }
+
+    preempt_enable();
+}
+
+
+
+static int smp_start_ap(cpu_t* cpu, smp_trampoline_data_t* data)
+{
+    cpu->self = cpu;
+
+    // Stacks are pre-faulted, the trampoline can't handle page faults
+    cpu->stack = stack_alloc();
+
+    data->cr0 = x86_get_cr0() & ~X86_CR0_TS;  // FPU is usable until fpu_init_ap()
+    data->cr3 = x86_get_cr3();
+    data->cr4 = x86_get_cr4();
+    data->stack = (uintptr_t)(cpu->stack + STACK_SIZE);
+    data->entry = (uintptr_t)smp_ap_main;
+    data->cpu = (uintptr_t)cpu;
+
+    // INIT-SIPI-SIPI sequence (Intel MultiProcessor Specification, B.4)
+    apic_send_init(cpu->apic_id);
+    timer_delay(10000);
+
+    for (int attempt = 0; attempt != 2 && !cpu->online; ++attempt)
+    {
+        apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_ADDRESS);
+        timer_delay(200);
+    }
+
+    for (int wait = 0; wait < SMP_STARTUP_TIMEOUT && !cpu->online; wait += 100)
+    {
+        timer_delay(100);
+    }
+
+    return cpu->online ? 0 : -1;
+}
+
+
+
+void smp_init()
+{
+    printf("smp_init()\n");
+
+    // The local APIC was setup by clockevent_init()
+    if (!apic_available())
+    {
+        printf("    No local APIC, running with a single processor\n");
+        return;
+    }
+
+    if (acpi_init_tables() != 0)
+        return;
+
+    ACPI_TABLE_MADT* madt;
+    if (ACPI_FAILURE(AcpiGetTable(ACPI_SIG_MADT, 1, (ACPI_TABLE_HEADER**)&madt)))
+    {
+        printf("    No MADT, running with a single processor\n");
+        return;
+    }
+
+    char* begin = (char*)(madt + 1);
+    char* end = (char*)madt + madt->Header.Length;
+
+    g_cpus[0].apic_id = apic_id();
+
+    interrupt_register(APIC_RESCHEDULE_VECTOR, smp_reschedule_interrupt);
+    interrupt_register(APIC_TLB_FLUSH_VECTOR, smp_tlb_flush_interrupt);
+
+    // Install the trampoline in low memory
+    memcpy((void*)(ISA_IO_BASE + SMP_TRAMPOLINE_ADDRESS), smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    smp_trampoline_data_t* data = (smp_trampoline_data_t*)(ISA_IO_BASE + SMP_TRAMPOLINE_ADDRESS + (smp_trampoline_data - smp_trampoline_start));
+
+    // The trampoline runs at its physical address when it enables paging
+    vmm_map_low_memory();
+
+    // Start application processors one at a time
+    for (char* p = begin; p < end; p += ((ACPI_SUBTABLE_HEADER*)p)->Length)
+    {
+        ACPI_SUBTABLE_HEADER* header = (ACPI_SUBTABLE_HEADER*)p;
+        if (header->Type != ACPI_MADT_TYPE_LOCAL_APIC)
+            continue;
+
+        ACPI_MADT_LOCAL_APIC* lapic = (ACPI_MADT_LOCAL_APIC*)header;
+        if (!(lapic->LapicFlags & ACPI_MADT_ENABLED) || lapic->Id == g_cpus[0].apic_id)
+            continue;
+
+        if (g_cpu_count == MAX_CPUS)
+        {
+            printf("    Too many processors, ignoring APIC ID %d\n", lapic->Id);
+            continue;
+        }
+
+        cpu_t* cpu = &g_cpus[g_cpu_count];
+        cpu->id = g_cpu_count;
+        cpu->apic_id = lapic->Id;
+
+        if (smp_start_ap(cpu, data) == 0)
+        {
+            ++g_cpu_count;
+        }
+        else
+        {
+            printf("    Processor with APIC ID %d failed to start\n", lapic->Id);
+        }
+    }
+
+    vmm_unmap_low_memory();
+
+    printf("    %d processor(s) online\n", g_cpu_count);
+}
@@ -0,0 +1,159 @@
+; Copyright (c) 2015, Thierry Tremblay
+; All rights reserved.
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are met:
+;
+; * Redistributions of source code must retain the above copyright notice, this
+;   list of conditions and the following disclaimer.
+;
+; * Redistributions in binary form must reproduce the above copyright notice,
+;   this list of conditions and the following disclaimer in the documentation
+;   and/or other materials provided with the distribution.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+; AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+; IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+; DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+; FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+; DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+; SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+; OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+; OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+; The trampoline is copied to SMP_TRAMPOLINE_ADDRESS in low memory and executed by
+; application processors when they receive a STARTUP IPI. It brings the CPU from
+; real mode to long mode and jumps into the kernel.
+
+SMP_TRAMPOLINE_ADDRESS equ 0x8000
+
+%define TRAMPOLINE(x) (SMP_TRAMPOLINE_ADDRESS + (x) - smp_trampoline_start)
+
+GDT_TRAMPOLINE_CODE32 equ 0x08
+GDT_TRAMPOLINE_DATA   equ 0x10
+GDT_TRAMPOLINE_CODE64 equ 0x18
+
+MSR_EFER equ 0xC0000080
+
+global smp_trampoline_start
+global smp_trampoline_data
+global smp_trampoline_end
+
+
+section .text
+
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Real Mode Entry Point
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+[bits 16]
+align 16
+
+smp_trampoline_start:
+
+    cli
+    cld
+
+    xor ax, ax
+    mov ds, ax
+
+    ; Enter protected mode
+    lgdt [TRAMPOLINE(gdtr)]
+    mov eax, cr0
+    bts eax, 0
+    mov cr0, eax
+
+    jmp dword GDT_TRAMPOLINE_CODE32:TRAMPOLINE(protected_mode)
+
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Protected Mode
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+[bits 32]
+
+protected_mode:
+
+    mov eax, GDT_TRAMPOLINE_DATA
+    mov ds, eax
+    mov es, eax
+    mov ss, eax
+
+    ; Use the same paging setup as the boot processor (CR4 has PAE and SSE bits)
+    mov eax, [TRAMPOLINE(data_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMPOLINE(data_cr3)]
+    mov cr3, eax
+
+    ; Enable long mode
+    mov ecx, MSR_EFER
+    rdmsr
+    bts eax, 8
+    wrmsr
+
+    ; Enable paging and enter long mode (and whatever else the boot processor has in CR0)
+    mov eax, [TRAMPOLINE(data_cr0)]
+    mov cr0, eax
+
+    jmp GDT_TRAMPOLINE_CODE64:TRAMPOLINE(long_mode)
+
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Long Mode
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+[bits 64]
+
+long_mode:
+
+    ; Switch to the CPU's stack and jump to the kernel
+    mov rsp, [TRAMPOLINE(data_stack)]
+    mov rdi, [TRAMPOLINE(data_cpu)]
+    mov rax, [TRAMPOLINE(data_entry)]
+    call rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; GDT
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+align 16
+
+gdt:
+    dq 0                        ; Null Descriptor
+    dq 0x00CF9A000000FFFF       ; 0x08 - Code, 4 GB, 32 bits
+    dq 0x00CF92000000FFFF       ; 0x10 - Data, 4 GB, 32 bits
+    dq 0x00209A0000000000       ; 0x18 - Code, 64 bits
+
+gdtr:
+    dw gdtr - gdt - 1
+    dd TRAMPOLINE(gdt)
+
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Parameters (filled by smp.c, see smp_trampoline_data_t)
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+align 8
+
+smp_trampoline_data:
+data_cr0:   dq 0
+data_cr3:   dq 0
+data_cr4:   dq 0
+data_stack: dq 0
+data_entry: dq 0
+data_cpu:   dq 0
+
+smp_trampoline_end:
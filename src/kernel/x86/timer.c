@@ -25,10 +25,12 @@
 */
 
 #include <kernel/timer.h>
+#include <kernel/x86/cpu.h>
 #include <kernel/x86/io.h>
-#include <kernel/x86/pic.h>
+#include <kernel/x86/timer.h>
 
 #include <stdio.h>
+#include <xmmintrin.h>
 
 
 //todo: move PIT stuff to a pit.c file
@@ -37,26 +39,114 @@
 #define PIT_CHANNEL2 0x42
 #define PIT_COMMAND 0x43
 
-#define PIT_INIT_TIMER 0x36     // Channel 0, mode 3, square-wave
+#define PIT_INIT_ONESHOT 0x30   // Channel 0, mode 0, interrupt on terminal count
+#define PIT_INIT_DELAY 0xB0     // Channel 2, mode 0, interrupt on terminal count
+
+#define PIT_CONTROL 0x61        // Channel 2 gate (bit 0), speaker (bit 1) and output (bit 5)
 
 #define PIT_FREQUENCY 1193182   // Really, it is 1193181.6666... Hz
 
+#define TIMER_SHIFT 24          // Fixed point shift for TSC <-> nanoseconds conversions
+
+
+static uint64_t tsc_base;           // TSC value at timer_init() time
+static uint64_t tsc_frequency;      // TSC ticks per second
+static uint32_t tsc_to_ns_mult;     // Nanoseconds per TSC tick << TIMER_SHIFT
+static uint32_t ns_to_tsc_mult;     // TSC ticks per nanosecond << TIMER_SHIFT
 
 
-void timer_init(int frequency, interrupt_handler_t callback)
+
+// Compute (a * b) >> TIMER_SHIFT without overflowing 64 bits
+static inline uint64_t timer_mul_shift(uint64_t a, uint32_t b)
 {
-    interrupt_register(32, callback); //todo: use PIC_IRQ_OFFSET constant!
+    const uint64_t high = (a >> 32) * b;
+    const uint64_t low = (a & 0xFFFFFFFF) * b;
+    return (high << (32 - TIMER_SHIFT)) + (low >> TIMER_SHIFT);
+}
 
-    uint32_t divisor = (frequency > 0) ? PIT_FREQUENCY / frequency : 0xFFFF;
 
-    // Valid range for divisor is 16 bits (0 is interpreted as 65536)
-    if (divisor > 0xFFFF) divisor = 0;
-    else if (divisor < 1) divisor = 1;
 
-    io_out_8(PIT_COMMAND, PIT_INIT_TIMER);
+void timer_init()
+{
+    // Calibrate the TSC against the PIT
+    const uint64_t start = x86_rdtsc();
+    timer_delay(50000);
+    const uint64_t end = x86_rdtsc();
+
+    tsc_frequency = (end - start) * 20;
+    tsc_to_ns_mult = (1000000000ull << TIMER_SHIFT) / tsc_frequency;
+    ns_to_tsc_mult = (tsc_frequency << TIMER_SHIFT) / 1000000000ull;
+    tsc_base = end;
+
+    printf("timer_init(): TSC frequency is %lu kHz\n", (unsigned long)(tsc_frequency / 1000));
+}
 
-    io_out_8(PIT_CHANNEL0, divisor & 0xFF);
-    io_out_8(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
 
-    pic_enable_irq(0);
+
+uint64_t timer_now()
+{
+    // The TSC is assumed to be invariant and synchronized between CPUs
+    return timer_mul_shift(x86_rdtsc() - tsc_base, tsc_to_ns_mult);
+}
+
+
+
+uint64_t tsc_from_ns(uint64_t ns)
+{
+    return tsc_base + timer_mul_shift(ns, ns_to_tsc_mult);
+}
+
+
+
+uint64_t ns_from_tsc_cycles(uint64_t cycles)
+{
+    return timer_mul_shift(cycles, tsc_to_ns_mult);
+}
+
+
+
+void pit_set_oneshot(uint64_t delay)
+{
+    // Channel 0 is a 16 bits counter, that's about 54 ms max. The interrupt handler
+    // will find nothing to do and reprogram the PIT if the delay is longer.
+    if (delay > 100000000) delay = 100000000;
+
+    uint64_t count = delay * PIT_FREQUENCY / 1000000000ull;
+    if (count < 1) count = 1;
+    else if (count > 0xFFFF) count = 0xFFFF;
+
+    io_out_8(PIT_COMMAND, PIT_INIT_ONESHOT);
+    io_out_8(PIT_CHANNEL0, count & 0xFF);
+    io_out_8(PIT_CHANNEL0, (count >> 8) & 0xFF);
+}
+
+
+
+void timer_delay(unsigned microseconds)
+{
+    while (microseconds > 0)
+    {
+        // Channel 2 is a 16 bits counter, that's about 54 ms max per round
+        unsigned delay = microseconds > 50000 ? 50000 : microseconds;
+        uint32_t count = (uint64_t)PIT_FREQUENCY * delay / 1000000;
+        if (count < 1) count = 1;
+
+        // Gate high, speaker off
+        uint8_t control = io_in_8(PIT_CONTROL);
+        io_out_8(PIT_CONTROL, (control & ~0x02) | 0x01);
+
+        io_out_8(PIT_COMMAND, PIT_INIT_DELAY);
+        io_out_8(PIT_CHANNEL2, count & 0xFF);
+        io_out_8(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+        // Wait for the output to go high (terminal count)
+        while (!(io_in_8(PIT_CONTROL) & 0x20))
+        {
+            _mm_pause();
+        }
+
+        io_out_8(PIT_CONTROL, control);
+
+        microseconds -= delay;
+    }
 }
@@ -25,8 +25,11 @@
 */
 
 #include <kernel/vmm.h>
+#include <kernel/cpu.h>
 #include <kernel/kernel.h>
 #include <kernel/interrupt.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
 
 #include <assert.h>
 
@@ -42,7 +45,7 @@
 
     0xE0000000 - 0xEFFFFFFF     Heap space (vmm_alloc)
 
-    0xFF000000 - 0xFF7FFFFF     Free memory pages stack (8 MB)
+    0xFF000000 - 0xFF7FFFFF     Physical memory buddy bitmaps (8 MB)
 
     Non-PAE:
     0xFFC00000 - 0xFFFFEFFF     Page Mapping Level 1 (Page Tables)
@@ -56,9 +59,7 @@
 
     0x00000000 00000000 - 0x00007FFF FFFFFFFF   User space
 
-    0xFFFF8000 00000000 - 0xFFFEFFFF FFFFFFFF   Unused kernel space
-
-    0xFFFFF000 00000000 - 0xFFFFF07F FFFFFFFF   Free memory pages stack (512 GB)
+    0xFFFF8000 00000000 - 0xFFFFBFFF FFFFFFFF   Direct map of RAM (64 TB)
 
     0xFFFFFF00 00000000 - 0xFFFFFF7F FFFFFFFF   Page Mapping Level 1 (Page Tables)
     0xFFFFFF7F 80000000 - 0xFFFFFF7F BFFFFFFF   Page Mapping Level 2 (Page Directories)
@@ -126,6 +127,64 @@ static inline void vmm_invalidate(void* virtualAddress)
 
 static int vmm_page_fault_handler(interrupt_context_t* context);
 
+static void vmm_split_large_page(uintptr_t addr);
+
+
+static int vmm_large_pages;     // Page directories can map large pages (see VMM_LARGE_PAGE_SHIFT)
+
+#if defined(__x86_64__)
+static int vmm_huge_pages;      // PDPTs can map 1 GB pages
+#endif
+
+
+
+static void vmm_init_large_pages()
+{
+#if defined(__i386__) && !defined(KIZNIX_PAE)
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (edx & X86_CPUID1_EDX_PSE)
+    {
+        // Application processors copy CR4 from the boot processor
+        x86_set_cr4(x86_get_cr4() | X86_CR4_PSE);
+        vmm_large_pages = 1;
+    }
+#else
+    // Large pages are always available with PAE and in long mode
+    vmm_large_pages = 1;
+#endif
+
+#if defined(__x86_64__)
+    uint32_t eax, ebx, ecx, edx;
+    x86_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+
+    if (eax >= 0x80000001)
+    {
+        x86_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        vmm_huge_pages = (edx & X86_CPUID81_EDX_PDPE1GB) != 0;
+    }
+#endif
+}
+
+
+
+// Allocate a page table, store it in 'entry' and clear it through its recursive mapping 'table'
+static void vmm_install_table(physaddr_t* entry, physaddr_t flags, void* table)
+{
+    physaddr_t page = pmm_take_zeroed_page();
+    const int zeroed = page != 0;
+
+    if (!zeroed)
+        page = pmm_alloc_page();
+
+    *entry = page | flags;
+    vmm_invalidate(table);
+
+    if (!zeroed)
+        memset(table, 0, PAGE_SIZE);
+}
+
 
 
 #if defined(KIZNIX_PAE)
@@ -155,6 +214,27 @@ static physaddr_t* const vmm_page_mappings_1 = (physaddr_t*)0xFF800000;
 static uintptr_t page_table_start = 0xFF800000;
 static uintptr_t page_table_end   = 0xFFFFFFFF;
 
+#define VMM_LARGE_PAGE_SHIFT 21     // 2 MB
+
+
+
+// Page directory entry for 'addr'. If its page directory doesn't exist, it is created
+// when 'create' is set, otherwise NULL is returned.
+static physaddr_t* vmm_directory_entry(uintptr_t addr, int create)
+{
+    const long i3 = (addr >> 30) & 0x3;
+
+    if (!(vmm_page_mappings_3[i3] & PAGE_PRESENT))
+    {
+        if (!create)
+            return NULL;
+
+        vmm_install_table(&vmm_page_mappings_3[i3], PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_2) + (i3 << 12));
+    }
+
+    return &vmm_page_mappings_2[(addr >> 21) & 0x7FF];
+}
+
 
 
 void vmm_init()
@@ -186,6 +266,8 @@ void vmm_init()
     vmm_unmap_page(_BootPageDirectory);
     vmm_unmap_page(_BootPageTables + 512);
 
+    vmm_init_large_pages();
+
     // Page fault handler
     interrupt_register(14, vmm_page_fault_handler);
 }
@@ -205,26 +287,18 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
     if (!(vmm_page_mappings_3[i3] & PAGE_PRESENT))
     {
         //todo: must handle out of memory - everywhere we call pmm_alloc_page()!
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_3[i3] = page | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_2) + (i3 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_3[i3], PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_2) + (i3 << 12));
 
 //TODO: this new page directory needs to be "recurse-mapped" in PD #3 [1FC-1FE]
     }
 
     if (!(vmm_page_mappings_2[i2] & PAGE_PRESENT))
     {
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_2[i2] = page | PAGE_WRITE | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_2[i2], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12));
     }
 
     //todo: this should just be an assert
-    if (vmm_page_mappings_1[i1] & PAGE_PRESENT)
+    if ((vmm_page_mappings_2[i2] & PAGE_LARGE) || (vmm_page_mappings_1[i1] & PAGE_PRESENT))
     {
         fatal("vmm_map_page() - there is already something there!");
     }
@@ -240,11 +314,32 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
 void vmm_unmap_page(void* virtualAddress)
 {
     uintptr_t addr = (uintptr_t)virtualAddress;
+
+    // The page table of a large page only exists once it is demoted
+    vmm_split_large_page(addr);
+
     vmm_page_mappings_1[(addr >> 12) & 0xFFFFF] = 0;
 }
 
 
 
+void vmm_map_low_memory()
+{
+    // The kernel's page directory still maps the first 4 MB at its start
+    vmm_page_mappings_3[0] = vmm_page_mappings_3[3];
+    x86_set_cr3(x86_get_cr3());
+}
+
+
+
+void vmm_unmap_low_memory()
+{
+    vmm_page_mappings_3[0] = 0;
+    x86_set_cr3(x86_get_cr3());
+}
+
+
+
 #elif defined(__i386__)
 
 /*
@@ -268,6 +363,18 @@ static physaddr_t* const vmm_page_mappings_1 = (physaddr_t*)0xFFC00000;
 static uintptr_t page_table_start = 0xFFC00000;
 static uintptr_t page_table_end   = 0xFFFFFFFF;
 
+#define VMM_LARGE_PAGE_SHIFT 22     // 4 MB (PSE)
+
+
+
+// Page directory entry for 'addr' (the page directory always exists)
+static physaddr_t* vmm_directory_entry(uintptr_t addr, int create)
+{
+    (void)create;
+
+    return &vmm_page_mappings_2[(addr >> 22) & 0x3FF];
+}
+
 
 
 void vmm_init()
@@ -290,6 +397,8 @@ void vmm_init()
     vmm_unmap_page(_BootPageDirectory);
     vmm_unmap_page(_BootPageTable);
 
+    vmm_init_large_pages();
+
     // Page fault handler
     interrupt_register(14, vmm_page_fault_handler);
 }
@@ -307,15 +416,11 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
 
     if (!(vmm_page_mappings_2[i2] & PAGE_PRESENT))
     {
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_2[i2] = page | PAGE_WRITE | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_2[i2], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12));
     }
 
     //todo: this should just be an assert
-    if (vmm_page_mappings_1[i1] & PAGE_PRESENT)
+    if ((vmm_page_mappings_2[i2] & PAGE_LARGE) || (vmm_page_mappings_1[i1] & PAGE_PRESENT))
     {
         fatal("vmm_map_page() - there is already something there!");
     }
@@ -331,12 +436,33 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
 void vmm_unmap_page(void* virtualAddress)
 {
     uintptr_t addr = (uintptr_t)virtualAddress;
+
+    // The page table of a large page only exists once it is demoted
+    vmm_split_large_page(addr);
+
     const int i1 = (addr >> 12) & 0xFFFFF;
     vmm_page_mappings_1[i1] = 0;
     vmm_invalidate(virtualAddress);
 }
 
 
+
+void vmm_map_low_memory()
+{
+    // Reuse the kernel's page table for the first 4 MB
+    vmm_page_mappings_2[0] = vmm_page_mappings_2[KERNEL_VIRTUAL_BASE >> 22];
+    x86_set_cr3(x86_get_cr3());
+}
+
+
+
+void vmm_unmap_low_memory()
+{
+    vmm_page_mappings_2[0] = 0;
+    x86_set_cr3(x86_get_cr3());
+}
+
+
 #elif defined(__x86_64__)
 
 /*
@@ -368,6 +494,50 @@ static physaddr_t* const vmm_page_mappings_1 = (physaddr_t*)0xFFFFFF0000000000ul
 static uintptr_t page_table_start = 0xFFFFFF0000000000ull;
 static uintptr_t page_table_end   = 0xFFFFFF7FFFFFFFFFull;
 
+#define VMM_LARGE_PAGE_SHIFT 21     // 2 MB
+#define VMM_HUGE_PAGE_SHIFT  30     // 1 GB
+
+
+
+// PDPT entry for 'addr'. If its PDPT doesn't exist, it is created when 'create' is set,
+// otherwise NULL is returned.
+static physaddr_t* vmm_pdpt_entry(uintptr_t addr, int create)
+{
+    const long i4 = (addr >> 39) & 0x1FF;
+
+    if (!(vmm_page_mappings_4[i4] & PAGE_PRESENT))
+    {
+        if (!create)
+            return NULL;
+
+        vmm_install_table(&vmm_page_mappings_4[i4], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_3) + (i4 << 12));
+    }
+
+    return &vmm_page_mappings_3[(addr >> 30) & 0x3FFFF];
+}
+
+
+
+// Page directory entry for 'addr'. Missing tables are created when 'create' is set,
+// otherwise NULL is returned. NULL is also returned if 'addr' is inside a 1 GB page.
+static physaddr_t* vmm_directory_entry(uintptr_t addr, int create)
+{
+    physaddr_t* pdpte = vmm_pdpt_entry(addr, create);
+
+    if (!pdpte || (*pdpte & PAGE_LARGE))
+        return NULL;
+
+    if (!(*pdpte & PAGE_PRESENT))
+    {
+        if (!create)
+            return NULL;
+
+        vmm_install_table(pdpte, PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_2) + ((pdpte - vmm_page_mappings_3) << 12));
+    }
+
+    return &vmm_page_mappings_2[(addr >> 21) & 0x7FFFFFF];
+}
+
 
 static inline void vmm_set_page_entry(uintptr_t address, uintptr_t flags)
 {
@@ -408,6 +578,8 @@ void vmm_init()
     vmm_unmap_page(_BootPageTables);
     vmm_unmap_page(_BootPageTables + 512);
 
+    vmm_init_large_pages();
+
     // Page fault handler
     interrupt_register(14, vmm_page_fault_handler);
 }
@@ -427,33 +599,26 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
 
     if (!(vmm_page_mappings_4[i4] & PAGE_PRESENT))
     {
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_4[i4] = page | PAGE_WRITE | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_3) + (i4 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_4[i4], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_3) + (i4 << 12));
     }
 
     if (!(vmm_page_mappings_3[i3] & PAGE_PRESENT))
     {
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_3[i3] = page | PAGE_WRITE | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_2) + (i3 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_3[i3], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_2) + (i3 << 12));
+    }
+
+    if (vmm_page_mappings_3[i3] & PAGE_LARGE)
+    {
+        fatal("vmm_map_page() - there is already something there!");
     }
 
     if (!(vmm_page_mappings_2[i2] & PAGE_PRESENT))
     {
-        physaddr_t page = pmm_alloc_page();
-        vmm_page_mappings_2[i2] = page | PAGE_WRITE | PAGE_PRESENT;
-        void* p = (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12);
-        vmm_invalidate(p);
-        memset(p, 0, PAGE_SIZE);
+        vmm_install_table(&vmm_page_mappings_2[i2], PAGE_WRITE | PAGE_PRESENT, (void*)((uintptr_t)vmm_page_mappings_1) + (i2 << 12));
     }
 
     //todo: this should just be an assert
-    if (vmm_page_mappings_1[i1] & PAGE_PRESENT)
+    if ((vmm_page_mappings_2[i2] & PAGE_LARGE) || (vmm_page_mappings_1[i1] & PAGE_PRESENT))
     {
         fatal("vmm_map_page() - there is already something there!");
     }
@@ -469,15 +634,338 @@ int vmm_map_page(physaddr_t physicalAddress, void* virtualAddress)
 void vmm_unmap_page(void* virtualAddress)
 {
     uintptr_t addr = (uintptr_t)virtualAddress;
+
+    // The page table of a large page only exists once it is demoted
+    vmm_split_large_page(addr);
+
     vmm_page_mappings_1[(addr >> 12) & 0xFFFFFFFFFull] = 0;
 }
 
 
+
+void vmm_map_low_memory()
+{
+    // Reuse the kernel's PDPT and page directory for the first 4 MB
+    vmm_page_mappings_4[0] = vmm_page_mappings_4[511];
+    vmm_page_mappings_3[511 * 512 + 0] = vmm_page_mappings_3[511 * 512 + 511];
+    x86_set_cr3(x86_get_cr3());
+}
+
+
+
+void vmm_unmap_low_memory()
+{
+    vmm_page_mappings_3[511 * 512 + 0] = 0;
+    vmm_page_mappings_4[0] = 0;
+    x86_set_cr3(x86_get_cr3());
+}
+
+
+#endif
+
+
+
+#define VMM_LARGE_PAGE_SIZE     ((uintptr_t)1 << VMM_LARGE_PAGE_SHIFT)
+#define VMM_LARGE_PAGE_ORDER    (VMM_LARGE_PAGE_SHIFT - 12)
+
+
+
+// Entry mapping 'addr' with a large (or 1 GB) page, NULL if 'addr' isn't in one
+static physaddr_t* vmm_large_entry(uintptr_t addr, int* shift)
+{
+#if defined(__x86_64__)
+    physaddr_t* pdpte = vmm_pdpt_entry(addr, 0);
+
+    if (pdpte && (*pdpte & PAGE_PRESENT) && (*pdpte & PAGE_LARGE))
+    {
+        *shift = VMM_HUGE_PAGE_SHIFT;
+        return pdpte;
+    }
+#endif
+
+    physaddr_t* pde = vmm_directory_entry(addr, 0);
+
+    if (pde && (*pde & PAGE_PRESENT) && (*pde & PAGE_LARGE))
+    {
+        *shift = VMM_LARGE_PAGE_SHIFT;
+        return pde;
+    }
+
+    return NULL;
+}
+
+
+
+// Replace the large page mapped by 'entry' with a table mapping the same memory with
+// pages of the next size down ('addr' is any address inside the large page)
+static void vmm_split_large_entry(physaddr_t* entry, int shift, uintptr_t addr)
+{
+    physaddr_t* table;
+    int child_shift;
+
+#if defined(__x86_64__)
+    if (shift == VMM_HUGE_PAGE_SHIFT)
+    {
+        table = (physaddr_t*)((uintptr_t)vmm_page_mappings_2 + ((entry - vmm_page_mappings_3) << 12));
+        child_shift = VMM_LARGE_PAGE_SHIFT;
+    }
+    else
+#endif
+    {
+        table = (physaddr_t*)((uintptr_t)vmm_page_mappings_1 + ((entry - vmm_page_mappings_2) << 12));
+        child_shift = 12;
+    }
+
+    const physaddr_t old = *entry;
+    const physaddr_t base = old & ~(((physaddr_t)1 << shift) - 1);
+
+    // Keep the protection bits. PAGE_LARGE is the PAT bit in a page table entry.
+    physaddr_t flags = old & (PAGE_SIZE - 1) & ~(PAGE_LARGE | PAGE_ACCESSED | PAGE_DIRTY);
+
+    if (child_shift != 12)
+        flags |= PAGE_LARGE;
+
+    const physaddr_t page = pmm_alloc_page();
+
+#if defined(__x86_64__)
+    // Fill the table through the direct map before installing it, the range stays mapped
+    physaddr_t* fill = phys_to_virt(page);
+
+    for (int i = 0; i != (1 << (shift - child_shift)); ++i)
+    {
+        fill[i] = (base + ((physaddr_t)i << child_shift)) | flags;
+    }
+
+    *entry = page | PAGE_WRITE | PAGE_PRESENT;
+    vmm_invalidate(table);
+
+    // Invalidating any address of a large page drops its TLB entry
+    vmm_invalidate((void*)addr);
+#else
+    // The range is briefly unmapped while the table is filled, it belongs to a single
+    // vmm_map() / vmm_alloc() region and only its owner can be unmapping it.
+    const int interruptsEnabled = interrupt_enabled();
+    interrupt_disable();
+
+    *entry = page | PAGE_WRITE | PAGE_PRESENT;
+    vmm_invalidate(table);
+
+    for (int i = 0; i != (1 << (shift - child_shift)); ++i)
+    {
+        table[i] = (base + ((physaddr_t)i << child_shift)) | flags;
+    }
+
+    // Invalidating any address of a large page drops its TLB entry
+    vmm_invalidate((void*)addr);
+
+    if (interruptsEnabled)
+        interrupt_enable();
+#endif
+}
+
+
+
+// Demote the large page containing 'addr' (if any) down to 4 KB pages
+static void vmm_split_large_page(uintptr_t addr)
+{
+    physaddr_t* entry;
+    int shift;
+
+    while ((entry = vmm_large_entry(addr, &shift)) != NULL)
+    {
+        vmm_split_large_entry(entry, shift, addr);
+    }
+}
+
+
+
+// Largest page size (as a shift) that can map 'physicalAddress' at 'addr' with 'length' bytes left, 0 if none
+static int vmm_large_page_shift(physaddr_t physicalAddress, uintptr_t addr, physaddr_t length)
+{
+#if defined(__x86_64__)
+    const uintptr_t huge = (uintptr_t)1 << VMM_HUGE_PAGE_SHIFT;
+
+    if (vmm_huge_pages && length >= huge && ((physicalAddress | addr) & (huge - 1)) == 0)
+        return VMM_HUGE_PAGE_SHIFT;
+#endif
+
+    if (vmm_large_pages && length >= VMM_LARGE_PAGE_SIZE && ((physicalAddress | addr) & (VMM_LARGE_PAGE_SIZE - 1)) == 0)
+        return VMM_LARGE_PAGE_SHIFT;
+
+    return 0;
+}
+
+
+
+// Map a large page, both addresses are aligned on its size. Returns 0 if a page table is
+// already in the way, the caller then maps 4 KB pages. 'flags' adds caching bits.
+static int vmm_map_large_page(physaddr_t physicalAddress, uintptr_t addr, int shift, physaddr_t flags)
+{
+    physaddr_t* entry;
+
+#if defined(__x86_64__)
+    if (shift == VMM_HUGE_PAGE_SHIFT)
+        entry = vmm_pdpt_entry(addr, 1);
+    else
+#else
+    (void)shift;
+#endif
+        entry = vmm_directory_entry(addr, 1);
+
+    if (!entry || (*entry & PAGE_PRESENT))
+        return 0;
+
+    *entry = physicalAddress | flags | PAGE_LARGE | PAGE_WRITE | PAGE_PRESENT;
+    vmm_invalidate((void*)addr);
+
+    return 1;
+}
+
+
+
+#if defined(__x86_64__)
+
+#define VMM_DIRECT_MAP_RANGES 256  // As many as the boot memory map holds
+#define VMM_FIRMWARE_RANGES 64     // As many as the boot firmware map holds
+
+typedef struct
+{
+    physaddr_t  start;
+    physaddr_t  end;
+} vmm_direct_range_t;
+
+static vmm_direct_range_t vmm_direct_map[VMM_DIRECT_MAP_RANGES];  // RAM in the direct map
+static int vmm_direct_map_count;
+static physaddr_t vmm_direct_map_size;
+
+static vmm_direct_range_t vmm_firmware_map[VMM_FIRMWARE_RANGES];  // ACPI tables and NVS
+static int vmm_firmware_map_count;
+
+
+
+void vmm_init_direct_map(physaddr_t start, physaddr_t end)
+{
+    start = PAGE_ALIGN_UP(start);
+    end = PAGE_ALIGN_DOWN(end);
+
+    if (end > VMM_DIRECT_MAP_SIZE)
+        end = VMM_DIRECT_MAP_SIZE;
+
+    if (start >= end)
+        return;
+
+    // Large pages only where they hold nothing but RAM, 4 KB pages at the edges
+    for (physaddr_t page = start; page != end; )
+    {
+        const uintptr_t addr = VMM_DIRECT_MAP_BASE + page;
+        const int shift = vmm_large_page_shift(page, addr, end - page);
+
+        if (shift && vmm_map_large_page(page, addr, shift, 0))
+        {
+            page += (physaddr_t)1 << shift;
+            continue;
+        }
+
+        vmm_map_page(page, (void*)addr);
+        page += PAGE_SIZE;
+    }
+
+    vmm_direct_map_size += end - start;
+
+    // Merge with an adjacent range, a vmm_map() request can then span both
+    for (int i = 0; i != vmm_direct_map_count; ++i)
+    {
+        if (vmm_direct_map[i].end == start)
+        {
+            vmm_direct_map[i].end = end;
+            return;
+        }
+
+        if (vmm_direct_map[i].start == end)
+        {
+            vmm_direct_map[i].start = start;
+            return;
+        }
+    }
+
+    if (vmm_direct_map_count == VMM_DIRECT_MAP_RANGES)
+    {
+        fatal("vmm_init_direct_map() - too many ranges");
+    }
+
+    vmm_direct_map[vmm_direct_map_count].start = start;
+    vmm_direct_map[vmm_direct_map_count].end = end;
+    ++vmm_direct_map_count;
+}
+
+
+
+void vmm_init_firmware_range(physaddr_t start, physaddr_t end)
+{
+    if (start >= end || vmm_firmware_map_count == VMM_FIRMWARE_RANGES)
+        return;
+
+    vmm_firmware_map[vmm_firmware_map_count].start = start;
+    vmm_firmware_map[vmm_firmware_map_count].end = end;
+    ++vmm_firmware_map_count;
+}
+
+
+
+// Is the physical range [start, end) entirely in one of 'ranges'?
+static int vmm_in_ranges(const vmm_direct_range_t* ranges, int count, physaddr_t start, physaddr_t end)
+{
+    for (int i = 0; i != count; ++i)
+    {
+        if (start >= ranges[i].start && end <= ranges[i].end)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+
+// Caching for a vmm_map() range outside the direct map. Firmware memory (ACPI tables and
+// the BIOS area, also mapped at ISA_IO_BASE) is write-back like RAM. Device memory gets
+// UC- rather than UC: MTRRs can still make a framebuffer write-combining.
+static physaddr_t vmm_cache_flags(physaddr_t start, physaddr_t end)
+{
+    if (end <= 0x100000 || vmm_in_ranges(vmm_firmware_map, vmm_firmware_map_count, start, end))
+        return 0;
+
+    return PAGE_CACHE_DISABLE;
+}
+
+
+
+void vmm_report_direct_map()
+{
+    printf("Direct map   : %lu MB in %d ranges (%s pages)\n", (unsigned long)(vmm_direct_map_size >> 20),
+        vmm_direct_map_count, vmm_huge_pages ? "1 GB" : "2 MB");
+}
+
 #endif
 
 
 
-//todo: total hack for now, implement proper virtual space allocation
+/*
+    Kernel heap (vmm_alloc(), vmm_map())
+
+    Segregated fit: free ranges of heap pages are kept in VMM_HEAP_CLASSES lists by size,
+    list i holds ranges of 2^i to 2^(i+1)-1 pages. Any range in a higher class than the
+    request fits, so allocation rarely searches. The first and last page of a free range
+    carry a boundary tag (its size): a freed range finds free neighbours in O(1) and merges
+    with them. Allocated ranges aren't tracked at all, any page aligned part of an
+    allocation can be freed (munmap() needs this).
+
+    The tags and list links are arrays indexed by heap page. They sit at the start of the
+    heap and are backed on first use like vmm_alloc() memory.
+
+    Quantum caches keep freed ranges of 1 to VMM_QCACHE_PAGES pages: small allocations
+    are the most common, they reuse a range of the same size without touching the lists.
+*/
+
 #if defined(__i386__)
 #define KERNEL_HEAP_BEGIN   0xE0000000
 #define KERNEL_HEAP_END     0xF0000000
@@ -486,7 +974,333 @@ void vmm_unmap_page(void* virtualAddress)
 #define KERNEL_HEAP_END     0xFFFFFFFFF0000000ull
 #endif
 
-static uintptr_t next_alloc = KERNEL_HEAP_BEGIN;
+#define VMM_HEAP_PAGES      ((KERNEL_HEAP_END - KERNEL_HEAP_BEGIN) >> 12)
+#define VMM_HEAP_CLASSES    17              // Enough for VMM_HEAP_PAGES (2^16)
+#define VMM_HEAP_FREE       0x80000000u     // Boundary tag flag: page starts or ends a free range
+
+#define VMM_QCACHE_PAGES    8               // Largest range kept in a quantum cache
+#define VMM_QCACHE_SIZE     16              // Ranges kept for each size
+
+#define VMM_FREE_BATCH      64              // Physical pages freed per TLB flush
+
+
+typedef struct vmm_heap_meta
+{
+    uint32_t    tags[VMM_HEAP_PAGES];       // Boundary tags (size | VMM_HEAP_FREE) of free ranges
+    uint32_t    next[VMM_HEAP_PAGES];       // Next free range in the same class (0 if none)
+    uint32_t    prev[VMM_HEAP_PAGES];       // Previous free range in the same class (0 if none)
+} vmm_heap_meta_t;
+
+// Heap page 0 is part of the metadata, never free: it is the list terminator
+static vmm_heap_meta_t* const vmm_heap = (vmm_heap_meta_t*)KERNEL_HEAP_BEGIN;
+
+#define VMM_HEAP_META_PAGES (PAGE_ALIGN_UP(sizeof(vmm_heap_meta_t)) >> 12)
+
+static uint32_t vmm_heap_lists[VMM_HEAP_CLASSES];   // First free range of each class
+static uintptr_t vmm_heap_free_pages;               // Pages in the lists
+static DEFINE_SPINLOCK(vmm_heap_lock);              // Protects the lists and the metadata
+
+
+typedef struct vmm_qcache
+{
+    int         count;
+    uintptr_t   ranges[VMM_QCACHE_SIZE];
+} vmm_qcache_t;
+
+static vmm_qcache_t vmm_qcaches[VMM_QCACHE_PAGES];  // Free ranges of 'index + 1' pages
+static DEFINE_SPINLOCK(vmm_qcache_lock);            // Protects vmm_qcaches
+
+
+
+// Page table entry of 'addr' (through the recursive mapping)
+static inline physaddr_t* vmm_page_entry(uintptr_t addr)
+{
+#if defined(__i386__)
+    return &vmm_page_mappings_1[(addr >> 12) & 0xFFFFF];
+#elif defined(__x86_64__)
+    return &vmm_page_mappings_1[(addr >> 12) & 0xFFFFFFFFFull];
+#endif
+}
+
+
+
+// Backed on first write (see vmm_page_fault_handler())
+static inline void vmm_mark_allocated(uintptr_t addr)
+{
+    *vmm_page_entry(addr) = PAGE_ALLOCATED;
+    vmm_invalidate((void*)addr);
+}
+
+
+
+static inline int vmm_heap_class(uint32_t pages)
+{
+    return 31 - __builtin_clz(pages);
+}
+
+
+
+static void vmm_heap_insert(uint32_t page, uint32_t pages)
+{
+    const int class = vmm_heap_class(pages);
+
+    vmm_heap->tags[page] = pages | VMM_HEAP_FREE;
+    vmm_heap->tags[page + pages - 1] = pages | VMM_HEAP_FREE;
+
+    vmm_heap->next[page] = vmm_heap_lists[class];
+    vmm_heap->prev[page] = 0;
+
+    if (vmm_heap_lists[class])
+        vmm_heap->prev[vmm_heap_lists[class]] = page;
+
+    vmm_heap_lists[class] = page;
+    vmm_heap_free_pages += pages;
+}
+
+
+
+static void vmm_heap_remove(uint32_t page)
+{
+    const uint32_t pages = vmm_heap->tags[page] & ~VMM_HEAP_FREE;
+    const uint32_t next = vmm_heap->next[page];
+    const uint32_t prev = vmm_heap->prev[page];
+
+    if (prev)
+        vmm_heap->next[prev] = next;
+    else
+        vmm_heap_lists[vmm_heap_class(pages)] = next;
+
+    if (next)
+        vmm_heap->prev[next] = prev;
+
+    vmm_heap->tags[page] = 0;
+    vmm_heap->tags[page + pages - 1] = 0;
+
+    vmm_heap_free_pages -= pages;
+}
+
+
+
+// Reserve 'size' bytes of heap space starting at an address equal to 'offset' modulo 'align'.
+// Returns 0 when no free range is large enough.
+static uintptr_t vmm_alloc_range(uintptr_t size, uintptr_t align, uintptr_t offset)
+{
+    const uint32_t pages = size >> 12;
+
+    if (pages == 0 || pages >= VMM_HEAP_PAGES)
+        return 0;
+
+    if (align == PAGE_SIZE && pages <= VMM_QCACHE_PAGES)
+    {
+        uintptr_t begin = 0;
+
+        spin_lock(&vmm_qcache_lock);
+
+        vmm_qcache_t* qcache = &vmm_qcaches[pages - 1];
+        if (qcache->count)
+            begin = qcache->ranges[--qcache->count];
+
+        spin_unlock(&vmm_qcache_lock);
+
+        if (begin)
+            return begin;
+    }
+
+    spin_lock(&vmm_heap_lock);
+
+    for (int class = vmm_heap_class(pages); class != VMM_HEAP_CLASSES; ++class)
+    {
+        for (uint32_t page = vmm_heap_lists[class]; page; page = vmm_heap->next[page])
+        {
+            const uint32_t available = vmm_heap->tags[page] & ~VMM_HEAP_FREE;
+            const uintptr_t start = KERNEL_HEAP_BEGIN + ((uintptr_t)page << 12);
+            const uintptr_t begin = ((start - offset + align - 1) & ~(align - 1)) + offset;
+            const uint32_t skip = (begin - start) >> 12;
+
+            if (skip + pages > available)
+                continue;
+
+            // Give back what is left on both sides
+            vmm_heap_remove(page);
+
+            if (skip)
+                vmm_heap_insert(page, skip);
+
+            if (skip + pages != available)
+                vmm_heap_insert(page + skip + pages, available - skip - pages);
+
+            spin_unlock(&vmm_heap_lock);
+
+            return begin;
+        }
+    }
+
+    spin_unlock(&vmm_heap_lock);
+
+    return 0;
+}
+
+
+
+// Return heap space, the pages must be unmapped (and flushed from the TLBs)
+static void vmm_free_range(uintptr_t begin, uintptr_t size)
+{
+    uint32_t page = (begin - KERNEL_HEAP_BEGIN) >> 12;
+    uint32_t pages = size >> 12;
+
+    if (pages <= VMM_QCACHE_PAGES)
+    {
+        int cached = 0;
+
+        spin_lock(&vmm_qcache_lock);
+
+        vmm_qcache_t* qcache = &vmm_qcaches[pages - 1];
+        if (qcache->count != VMM_QCACHE_SIZE)
+        {
+            qcache->ranges[qcache->count++] = begin;
+            cached = 1;
+        }
+
+        spin_unlock(&vmm_qcache_lock);
+
+        if (cached)
+            return;
+    }
+
+    spin_lock(&vmm_heap_lock);
+
+    assert(!(vmm_heap->tags[page] & VMM_HEAP_FREE));
+
+    // Merge with the free ranges on both sides
+    const uint32_t before = vmm_heap->tags[page - 1];
+
+    if (before & VMM_HEAP_FREE)
+    {
+        const uint32_t length = before & ~VMM_HEAP_FREE;
+
+        vmm_heap_remove(page - length);
+        page -= length;
+        pages += length;
+    }
+
+    if (page + pages != VMM_HEAP_PAGES && (vmm_heap->tags[page + pages] & VMM_HEAP_FREE))
+    {
+        const uint32_t length = vmm_heap->tags[page + pages] & ~VMM_HEAP_FREE;
+
+        vmm_heap_remove(page + pages);
+        pages += length;
+    }
+
+    vmm_heap_insert(page, pages);
+
+    spin_unlock(&vmm_heap_lock);
+}
+
+
+
+static inline int vmm_in_heap(uintptr_t begin, uintptr_t end)
+{
+    return begin >= KERNEL_HEAP_BEGIN + (VMM_HEAP_META_PAGES << 12) && end <= KERNEL_HEAP_END && begin < end;
+}
+
+
+
+void vmm_init_heap()
+{
+    for (uintptr_t page = 0; page != VMM_HEAP_META_PAGES; ++page)
+    {
+        vmm_mark_allocated(KERNEL_HEAP_BEGIN + (page << 12));
+    }
+
+    vmm_heap_insert(VMM_HEAP_META_PAGES, VMM_HEAP_PAGES - VMM_HEAP_META_PAGES);
+}
+
+
+
+// Unmap a range, giving its physical pages back to the PMM if 'free_pages' is set.
+// Pages are only freed once no TLB can reference them anymore.
+static void vmm_unmap_range(uintptr_t begin, uintptr_t end, int free_pages)
+{
+    struct
+    {
+        physaddr_t  address;
+        int         order;
+    } batch[VMM_FREE_BATCH];
+
+    int count = 0;
+
+    for (uintptr_t p = begin; p != end; )
+    {
+        physaddr_t freed = 0;
+        int order = 0;
+        int shift;
+
+        physaddr_t* entry = vmm_large_entry(p, &shift);
+
+        if (entry)
+        {
+            const uintptr_t size = (uintptr_t)1 << shift;
+
+            if ((p & (size - 1)) != 0 || end - p < size)
+            {
+                // Partially unmapped, demote one level and look again
+                vmm_split_large_entry(entry, shift, p);
+                continue;
+            }
+
+            freed = *entry & ~(physaddr_t)(size - 1);
+            order = shift - 12;
+
+            *entry = 0;
+            p += size;
+        }
+        else
+        {
+            physaddr_t* pde = vmm_directory_entry(p, 0);
+
+            if (!pde || !(*pde & PAGE_PRESENT))
+            {
+                // No page table, skip to the next one
+                p = (p + VMM_LARGE_PAGE_SIZE) & ~(VMM_LARGE_PAGE_SIZE - 1);
+                if (p > end || p == 0)
+                    p = end;
+                continue;
+            }
+
+            physaddr_t* pte = vmm_page_entry(p);
+
+            if (*pte & PAGE_PRESENT)
+                freed = *pte & ~(physaddr_t)(PAGE_SIZE - 1);
+
+            *pte = 0;
+            p += PAGE_SIZE;
+        }
+
+        if (freed && free_pages)
+        {
+            batch[count].address = freed;
+            batch[count].order = order;
+
+            if (++count == VMM_FREE_BATCH)
+            {
+                smp_flush_tlb();
+
+                for (int i = 0; i != count; ++i)
+                    pmm_free_pages(batch[i].address, batch[i].order);
+
+                count = 0;
+            }
+        }
+    }
+
+    smp_flush_tlb();
+
+    for (int i = 0; i != count; ++i)
+    {
+        pmm_free_pages(batch[i].address, batch[i].order);
+    }
+}
+
 
 
 void* vmm_alloc(size_t length)
@@ -496,21 +1310,43 @@ void* vmm_alloc(size_t length)
         return NULL;
     }
 
-    uintptr_t begin = (uintptr_t)next_alloc;
-    uintptr_t end = begin + PAGE_ALIGN_UP(length);
+    const uintptr_t size = PAGE_ALIGN_UP(length);
+    uintptr_t begin = 0;
 
-    for (uintptr_t p = begin; p != end; p += PAGE_SIZE)
+    // Aligned on a large page if possible, so that large pages can back it
+    if (vmm_large_pages && size >= VMM_LARGE_PAGE_SIZE)
+        begin = vmm_alloc_range(size, VMM_LARGE_PAGE_SIZE, 0);
+
+    if (begin == 0)
+        begin = vmm_alloc_range(size, PAGE_SIZE, 0);
+
+    if (begin == 0)
     {
-#if defined(__i386__)
-        long i1 = (next_alloc >> 12) & 0xFFFFF;
-#elif defined(__x86_64__)
-        long i1 = (next_alloc >> 12) & 0xFFFFFFFFF;
-#endif
+        return NULL;
+    }
 
-        vmm_page_mappings_1[i1] = PAGE_ALLOCATED;
-        vmm_invalidate((void*)next_alloc);
+    const uintptr_t end = begin + size;
 
-        next_alloc += PAGE_SIZE;
+    for (uintptr_t p = begin; p != end; )
+    {
+        if (vmm_large_page_shift(0, p, end - p) != 0)
+        {
+            // Back whole large pages right away if physical memory is contiguous enough
+            physaddr_t page = pmm_alloc_pages(VMM_LARGE_PAGE_ORDER);
+
+            if (page && vmm_map_large_page(page, p, VMM_LARGE_PAGE_SHIFT, 0))
+            {
+                memset((void*)p, 0, VMM_LARGE_PAGE_SIZE);
+                p += VMM_LARGE_PAGE_SIZE;
+                continue;
+            }
+
+            if (page)
+                pmm_free_pages(page, VMM_LARGE_PAGE_ORDER);
+        }
+
+        vmm_mark_allocated(p);
+        p += PAGE_SIZE;
     }
 
     //todo: handle offset when 'address' isn't on a page boundary
@@ -520,29 +1356,93 @@ void* vmm_alloc(size_t length)
 
 
 
+int vmm_free(void* address, size_t length)
+{
+    const uintptr_t begin = (uintptr_t)address;
+    const uintptr_t end = PAGE_ALIGN_UP(begin + length);
+
+    if (!IS_PAGE_ALIGNED(begin) || !vmm_in_heap(begin, end))
+    {
+        return -1;
+    }
+
+    vmm_unmap_range(begin, end, 1);
+    vmm_free_range(begin, end - begin);
+
+    return 0;
+}
+
+
+
 void* vmm_map(physaddr_t physicalAddress, size_t length)
 {
     physaddr_t begin = PAGE_ALIGN_DOWN(physicalAddress);
     physaddr_t end = PAGE_ALIGN_UP(physicalAddress + length);
 
-    void* virtualAddress = vmm_alloc(end - begin);
+#if defined(__x86_64__)
+    // Nothing to map for RAM, vmm_unmap() leaves direct map addresses alone
+    if (vmm_in_ranges(vmm_direct_map, vmm_direct_map_count, begin, end))
+    {
+        return phys_to_virt(physicalAddress);
+    }
+
+    const physaddr_t flags = vmm_cache_flags(begin, end);
+#else
+    const physaddr_t flags = 0;
+#endif
 
-    if ((uintptr_t)virtualAddress + end - begin > KERNEL_HEAP_END)
+    // Give the virtual range the same offset as the physical one within a large page,
+    // settling for smaller alignments when the heap can't provide it
+    uintptr_t align = PAGE_SIZE;
+
+    if (vmm_large_pages && end - begin >= VMM_LARGE_PAGE_SIZE)
+        align = VMM_LARGE_PAGE_SIZE;
+
+#if defined(__x86_64__)
+    if (vmm_huge_pages && end - begin >= ((uintptr_t)1 << VMM_HUGE_PAGE_SHIFT))
+        align = (uintptr_t)1 << VMM_HUGE_PAGE_SHIFT;
+#endif
+
+    uintptr_t virtualAddress;
+
+    while ((virtualAddress = vmm_alloc_range(end - begin, align, begin & (align - 1))) == 0 && align != PAGE_SIZE)
+    {
+        align = align > VMM_LARGE_PAGE_SIZE ? VMM_LARGE_PAGE_SIZE : PAGE_SIZE;
+    }
+
+    if (virtualAddress == 0)
     {
         fatal("vmm_map() - out of virtual space");
     }
 
     //printf("vmm_map(%p, %p)\n", (void*)physicalAddress, (void*)length);
 
-    for (uintptr_t page = begin; page != end; page += PAGE_SIZE)
+    for (physaddr_t page = begin; page != end; )
     {
-        //printf("    %p --> %p\n", (void*)(uintptr_t)virtualAddress + (page - begin), (void*)page);
-        vmm_map_page(page, (void*)(uintptr_t)virtualAddress + (page - begin));
+        const uintptr_t addr = virtualAddress + (page - begin);
+        const int shift = vmm_large_page_shift(page, addr, end - page);
+
+        if (shift && vmm_map_large_page(page, addr, shift, flags))
+        {
+            page += (physaddr_t)1 << shift;
+            continue;
+        }
+
+        //printf("    %p --> %p\n", (void*)addr, (void*)page);
+        vmm_map_page(page, (void*)addr);
+
+        if (flags)
+        {
+            *vmm_page_entry(addr) |= flags;
+            vmm_invalidate((void*)addr);
+        }
+
+        page += PAGE_SIZE;
     }
 
     physaddr_t offset = physicalAddress - begin;
 
-    return (void*)(uintptr_t)virtualAddress + offset;
+    return (void*)virtualAddress + offset;
 }
 
 
@@ -554,10 +1454,20 @@ int vmm_unmap(void* address, size_t length)
 
     //printf("vmm_unmap(%p, %x) --> %p, %p\n", address, length, (void*)begin, (void*)(end-1));
 
-    for (uintptr_t p = begin; p != end; p += PAGE_SIZE)
+#if defined(__x86_64__)
+    // Returned by vmm_map() without a mapping of its own
+    if (begin >= VMM_DIRECT_MAP_BASE && end <= VMM_DIRECT_MAP_BASE + VMM_DIRECT_MAP_SIZE)
     {
-        //printf("    %p\n", (void*)p);
-        vmm_unmap_page((void*)p);
+        return 0;
+    }
+#endif
+
+    // The physical pages aren't ours (device memory, ACPI tables)
+    vmm_unmap_range(begin, end, 0);
+
+    if (vmm_in_heap(begin, end))
+    {
+        vmm_free_range(begin, end - begin);
     }
 
     return 0;
@@ -602,27 +1512,37 @@ static int vmm_page_fault_handler(interrupt_context_t* context)
     physaddr_t* pPageEntry = &vmm_page_mappings_1[index];
 
 
-    if (error == PAGE_FAULT_WRITE)
+    // Heap pages are backed on first use, reads included: the heap metadata is read before it
+    // is ever written (see vmm_free_range()). Page tables are only backed on write.
+    const int in_heap = address >= KERNEL_HEAP_BEGIN && address < KERNEL_HEAP_END;
+    const int allocated = (error == PAGE_FAULT_WRITE || (error == 0 && in_heap)) && (*pPageEntry & PAGE_ALLOCATED);
+
+    const int page_table = error == PAGE_FAULT_WRITE && address >= page_table_start && address <= page_table_end;
+
+    if (allocated || page_table)
     {
-        if ((*pPageEntry & PAGE_ALLOCATED) || (address >= page_table_start && address <= page_table_end))
-        {
-            physaddr_t page = pmm_alloc_page();
+        physaddr_t page = pmm_take_zeroed_page();
+        const int zeroed = page != 0;
 
-            //printf("Creating entry for %p at %p\n", (void*)address, pPageEntry);
+        if (!zeroed)
+            page = pmm_alloc_page();
 
-            physaddr_t entry = page | PAGE_WRITE | PAGE_PRESENT;
+        //printf("Creating entry for %p at %p\n", (void*)address, pPageEntry);
 
-            if (address >= KERNEL_SPACE)
-            {
-                entry |= PAGE_GLOBAL;
-            }
+        physaddr_t entry = page | PAGE_WRITE | PAGE_PRESENT;
+
+        if (address >= KERNEL_SPACE)
+        {
+            entry |= PAGE_GLOBAL;
+        }
 
-            *pPageEntry = entry;
-            vmm_invalidate((void*)address);
+        *pPageEntry = entry;
+        vmm_invalidate((void*)address);
+
+        if (!zeroed)
             memset((void*)address, 0, PAGE_SIZE);
 
-            return 1;
-        }
+        return 1;
     }
 
     fatal("UNHANDLED PAGE FAULT: %p", (void*)address);
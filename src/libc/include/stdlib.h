@@ -15,6 +15,7 @@ void* malloc(size_t);
 void free(void*);
 void* calloc(size_t, size_t);
 void* realloc(void*, size_t);
+int posix_memalign(void**, size_t, size_t);
 
 
 #ifdef __cplusplus
@@ -18,6 +18,7 @@ char* strcat(char*, const char*);
 //char* strncat(char*, const char*, size_t);
 
 char* strchr(const char* string, int character);
+int strcmp(const char* a, const char* b);
 size_t strlen(const char* string);
 
 #ifdef __cplusplus
@@ -51,9 +51,17 @@ void* mmap(void* address, size_t length, int prot, int flags, int fd, off_t offs
 
 int munmap(void* address, size_t length)
 {
-    (void)address;
-    (void)length;
+    if (length == 0 || !IS_PAGE_ALIGNED((uintptr_t)address))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (vmm_free(address, length) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
 
-    errno = EINVAL;
-    return -1;
+    return 0;
 }
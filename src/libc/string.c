@@ -88,6 +88,17 @@ char* strchr(const char* string, int character)
 }
 
 
+int strcmp(const char* a, const char* b)
+{
+    while (*a && *a == *b)
+    {
+        ++a;
+        ++b;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+
 size_t strlen(const char* string)
 {
     size_t result = 0;